@@ -0,0 +1,269 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/**
+*	Small lossless codec for the blocks in a saved simulation
+*
+*	a block is a short prefix followed by same sized values. each value is first xor-ed with the one before it,
+*	so smooth gradients and empty space leave mostly zero bytes, then the bytes are shuffled so the first byte
+*	of every value comes first, then every second byte and so on. this groups the zero bytes into long runs
+*	which a simple lz77 coder, using the same sequence format as lz4, squeezes well and decodes very quickly
+*
+*	blocks which don't get any smaller are stored as they are, a compressed size equal to the block size
+*	means the block wasn't compressed
+**/
+
+
+class BlockCodec
+{
+public:
+	/// <summary>
+	/// compresses a block into the output, which must be at least size bytes
+	/// </summary>
+	/// <param name="elementSize"> bytes in each value after the prefix </param>
+	/// <param name="prefixSize"> bytes at the start of the block which aren't values, copied without shuffling </param>
+	/// <param name="scratch"> size bytes used while compressing </param>
+	/// <returns> bytes written to the output </returns>
+	static int Compress(const char* input, int size, int elementSize, int prefixSize, char* output, char* scratch);
+
+	/// <summary>
+	/// decompresses a block of the given size
+	/// </summary>
+	/// <param name="scratch"> size bytes used while decompressing </param>
+	/// <returns> false if the compressed data is corrupt </returns>
+	static bool Decompress(const char* input, int compressedSize, int size, int elementSize, int prefixSize, char* output, char* scratch);
+
+private:
+	static const int MinMatch = 4;
+	static const int MaxOffset = 65535;
+	static const int HashBits = 12;
+
+	/// <summary>
+	/// xors each value with the one before it and groups the values' bytes by their position in the value
+	/// </summary>
+	static void Shuffle(const char* input, int count, int elementSize, char* output);
+
+	/// <summary>
+	/// undoes Shuffle
+	/// </summary>
+	static void Unshuffle(const char* input, int count, int elementSize, char* output);
+
+	/// <summary>
+	/// lz77 compresses the bytes
+	/// </summary>
+	/// <returns> bytes written, or -1 if it didn't fit in the capacity </returns>
+	static int LzCompress(const char* input, int size, char* output, int capacity);
+
+	/// <summary>
+	/// decompresses exactly size bytes
+	/// </summary>
+	static bool LzDecompress(const char* input, int compressedSize, char* output, int size);
+
+	/// <summary>
+	/// writes one sequence of literals followed by a match, a match length of 0 ends the block
+	/// </summary>
+	static bool WriteSequence(const char* literals, int literalLength, int offset, int matchLength, char* output, int& outputPosition, int capacity);
+};
+
+
+inline int BlockCodec::Compress(const char* input, int size, int elementSize, int prefixSize, char* output, char* scratch)
+{
+	//prefix stays as it is, the values are shuffled after it
+	int count = (size - prefixSize) / elementSize;
+	memcpy(scratch, input, prefixSize);
+	Shuffle(input + prefixSize, count, elementSize, scratch + prefixSize);
+
+	//only keep the compressed block if it's smaller
+	int compressedSize = LzCompress(scratch, size, output, size - 1);
+	if (compressedSize < 0) {
+		memcpy(output, input, size);
+		return size;
+	}
+
+	return compressedSize;
+}
+
+inline bool BlockCodec::Decompress(const char* input, int compressedSize, int size, int elementSize, int prefixSize, char* output, char* scratch)
+{
+	if (compressedSize == size) {
+		memcpy(output, input, size);
+		return true;
+	}
+	if (compressedSize > size || !LzDecompress(input, compressedSize, scratch, size)) { return false; }
+
+	int count = (size - prefixSize) / elementSize;
+	memcpy(output, scratch, prefixSize);
+	Unshuffle(scratch + prefixSize, count, elementSize, output + prefixSize);
+	return true;
+}
+
+inline void BlockCodec::Shuffle(const char* input, int count, int elementSize, char* output)
+{
+	const unsigned char* in = (const unsigned char*)input;
+	unsigned char* out = (unsigned char*)output;
+
+	for (int i = 0; i < count; i++) {
+		for (int b = 0; b < elementSize; b++) {
+			unsigned char previous = (i > 0) ? in[(i - 1) * elementSize + b] : 0;
+			out[b * count + i] = in[i * elementSize + b] ^ previous;
+		}
+	}
+}
+
+inline void BlockCodec::Unshuffle(const char* input, int count, int elementSize, char* output)
+{
+	const unsigned char* in = (const unsigned char*)input;
+	unsigned char* out = (unsigned char*)output;
+
+	//whole values at a time for the usual sizes, so undoing the xor is one operation per value
+	if (elementSize == 4) {
+		uint32_t previous = 0;
+		for (int i = 0; i < count; i++) {
+			previous ^= (uint32_t)in[i] | ((uint32_t)in[count + i] << 8) | ((uint32_t)in[2 * count + i] << 16) | ((uint32_t)in[3 * count + i] << 24);
+			memcpy(out + i * 4, &previous, 4);
+		}
+		return;
+	}
+	if (elementSize == 1) {
+		unsigned char previous = 0;
+		for (int i = 0; i < count; i++) { out[i] = previous ^= in[i]; }
+		return;
+	}
+	if (elementSize == 2) {
+		uint16_t previous = 0;
+		for (int i = 0; i < count; i++) {
+			previous ^= (uint16_t)(in[i] | (in[count + i] << 8));
+			memcpy(out + i * 2, &previous, 2);
+		}
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		for (int b = 0; b < elementSize; b++) {
+			unsigned char previous = (i > 0) ? out[(i - 1) * elementSize + b] : 0;
+			out[i * elementSize + b] = in[b * count + i] ^ previous;
+		}
+	}
+}
+
+inline int BlockCodec::LzCompress(const char* input, int size, char* output, int capacity)
+{
+	//most recent position of each hashed 4 bytes
+	int table[1 << HashBits];
+	std::fill_n(table, 1 << HashBits, -1);
+	int position = 0, anchor = 0, outputPosition = 0;
+
+	while (position + MinMatch <= size) {
+		uint32_t sequence;
+		memcpy(&sequence, input + position, sizeof(uint32_t));
+		uint32_t hash = (sequence * 2654435761u) >> (32 - HashBits);
+
+		int candidate = table[hash];
+		table[hash] = position;
+
+		uint32_t candidateSequence = 0;
+		if (candidate >= 0) { memcpy(&candidateSequence, input + candidate, sizeof(uint32_t)); }
+		if (candidate < 0 || position - candidate > MaxOffset || candidateSequence != sequence) {
+			position++;
+			continue;
+		}
+
+		//extend the match as far as it goes, it may overlap the bytes it's copying
+		int matchLength = MinMatch;
+		while (position + matchLength < size && input[candidate + matchLength] == input[position + matchLength]) { matchLength++; }
+
+		if (!WriteSequence(input + anchor, position - anchor, position - candidate, matchLength, output, outputPosition, capacity)) { return -1; }
+		position += matchLength;
+		anchor = position;
+	}
+
+	//whatever is left is literals
+	if (!WriteSequence(input + anchor, size - anchor, 0, 0, output, outputPosition, capacity)) { return -1; }
+	return outputPosition;
+}
+
+inline bool BlockCodec::WriteSequence(const char* literals, int literalLength, int offset, int matchLength, char* output, int& outputPosition, int capacity)
+{
+	//token holds both lengths up to 15, longer lengths carry on in the bytes after it
+	int matchCode = (matchLength > 0) ? matchLength - MinMatch : 0;
+	int worstCase = 1 + literalLength / 255 + 1 + literalLength + 2 + matchCode / 255 + 1;
+	if (outputPosition + worstCase > capacity) { return false; }
+
+	unsigned char* out = (unsigned char*)output;
+	out[outputPosition++] = (unsigned char)((std::min(literalLength, 15) << 4) | std::min(matchCode, 15));
+
+	if (literalLength >= 15) {
+		int remaining = literalLength - 15;
+		for (; remaining >= 255; remaining -= 255) { out[outputPosition++] = 255; }
+		out[outputPosition++] = (unsigned char)remaining;
+	}
+	memcpy(output + outputPosition, literals, literalLength);
+	outputPosition += literalLength;
+
+	if (matchLength == 0) { return true; }
+
+	out[outputPosition++] = (unsigned char)(offset & 0xFF);
+	out[outputPosition++] = (unsigned char)(offset >> 8);
+
+	if (matchCode >= 15) {
+		int remaining = matchCode - 15;
+		for (; remaining >= 255; remaining -= 255) { out[outputPosition++] = 255; }
+		out[outputPosition++] = (unsigned char)remaining;
+	}
+	return true;
+}
+
+inline bool BlockCodec::LzDecompress(const char* input, int compressedSize, char* output, int size)
+{
+	const unsigned char* in = (const unsigned char*)input;
+	int inputPosition = 0, outputPosition = 0;
+
+	//reads a length carried on past the token
+	auto readLength = [&](int length) {
+		if (length < 15) { return length; }
+		unsigned char extra;
+		do {
+			if (inputPosition >= compressedSize) { return -1; }
+			extra = in[inputPosition++];
+			length += extra;
+		} while (extra == 255);
+		return length;
+	};
+
+	while (inputPosition < compressedSize) {
+		int token = in[inputPosition++];
+
+		int literalLength = readLength(token >> 4);
+		if (literalLength < 0 || inputPosition + literalLength > compressedSize || outputPosition + literalLength > size) { return false; }
+		memcpy(output + outputPosition, input + inputPosition, literalLength);
+		inputPosition += literalLength;
+		outputPosition += literalLength;
+
+		//the last sequence has no match
+		if (inputPosition == compressedSize) { break; }
+
+		if (inputPosition + 2 > compressedSize) { return false; }
+		int offset = in[inputPosition] | (in[inputPosition + 1] << 8);
+		inputPosition += 2;
+
+		int matchLength = readLength(token & 15);
+		if (matchLength < 0) { return false; }
+		matchLength += MinMatch;
+		if (offset == 0 || offset > outputPosition || outputPosition + matchLength > size) { return false; }
+
+		//a match overlapping what it's writing repeats every offset bytes, which is how runs are stored
+		char* match = output + outputPosition - offset;
+		if (offset == 1) { memset(output + outputPosition, match[0], matchLength); }
+		else {
+			for (int copied = 0; copied < matchLength; copied += offset) {
+				memcpy(output + outputPosition + copied, match + copied, std::min(offset, matchLength - copied));
+			}
+		}
+		outputPosition += matchLength;
+	}
+
+	return outputPosition == size;
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+/**
+*	Sparse grid of 8x8x8 bricks, covering a smoke grid of the given width and its boundary
+*
+*	bricks are only allocated where values are stored, everywhere else reads as 0. freed bricks go
+*	on a free list and are reused before any new memory is allocated
+*
+*	cells in a brick are ordered x + 8y + 64z, the same order as the blocks in a saved simulation.
+*	if the grid isn't a multiple of 8 wide, the last bricks on each axis hang over the edge
+**/
+
+
+class BrickGrid
+{
+public:
+	static const int BrickWidth = 8;
+	static const int BrickCellCount = BrickWidth * BrickWidth * BrickWidth;
+
+	/// <summary>
+	/// creates an empty grid, the width doesn't include the boundary
+	/// </summary>
+	BrickGrid(int gridWidth);
+	~BrickGrid();
+
+	/// <summary>
+	/// value of a cell, 0 if its brick isn't allocated
+	/// </summary>
+	inline float Get(int i, int j, int k) const;
+
+	/// <summary>
+	/// sets a cell, allocating its brick if needed
+	/// </summary>
+	inline void Set(int i, int j, int k, float value);
+
+	/// <summary>
+	/// returns the brick's cells, or nullptr if it isn't allocated
+	/// </summary>
+	inline float* GetBrick(int brickIndex) const;
+
+	/// <summary>
+	/// returns the brick's cells, allocating it filled with 0 if needed
+	/// </summary>
+	float* Touch(int brickIndex);
+
+	/// <summary>
+	/// returns the brick to the free list
+	/// </summary>
+	void Free(int brickIndex);
+
+	/// <summary>
+	/// frees every brick
+	/// </summary>
+	void Clear();
+
+	/// <summary>
+	/// copies a brick and the given number of cells around it into a (8 + 2 * halo)^3 block, so stencils 
+	/// can read their neighbours without looking up bricks. cells in missing bricks are 0
+	/// </summary>
+	void GatherHalo(int brickIndex, int halo, float* out) const;
+
+	/// <summary>
+	/// index of the brick holding a cell
+	/// </summary>
+	inline int GetBrickIndex(int i, int j, int k) const;
+
+	/// <summary>
+	/// converts a brick index into the brick's coordinates, in bricks
+	/// </summary>
+	inline void GetBrickCoords(int brickIndex, int& bi, int& bj, int& bk) const;
+
+	/// <summary>
+	/// writes every cell into a dense grid, including the boundary
+	/// </summary>
+	void CopyToDense(float* dense) const;
+
+	/// <summary>
+	/// writes one brick's cells into a dense grid, 0 if it isn't allocated
+	/// </summary>
+	void CopyBrickToDense(int brickIndex, float* dense) const;
+
+	/// <summary>
+	/// replaces the grid with a dense grid, only allocating bricks that have a value
+	/// </summary>
+	void CopyFromDense(const float* dense);
+
+	int GetBricksPerAxis() const;
+	int GetTotalBrickCount() const;
+	int GetAllocatedBrickCount() const;
+
+	/// <summary>
+	/// bytes of brick memory, including bricks on the free list
+	/// </summary>
+	size_t GetMemoryUsage() const;
+
+private:
+	//grid width including the boundary, and bricks along each axis
+	int mWidth;
+	int mBricksPerAxis;
+
+	//each brick's cells, nullptr while empty
+	std::vector<float*> mBricks;
+
+	//freed bricks ready to reuse, and every brick ever allocated
+	std::vector<float*> mFreeBricks;
+	std::vector<float*> mAllocations;
+
+	int mAllocatedCount = 0;
+};
+
+
+inline BrickGrid::BrickGrid(int gridWidth) :
+	mWidth(gridWidth + 2)
+{
+	mBricksPerAxis = (mWidth + BrickWidth - 1) / BrickWidth;
+	mBricks.assign(mBricksPerAxis * mBricksPerAxis * mBricksPerAxis, nullptr);
+}
+
+inline BrickGrid::~BrickGrid()
+{
+	for (float* brick : mAllocations) { free(brick); }
+}
+
+inline float BrickGrid::Get(int i, int j, int k) const
+{
+	//outside the grid is empty
+	if (i < 0 || j < 0 || k < 0 || i >= mWidth || j >= mWidth || k >= mWidth) { return 0.0f; }
+
+	float* brick = mBricks[GetBrickIndex(i, j, k)];
+	if (!brick) { return 0.0f; }
+
+	return brick[(i & 7) + BrickWidth * (j & 7) + BrickWidth * BrickWidth * (k & 7)];
+}
+
+inline void BrickGrid::Set(int i, int j, int k, float value)
+{
+	float* brick = Touch(GetBrickIndex(i, j, k));
+	brick[(i & 7) + BrickWidth * (j & 7) + BrickWidth * BrickWidth * (k & 7)] = value;
+}
+
+inline float* BrickGrid::GetBrick(int brickIndex) const
+{
+	return mBricks[brickIndex];
+}
+
+inline float* BrickGrid::Touch(int brickIndex)
+{
+	float*& brick = mBricks[brickIndex];
+	if (brick) { return brick; }
+
+	//reuse a freed brick before allocating more memory
+	if (!mFreeBricks.empty()) {
+		brick = mFreeBricks.back();
+		mFreeBricks.pop_back();
+		std::fill_n(brick, BrickCellCount, 0.0f);
+	}
+	else {
+		brick = (float*)calloc(BrickCellCount, sizeof(float));
+		mAllocations.push_back(brick);
+	}
+
+	mAllocatedCount++;
+	return brick;
+}
+
+inline void BrickGrid::Free(int brickIndex)
+{
+	float*& brick = mBricks[brickIndex];
+	if (!brick) { return; }
+
+	mFreeBricks.push_back(brick);
+	brick = nullptr;
+	mAllocatedCount--;
+}
+
+inline void BrickGrid::Clear()
+{
+	for (int b = 0; b < (int)mBricks.size(); b++) { Free(b); }
+}
+
+inline void BrickGrid::GatherHalo(int brickIndex, int halo, float* out) const
+{
+	const int B = BrickWidth;
+	int width = B + 2 * halo;
+	int bi, bj, bk;
+	GetBrickCoords(brickIndex, bi, bj, bk);
+
+	//neighbouring bricks, nullptr if empty or past the edge of the grid
+	float* neighbours[3][3][3];
+	for (int z = 0; z < 3; z++) {
+		for (int y = 0; y < 3; y++) {
+			for (int x = 0; x < 3; x++) {
+				int nx = bi + x - 1, ny = bj + y - 1, nz = bk + z - 1;
+				bool inside = nx >= 0 && ny >= 0 && nz >= 0 && nx < mBricksPerAxis && ny < mBricksPerAxis && nz < mBricksPerAxis;
+				neighbours[z][y][x] = inside ? mBricks[nx + mBricksPerAxis * ny + mBricksPerAxis * mBricksPerAxis * nz] : nullptr;
+			}
+		}
+	}
+
+	//each row of the block comes from up to three bricks along x
+	for (int z = -halo; z < B + halo; z++) {
+		int nz = (z < 0) ? 0 : (z < B) ? 1 : 2, cz = (z + B) % B;
+		for (int y = -halo; y < B + halo; y++) {
+			int ny = (y < 0) ? 0 : (y < B) ? 1 : 2, cy = (y + B) % B;
+			float* row = out + width * (y + halo) + width * width * (z + halo);
+			int offset = B * cy + B * B * cz;
+
+			float* left = neighbours[nz][ny][0], * centre = neighbours[nz][ny][1], * right = neighbours[nz][ny][2];
+			if (left) { std::copy_n(left + offset + B - halo, halo, row); }
+			else { std::fill_n(row, halo, 0.0f); }
+			if (centre) { std::copy_n(centre + offset, B, row + halo); }
+			else { std::fill_n(row + halo, B, 0.0f); }
+			if (right) { std::copy_n(right + offset, halo, row + halo + B); }
+			else { std::fill_n(row + halo + B, halo, 0.0f); }
+		}
+	}
+}
+
+inline int BrickGrid::GetBrickIndex(int i, int j, int k) const
+{
+	return (i >> 3) + mBricksPerAxis * (j >> 3) + mBricksPerAxis * mBricksPerAxis * (k >> 3);
+}
+
+inline void BrickGrid::GetBrickCoords(int brickIndex, int& bi, int& bj, int& bk) const
+{
+	bi = brickIndex % mBricksPerAxis;
+	bj = (brickIndex / mBricksPerAxis) % mBricksPerAxis;
+	bk = brickIndex / (mBricksPerAxis * mBricksPerAxis);
+}
+
+inline void BrickGrid::CopyToDense(float* dense) const
+{
+	for (int b = 0; b < (int)mBricks.size(); b++) { CopyBrickToDense(b, dense); }
+}
+
+inline void BrickGrid::CopyBrickToDense(int brickIndex, float* dense) const
+{
+	int bi, bj, bk;
+	GetBrickCoords(brickIndex, bi, bj, bk);
+	float* brick = mBricks[brickIndex];
+
+	//rows of the brick, stopping at the edge of the grid
+	int iStart = bi * BrickWidth, iEnd = std::min(iStart + BrickWidth, mWidth);
+	for (int z = 0; z < BrickWidth && bk * BrickWidth + z < mWidth; z++) {
+		for (int y = 0; y < BrickWidth && bj * BrickWidth + y < mWidth; y++) {
+			float* row = dense + iStart + mWidth * (bj * BrickWidth + y) + mWidth * mWidth * (bk * BrickWidth + z);
+			if (brick) { std::copy_n(brick + BrickWidth * y + BrickWidth * BrickWidth * z, iEnd - iStart, row); }
+			else { std::fill_n(row, iEnd - iStart, 0.0f); }
+		}
+	}
+}
+
+inline void BrickGrid::CopyFromDense(const float* dense)
+{
+	Clear();
+
+	for (int k = 0; k < mWidth; k++) {
+		for (int j = 0; j < mWidth; j++) {
+			for (int i = 0; i < mWidth; i++) {
+				float value = dense[i + mWidth * j + mWidth * mWidth * k];
+				if (value != 0.0f) { Set(i, j, k, value); }
+			}
+		}
+	}
+}
+
+inline int BrickGrid::GetBricksPerAxis() const
+{
+	return mBricksPerAxis;
+}
+
+inline int BrickGrid::GetTotalBrickCount() const
+{
+	return (int)mBricks.size();
+}
+
+inline int BrickGrid::GetAllocatedBrickCount() const
+{
+	return mAllocatedCount;
+}
+
+inline size_t BrickGrid::GetMemoryUsage() const
+{
+	return mAllocations.size() * BrickCellCount * sizeof(float);
+}
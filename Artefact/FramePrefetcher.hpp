@@ -0,0 +1,220 @@
+#pragma once
+
+#include "ReadWriteSmoke.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <exception>
+
+/**
+*	Decodes the frames of a saved simulation ahead of playback on its own thread
+*
+*	decoded frames wait in a ring of density buffers, the renderer takes the next one each frame and only ever
+*	waits on the lock around the ring's counts, never on the file. if decoding falls behind, the renderer keeps
+*	the frame it already has, so playback slows down instead of stalling
+*
+*	the buffer the renderer holds isn't reused until it moves on to the next frame. each frame is decoded by copying
+*	the frame before it and applying only its own changed blocks
+*
+*	frames are decoded with ReadWriteSmoke::DecodeFrame, so the reader's own frame is never touched, but the reader
+*	mustn't be closed or have its loop mode changed while prefetching. a frame that fails to decode stops the
+*	decoding, and its exception is thrown from GetNextFrame once the frames before it have been shown
+**/
+
+
+class FramePrefetcher
+{
+public:
+	static const int DefaultAheadFrames = 4;
+
+	/// <summary>
+	/// decodes the first frame straight away, then starts decoding the frames after it
+	/// </summary>
+	/// <param name="reader"> - opened simulation file, see ReadWriteSmoke::ReadInit </param>
+	/// <param name="aheadFrames"> - most frames decoded ahead of the one being shown </param>
+	FramePrefetcher(ReadWriteSmoke* reader, int aheadFrames = DefaultAheadFrames);
+	~FramePrefetcher();
+
+	/// <summary>
+	/// moves on to the next decoded frame if one is ready, looping back to the first after the last.
+	/// throws the decoding thread's exception once every frame decoded before it has been taken
+	/// </summary>
+	/// <returns> the frame's density, valid until the next call </returns>
+	float* GetNextFrame();
+
+	/// <summary>
+	/// density last returned, without moving on
+	/// </summary>
+	float* GetCurrentDensity();
+
+	/// <summary>
+	/// frame of the density last returned
+	/// </summary>
+	int GetCurrentFrame();
+
+	/// <summary>
+	/// frames decoded and waiting to be taken
+	/// </summary>
+	int GetReadyFrameCount();
+
+	/// <summary>
+	/// times GetNextFrame found nothing ready and returned the same frame again
+	/// </summary>
+	int GetMissedFrameCount();
+
+	/// <summary>
+	/// bytes allocated for the ring of density buffers
+	/// </summary>
+	size_t GetMemoryUsage();
+
+private:
+	/// <summary>
+	/// decodes the frame after the newest one whenever there's a free buffer
+	/// </summary>
+	void DecodeLoop();
+
+	ReadWriteSmoke* mReader;
+	size_t mCellCount;
+	int mFrameCount;
+
+	//ring of density buffers and the frame in each. the renderer's buffer is followed by the ready ones,
+	//every other buffer is free for decoding into
+	std::vector<float*> mBuffers;
+	std::vector<int> mBufferFrames;
+	int mHeldIndex = 0;
+	int mReadyCount = 0;
+	int mMissedFrames = 0;
+
+	std::mutex mMutex;
+	std::condition_variable mBufferFreed;
+	std::atomic<bool> bStopping{ false };
+
+	//why decoding stopped, kept for the renderer's thread
+	std::exception_ptr mDecodeError;
+
+	std::thread mThread;
+};
+
+
+inline FramePrefetcher::FramePrefetcher(ReadWriteSmoke* reader, int aheadFrames) :
+	mReader(reader), mFrameCount(reader->GetStoredFrameCount())
+{
+	int gridWidth = reader->GetSimulationGridWidth();
+	mCellCount = (size_t)gridWidth * gridWidth * gridWidth;
+
+	//one buffer for the renderer plus one for each frame ahead
+	int bufferCount = std::max(aheadFrames, 1) + 1;
+	mBuffers.resize(bufferCount);
+	mBufferFrames.assign(bufferCount, -1);
+	for (int b = 0; b < bufferCount; b++) { mBuffers[b] = (float*)calloc(mCellCount, sizeof(float)); }
+
+	//the renderer has the first frame before anything is prefetched
+	if (mFrameCount == 0) { return; }
+	mReader->DecodeFrame(0, mBuffers[0]);
+	mBufferFrames[0] = 0;
+
+	//a single frame never changes, so there's nothing to prefetch
+	if (mFrameCount > 1) { mThread = std::thread(&FramePrefetcher::DecodeLoop, this); }
+}
+
+inline FramePrefetcher::~FramePrefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		bStopping = true;
+	}
+	mBufferFreed.notify_one();
+	if (mThread.joinable()) { mThread.join(); }
+
+	for (float* buffer : mBuffers) { free(buffer); }
+}
+
+inline float* FramePrefetcher::GetNextFrame()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	//the decoder has stopped, so no more frames are coming
+	if (mReadyCount == 0 && mDecodeError) { std::rethrow_exception(mDecodeError); }
+
+	//keep showing the current frame rather than waiting on the decoder
+	if (mReadyCount == 0) {
+		mMissedFrames++;
+		return mBuffers[mHeldIndex];
+	}
+
+	//the old buffer is free to decode into again
+	mHeldIndex = (mHeldIndex + 1) % (int)mBuffers.size();
+	mReadyCount--;
+	mBufferFreed.notify_one();
+
+	return mBuffers[mHeldIndex];
+}
+
+inline float* FramePrefetcher::GetCurrentDensity()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mBuffers[mHeldIndex];
+}
+
+inline int FramePrefetcher::GetCurrentFrame()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mBufferFrames[mHeldIndex];
+}
+
+inline int FramePrefetcher::GetReadyFrameCount()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mReadyCount;
+}
+
+inline int FramePrefetcher::GetMissedFrameCount()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mMissedFrames;
+}
+
+inline size_t FramePrefetcher::GetMemoryUsage()
+{
+	return mBuffers.size() * mCellCount * sizeof(float);
+}
+
+inline void FramePrefetcher::DecodeLoop()
+{
+	int bufferCount = (int)mBuffers.size();
+
+	while (true)
+	{
+		//wait for a buffer that's neither held nor ready
+		int source;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mBufferFreed.wait(lock, [&]() { return bStopping || mReadyCount < bufferCount - 1; });
+			if (bStopping) { return; }
+
+			source = (mHeldIndex + mReadyCount) % bufferCount;
+		}
+		int target = (source + 1) % bufferCount;
+
+		//the newest frame is only read while decoding, so the renderer can still be drawing it
+		int sourceFrame = mBufferFrames[source];
+		int frame = (sourceFrame + 1) % mFrameCount;
+		std::copy_n(mBuffers[source], mCellCount, mBuffers[target]);
+		try {
+			mReader->DecodeFrame(frame, mBuffers[target], sourceFrame);
+		}
+		catch (...) {
+			//every frame after this one is decoded from it, so stop and let the renderer know
+			std::lock_guard<std::mutex> lock(mMutex);
+			mDecodeError = std::current_exception();
+			return;
+		}
+		mBufferFrames[target] = frame;
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReadyCount++;
+	}
+}
@@ -9,6 +9,8 @@
 #include "VoxelRendering.h"
 #include "RayTraceRendering.h"
 #include "Smoke.h"
+#include "SimulationThread.hpp"
+#include "SmokePlayback.hpp"
 #include "IntegrationTests.h"
 #include "DataCollection.h"
 #include "InputConfiguration.hpp"
@@ -44,6 +46,15 @@ float ExperimentRunTime = 30.0f;
 int SmokeGridSize = 32;
 float SmokeWorldSize = 0.5f;
 
+//run the real time simulation on its own thread, rendering the latest finished frame
+bool bBackgroundSimulation = true;
+
+//saved frames decoded ahead of playback on their own thread, 0 decodes each frame on the render thread
+int PrefetchFrames = FramePrefetcher::DefaultAheadFrames;
+
+//playback keeps a copy of the first frame, so looping back to it doesn't decode it again
+ReadWriteSmoke::LoopMode PlaybackLoopMode = ReadWriteSmoke::LoopFromSnapshot;
+
 //program settings
 float MouseSensitivity = 0.3f;
 
@@ -69,6 +80,8 @@ Scenery* scenery;
 
 //smoke
 Smoke* smokeSim;
+SimulationThread* simulationThread;
+SmokePlayback* smokePlayback;
 float* smokeDensityGrid;
 
 //renderers
@@ -105,6 +118,8 @@ int AppStart(WindowInitialiser& programStart) {
 
 //clears any allocated memory
 void AppClose() {
+	if (simulationThread) { delete(simulationThread); }
+	if (smokePlayback) { delete(smokePlayback); }
 	if (controls) { delete(controls); }
 	if (rayCastRenderer) { delete(rayCastRenderer); }
 	if (voxelRenderer) { delete(voxelRenderer); }
@@ -128,6 +143,11 @@ void WriteNewSimulation() {
 	smoke.CreateAndSaveSimulation(savedSmokeFile, totalFrames);
 }
 
+//the simulation thread runs by itself, so it's paused while stepping or with the simulation disabled
+void UpdateSimulationPause() {
+	if (simulationThread) { simulationThread->SetPaused(bStepSimulation || !bEnableSmokeSimulation); }
+}
+
 //sets-up artefact in the chosen mode, initalises renderer
 void ArtefactSetup() {
 	//Testing Mode - initalise intgration testing 
@@ -140,11 +160,21 @@ void ArtefactSetup() {
 		smokeSim = new Smoke(SmokeGridSize);
 		smokeDensityGrid = smokeSim->mCurrentDensity;
 		smokeSim->SetAmbientVelocity(0, 0, 0);
+
+		//add density to the bottom middle before every update on the simulation thread
+		if (bBackgroundSimulation) {
+			simulationThread = new SimulationThread(smokeSim, [](Smoke& smoke) {
+				smoke.AddDensity(SmokeGridSize / 2, 2, SmokeGridSize / 2, 10.0f);
+			});
+			smokeDensityGrid = simulationThread->GetLatestDensity();
+			UpdateSimulationPause();
+		}
 	}
-	//Reading simulation - Initalise smoke and read in the saved sim
+	//Reading simulation - open the saved sim, only its density is kept
 	else if (MODE == ArtefactMode::ReadingSim) {
-		smokeSim = Smoke::OpenSavedSimulation(savedSmokeFile, SmokeGridSize);
-		smokeDensityGrid = smokeSim->mCurrentDensity;
+		smokePlayback = new SmokePlayback(savedSmokeFile, PrefetchFrames, PlaybackLoopMode);
+		SmokeGridSize = smokePlayback->GetGridWidth();
+		smokeDensityGrid = smokePlayback->GetDensity();
 	}
 
 	//initalise voxel renderer 
@@ -159,13 +189,16 @@ void ArtefactSetup() {
 
 //called each frame and depending on the mode updates the smoke grid 
 void UpdateSmoke() {
-	if (MODE == ArtefactMode::RealTimeSim) {
+	//background simulation runs by itself, only stepping needs asking for
+	if (MODE == ArtefactMode::RealTimeSim && simulationThread) {
+		if (bStepSimulation) { simulationThread->RequestStep(); }
+	}
+	else if (MODE == ArtefactMode::RealTimeSim) {
 		smokeSim->AddDensity(SmokeGridSize / 2, 2, SmokeGridSize / 2, 10.0f);
 		smokeSim->Update(controls->deltaTime);
 	}
 	else if (MODE == ArtefactMode::ReadingSim) {
-		smokeSim->ReadNextSimulationFrame();
-		smokeDensityGrid = smokeSim->mCurrentDensity;
+		smokeDensityGrid = smokePlayback->ReadNextFrame();
 	}
 	else if (MODE == ArtefactMode::IntegrationTesting) {
 		integrationTesting->Run();
@@ -174,6 +207,9 @@ void UpdateSmoke() {
 
 //draws the smoke grid to screen using chosen renderer
 void DrawSmoke() {
+	//latest frame the simulation thread finished, never waits for it
+	if (simulationThread) { smokeDensityGrid = simulationThread->GetLatestDensity(); }
+
 	if (RENDER_METHOD == RenderingMethod::Voxels) {
 		voxelRenderer->DrawVoxelsInstanced(controls->projection, controls->viewMatrix, smokeDensityGrid);
 	}
@@ -188,13 +224,22 @@ void InputCheck() {
 	if (FirstPersonController::GetKeyDown(GLFW_KEY_0)) { controls->ToggleMouseLock(); }
 
 	//1: toggle stepping simulation -- 2: to actually step simulation 
-	if (FirstPersonController::GetKeyDown(GLFW_KEY_1)) { bStepSimulation = !bStepSimulation; }
+	if (FirstPersonController::GetKeyDown(GLFW_KEY_1)) { 
+		bStepSimulation = !bStepSimulation; 
+		UpdateSimulationPause();
+	}
 
-	//4: add random density to smoke
-	if (FirstPersonController::GetKeyDown(GLFW_KEY_4)) { smokeSim->AddRandomDensityCloud(2, 100.0f); }
+	//4: add random density to smoke, queued while the simulation thread is running
+	if (FirstPersonController::GetKeyDown(GLFW_KEY_4)) {
+		if (simulationThread) { simulationThread->AddRandomDensityCloud(2, 100.0f); }
+		else if (smokeSim) { smokeSim->AddRandomDensityCloud(2, 100.0f); }
+	}
 
 	//5: clear smoke density 
-	if (FirstPersonController::GetKeyDown(GLFW_KEY_5)) { smokeSim->ClearDensity(); }
+	if (FirstPersonController::GetKeyDown(GLFW_KEY_5)) {
+		if (simulationThread) { simulationThread->ClearDensity(); }
+		else if (smokeSim) { smokeSim->ClearDensity(); }
+	}
 
 	//update the smoke simulation by stepping or just every frame if stepping disabled 
 	if (bEnableSmokeSimulation && (FirstPersonController::GetKeyDown(GLFW_KEY_2) || !bStepSimulation)) {
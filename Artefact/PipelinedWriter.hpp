@@ -0,0 +1,372 @@
+#pragma once
+
+#include "ReadWriteSmoke.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+
+/**
+*	Writes a simulation to file in three overlapping stages, so the solver never waits on encoding or disk
+*
+*	1. snapshot - the solver copies its density, and changed brick mask if it has one, into a free snapshot
+*	2. encode - a thread diffs, encodes and compresses each snapshot into the frame's bytes
+*	3. write - a thread writes the bytes to file
+*
+*	a fixed amount of snapshots and frame buffers go round between the stages, so memory stays bounded. a stage
+*	only waits when the next one has every buffer, and the time each stage spends working and waiting is kept so
+*	the stage that limits the write can be seen
+*
+*	the writer must be initialised before the pipeline starts and only stopped after Finish. if encoding or writing
+*	throws, that stage stops and the exception is thrown from the next AddFrame or Finish on the solver's thread
+**/
+
+
+class PipelinedWriter
+{
+public:
+	static const int DefaultQueueFrames = 4;
+
+	enum Stage { SnapshotStage = 0, EncodeStage = 1, WriteStage = 2, StageCount = 3 };
+
+	//frames and bytes through a stage, the time spent on them and the time spent waiting for a buffer or frame
+	struct StageStats
+	{
+		int frames = 0;
+		uint64_t bytes = 0;
+		double busySeconds = 0;
+		double waitSeconds = 0;
+	};
+
+	/// <summary>
+	/// starts the encode and write threads
+	/// </summary>
+	/// <param name="writer"> - writer after WriteInit </param>
+	/// <param name="queueFrames"> - snapshots and encoded frames which can wait between stages </param>
+	PipelinedWriter(ReadWriteSmoke* writer, int queueFrames = DefaultQueueFrames);
+	~PipelinedWriter();
+
+	/// <summary>
+	/// snapshots the frame to be written, only waiting if every snapshot is still queued. throws after Finish,
+	/// or the encode or write thread's exception if either has stopped
+	/// </summary>
+	/// <param name="changedBricks"> - changed brick mask as for ReadWriteSmoke::AddFrame, nullptr diffs the frame instead </param>
+	void AddFrame(const float* density, const uint64_t* changedBricks = nullptr);
+
+	/// <summary>
+	/// waits for every frame to be written and stops the threads, the writer writes straight to file again.
+	/// throws the encode or write thread's exception if either stopped early, the destructor doesn't
+	/// </summary>
+	void Finish();
+
+	/// <summary>
+	/// frames, bytes and time for one stage, only complete after Finish
+	/// </summary>
+	StageStats GetStageStats(Stage stage);
+
+	/// <summary>
+	/// prints each stage's throughput and the stage that bounds the write
+	/// </summary>
+	void PrintThroughput();
+
+private:
+	/// <summary>
+	/// thread safe queue of buffer indexes, closing it wakes every wait
+	/// </summary>
+	class IndexQueue
+	{
+	public:
+		void Push(int index);
+
+		/// <returns> false once the queue is closed and empty </returns>
+		bool Pop(int& index);
+
+		void Close();
+
+	private:
+		std::mutex mMutex;
+		std::condition_variable mAdded;
+		std::deque<int> mIndexes;
+		bool bClosed = false;
+	};
+
+	/// <summary>
+	/// encodes each snapshot, handing the frame's bytes to the write queue through the writer's frame sink
+	/// </summary>
+	void EncodeLoop();
+
+	/// <summary>
+	/// writes each encoded frame
+	/// </summary>
+	void WriteLoop();
+
+	/// <summary>
+	/// keeps the first exception from the encode or write thread, then closes the free queues so
+	/// nothing waits on the stopped stage
+	/// </summary>
+	void Fail(std::exception_ptr error);
+
+	/// <summary>
+	/// throws the exception a stage stopped with, if any
+	/// </summary>
+	void RethrowError();
+
+	/// <summary>
+	/// seconds since the given time
+	/// </summary>
+	static double SecondsSince(std::chrono::steady_clock::time_point start);
+
+	ReadWriteSmoke* mWriter;
+	size_t mCellCount;
+	int mMaskWords;
+
+	//snapshots of the solver's density and changed bricks, and whether each has a mask
+	std::vector<std::vector<float>> mSnapshots;
+	std::vector<std::vector<uint64_t>> mSnapshotMasks;
+	std::vector<uint8_t> mSnapshotHasMask;
+	IndexQueue mFreeSnapshots, mEncodeQueue;
+
+	//encoded frames waiting to be written
+	std::vector<std::vector<char>> mFrames;
+	IndexQueue mFreeFrames, mWriteQueue;
+
+	//each stat is only changed by its own stage's thread
+	StageStats mStats[StageCount];
+	std::chrono::steady_clock::time_point mStartTime;
+	double mTotalSeconds = 0;
+
+	//first exception thrown on the encode or write thread
+	std::mutex mErrorMutex;
+	std::exception_ptr mError;
+
+	bool bFinished = false;
+	std::thread mEncodeThread;
+	std::thread mWriteThread;
+};
+
+
+inline PipelinedWriter::PipelinedWriter(ReadWriteSmoke* writer, int queueFrames) :
+	mWriter(writer), mMaskWords(writer->GetFrameHeaderSize())
+{
+	int gridWidth = writer->GetSimulationGridWidth();
+	mCellCount = (size_t)gridWidth * gridWidth * gridWidth;
+
+	//every buffer starts free
+	int bufferCount = std::max(queueFrames, 1);
+	mSnapshots.assign(bufferCount, std::vector<float>(mCellCount));
+	mSnapshotMasks.assign(bufferCount, std::vector<uint64_t>(mMaskWords));
+	mSnapshotHasMask.assign(bufferCount, 0);
+	mFrames.resize(bufferCount);
+	for (int b = 0; b < bufferCount; b++) {
+		mFreeSnapshots.Push(b);
+		mFreeFrames.Push(b);
+	}
+
+	//finished frames are swapped into a free frame buffer on the encode thread and queued to be written
+	mWriter->SetFrameSink([this](std::vector<char>& frame) {
+		auto waitStart = std::chrono::steady_clock::now();
+		int index;
+
+		//a closed queue has no buffer to give, so there's nowhere to put the frame
+		if (!mFreeFrames.Pop(index)) { return; }
+		mStats[EncodeStage].waitSeconds += SecondsSince(waitStart);
+
+		mFrames[index].swap(frame);
+		mWriteQueue.Push(index);
+	});
+
+	mStartTime = std::chrono::steady_clock::now();
+	mEncodeThread = std::thread(&PipelinedWriter::EncodeLoop, this);
+	mWriteThread = std::thread(&PipelinedWriter::WriteLoop, this);
+}
+
+inline PipelinedWriter::~PipelinedWriter()
+{
+	//a destructor can't throw, an error not already seen through AddFrame or Finish is dropped
+	try { Finish(); }
+	catch (...) {}
+}
+
+inline void PipelinedWriter::AddFrame(const float* density, const uint64_t* changedBricks)
+{
+	if (changedBricks && !mWriter->UsesBrickBlocks()) {
+		throw std::invalid_argument("Changed bricks don't match the simulation's blocks");
+	}
+
+	RethrowError();
+
+	auto waitStart = std::chrono::steady_clock::now();
+	int index;
+	if (bFinished || !mFreeSnapshots.Pop(index)) {
+		RethrowError();
+		throw std::logic_error("Frame added after the pipeline finished");
+	}
+	mStats[SnapshotStage].waitSeconds += SecondsSince(waitStart);
+
+	auto start = std::chrono::steady_clock::now();
+	std::copy_n(density, mCellCount, mSnapshots[index].data());
+	if (changedBricks) { std::copy_n(changedBricks, mMaskWords, mSnapshotMasks[index].data()); }
+	mSnapshotHasMask[index] = changedBricks != nullptr;
+
+	mStats[SnapshotStage].busySeconds += SecondsSince(start);
+	mStats[SnapshotStage].frames++;
+	mStats[SnapshotStage].bytes += mCellCount * sizeof(float);
+
+	mEncodeQueue.Push(index);
+}
+
+inline void PipelinedWriter::Finish()
+{
+	if (bFinished) { return; }
+	bFinished = true;
+
+	//each stage finishes what's queued before the next is closed
+	mEncodeQueue.Close();
+	mEncodeThread.join();
+	mWriteQueue.Close();
+	mWriteThread.join();
+
+	mWriter->SetFrameSink(nullptr);
+	mTotalSeconds = SecondsSince(mStartTime);
+
+	RethrowError();
+}
+
+inline PipelinedWriter::StageStats PipelinedWriter::GetStageStats(Stage stage)
+{
+	return mStats[stage];
+}
+
+inline void PipelinedWriter::PrintThroughput()
+{
+	const char* names[StageCount] = { "Snapshot", "Encode", "Write" };
+
+	//the busiest stage is the one the others wait on
+	int bound = 0;
+	for (int s = 0; s < StageCount; s++) {
+		const StageStats& stats = mStats[s];
+		double framesPerSecond = (stats.busySeconds > 0) ? stats.frames / stats.busySeconds : 0;
+		double megabytesPerSecond = (stats.busySeconds > 0) ? stats.bytes / stats.busySeconds / (1024.0 * 1024.0) : 0;
+
+		std::cout << names[s] << ": " << stats.frames << " frames | " << framesPerSecond << " frames/s | "
+			<< megabytesPerSecond << " MB/s | busy " << stats.busySeconds << " s | waiting " << stats.waitSeconds << " s\n";
+
+		if (stats.busySeconds > mStats[bound].busySeconds) { bound = s; }
+	}
+
+	std::cout << "Pipeline bound by " << names[bound] << " stage, total " << mTotalSeconds << " s\n";
+}
+
+inline void PipelinedWriter::EncodeLoop()
+{
+	while (true)
+	{
+		auto waitStart = std::chrono::steady_clock::now();
+		int index;
+		if (!mEncodeQueue.Pop(index)) { return; }
+		mStats[EncodeStage].waitSeconds += SecondsSince(waitStart);
+
+		//waiting on a free frame buffer inside the sink counts as waiting, not encoding
+		double sinkWait = mStats[EncodeStage].waitSeconds;
+		auto start = std::chrono::steady_clock::now();
+
+		float* density = mSnapshots[index].data();
+		try {
+			if (mSnapshotHasMask[index]) { mWriter->AddFrame(density, mSnapshotMasks[index].data()); }
+			else { mWriter->AddFrame(density); }
+		}
+		catch (...) {
+			Fail(std::current_exception());
+			return;
+		}
+
+		mStats[EncodeStage].busySeconds += SecondsSince(start) - (mStats[EncodeStage].waitSeconds - sinkWait);
+		mStats[EncodeStage].frames++;
+		mStats[EncodeStage].bytes += mCellCount * sizeof(float);
+
+		mFreeSnapshots.Push(index);
+	}
+}
+
+inline void PipelinedWriter::WriteLoop()
+{
+	while (true)
+	{
+		auto waitStart = std::chrono::steady_clock::now();
+		int index;
+		if (!mWriteQueue.Pop(index)) { return; }
+		mStats[WriteStage].waitSeconds += SecondsSince(waitStart);
+
+		auto start = std::chrono::steady_clock::now();
+		try {
+			mWriter->WriteFrameBytes(mFrames[index]);
+		}
+		catch (...) {
+			Fail(std::current_exception());
+			return;
+		}
+
+		mStats[WriteStage].busySeconds += SecondsSince(start);
+		mStats[WriteStage].frames++;
+		mStats[WriteStage].bytes += mFrames[index].size();
+
+		mFreeFrames.Push(index);
+	}
+}
+
+inline void PipelinedWriter::Fail(std::exception_ptr error)
+{
+	{
+		std::lock_guard<std::mutex> lock(mErrorMutex);
+		if (!mError) { mError = error; }
+	}
+
+	//wakes the solver waiting for a snapshot and the encoder waiting for a frame buffer
+	mFreeSnapshots.Close();
+	mFreeFrames.Close();
+}
+
+inline void PipelinedWriter::RethrowError()
+{
+	std::lock_guard<std::mutex> lock(mErrorMutex);
+	if (mError) { std::rethrow_exception(mError); }
+}
+
+inline double PipelinedWriter::SecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline void PipelinedWriter::IndexQueue::Push(int index)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mIndexes.push_back(index);
+	}
+	mAdded.notify_one();
+}
+
+inline bool PipelinedWriter::IndexQueue::Pop(int& index)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mAdded.wait(lock, [&]() { return bClosed || !mIndexes.empty(); });
+	if (mIndexes.empty()) { return false; }
+
+	index = mIndexes.front();
+	mIndexes.pop_front();
+	return true;
+}
+
+inline void PipelinedWriter::IndexQueue::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		bClosed = true;
+	}
+	mAdded.notify_all();
+}
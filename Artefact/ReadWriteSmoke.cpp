@@ -1,17 +1,113 @@
 #include "ReadWriteSmoke.h"
+#include "BlockCodec.hpp"
 
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
+#include <atomic>
 
-void ReadWriteSmoke::WriteInit(std::string fileName, int gridWidth, float* startingSmokeDensity, int blockWidth)
+//memory mapping the simulation file for reading
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//block diffing uses sse2, which every x86-64 cpu has
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define SMOKE_SIMD_DIFF
+#include <emmintrin.h>
+#endif
+
+/// <summary>
+/// number of flagged bits, used to count the blocks stored in a frame
+/// </summary>
+static inline int CountBits(uint64_t value)
+{
+#if defined(_MSC_VER)
+	return (int)__popcnt64(value);
+#else
+	return __builtin_popcountll(value);
+#endif
+}
+
+/// <summary>
+/// index of the lowest flagged bit, used to step through the flagged blocks. value can't be 0
+/// </summary>
+static inline int LowestSetBit(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int)index;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+const float ReadWriteSmoke::ChangeTolerance = 0.000001f;
+
+/// <summary>
+/// true if any value differs between the two blocks by more than the tolerance, stopping at the first difference
+/// </summary>
+static bool BlocksDiffer(const float* block1, const float* block2, int count)
+{
+	const float tolerance = ReadWriteSmoke::ChangeTolerance;
+	int i = 0;
+
+#ifdef SMOKE_SIMD_DIFF
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 toleranceV = _mm_set1_ps(tolerance);
+
+	//16 values per iteration, only branching once all four comparisons are combined
+	for (; i + 16 <= count; i += 16) {
+		__m128 d0 = _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(block1 + i), _mm_loadu_ps(block2 + i)));
+		__m128 d1 = _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(block1 + i + 4), _mm_loadu_ps(block2 + i + 4)));
+		__m128 d2 = _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(block1 + i + 8), _mm_loadu_ps(block2 + i + 8)));
+		__m128 d3 = _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(block1 + i + 12), _mm_loadu_ps(block2 + i + 12)));
+
+		__m128 differs = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(d0, toleranceV), _mm_cmpgt_ps(d1, toleranceV)),
+			_mm_or_ps(_mm_cmpgt_ps(d2, toleranceV), _mm_cmpgt_ps(d3, toleranceV)));
+		if (_mm_movemask_ps(differs)) { return true; }
+	}
+#endif
+
+	for (; i < count; i++) {
+		if (std::abs(block1[i] - block2[i]) > tolerance) { return true; }
+	}
+	return false;
+}
+
+ReadWriteSmoke::~ReadWriteSmoke()
+{
+	FreeBlockArenas();
+	delete(mThreadPool);
+}
+
+void ReadWriteSmoke::WriteInit(std::string fileName, int gridWidth, float* startingSmokeDensity, int blockWidth, int keyframeInterval,
+	BlockEncoding blockEncoding, bool compressBlocks)
 {
 	//calculate all needed values
 	mGridWidth = gridWidth;
+	mKeyframeInterval = std::max(keyframeInterval, 0);
 
 	//amount of values in one dimension of a 'block'
 	mBlockWidth = blockWidth;
 	mBlockSize = blockWidth * blockWidth * blockWidth;
 
+	mBlockEncoding = blockEncoding;
+	mEncodedBlockSize = GetEncodedBlockSize();
+	bCompressBlocks = compressBlocks;
+	bBlockModes = true;
+	bHeaderSummary = true;
+
 	//the amount of blocks in one dimension of the resulting split grid array
 	mBlockArrayWidth = {};
 
@@ -26,6 +122,9 @@ void ReadWriteSmoke::WriteInit(std::string fileName, int gridWidth, float* start
 		mFrameHeaderSize++;
 	}
 
+	//memory for splitting frames into, allocated once for the whole write
+	AllocateBlockArenas();
+
 #ifdef NDEBUG
 
 	mWriteFileStream = std::ofstream("Saved-Smoke/" + fileName + ".dat", std::ios::out | std::ios::binary | std::ios::trunc);
@@ -51,163 +150,806 @@ void ReadWriteSmoke::WriteInit(std::string fileName, int gridWidth, float* start
 	std::cout << "Saving Smoke Settings, grid width: " << mGridWidth << ", block array width: " << mBlockArrayWidth << ", \nblock width: " << blockWidth << ", frame header size: " << mFrameHeaderSize << ", total Frames: " << 100 <<"\n\n";
 
 	//get the file header, as block of 4-byte-ints
-	uint32_t* header = EncodeFileHeader(mGridWidth, blockWidth, mBlockArrayWidth, mFrameHeaderSize, 100);
+	uint32_t* header = EncodeFileHeader(mGridWidth, blockWidth, mBlockArrayWidth, mFrameHeaderSize, 100, mKeyframeInterval,
+		GetBlockFlags());
 
 	//write the header to the file
 	mWriteFileStream.write((char*)header, 8 * sizeof(uint32_t));
+	mWriteOffset = 8 * sizeof(uint32_t);
 
-	//need all values to be read at the first frame, so get all block ids to add to the first frames header
-	std::vector<int> fullBlockIdList = GetFullBlockIdList();
+	//the first frame is always a keyframe, straight after the header
+	mKeyframeOffsets.clear();
+	mKeyframeOffsets.push_back(8 * sizeof(uint32_t));
+	mWrittenFrameOffsets.clear();
 
-	//encode the full block id list into a frame header
-	uint64_t* firstFrameHeader = EncodeFrameHeader(fullBlockIdList);
-
-	//write the first frame header to file
-	mWriteFileStream.write((char*)firstFrameHeader, mFrameHeaderSize * sizeof(uint64_t));
+	//need all values to be read at the first frame, so flag every block id in the first frames header
+	EncodeFrameHeader(mFullBlockIds, mWriteHeaderBuffer);
 
 	//set previous frame's smoke as the starting frame
-	mPreviousFrameSmoke = SplitGrid(startingSmokeDensity);
+	SplitGrid(startingSmokeDensity, mPreviousFrameSmoke);
 
 	//write the whole grid to file
-	WriteFrame(mPreviousFrameSmoke, fullBlockIdList);
+	WriteFrame(mPreviousFrameSmoke, mFullBlockIds);
+	EndFrame();
 
 	//free pointers
-	delete[](header);
-	delete[](firstFrameHeader);
+	free(header);
 }
 
 void ReadWriteSmoke::ReadInit(std::string fileName)
 {
-	//try given filename as full file path
-	mReadFileStream = std::ifstream(fileName, std::ios::out | std::ios::binary);
-
-	//otherwise try name in other directories
-	if (!mReadFileStream) {
-		//read file stream 
-		mReadFileStream = std::ifstream("../../Saved-Smoke/" + fileName + ".dat", std::ios::out | std::ios::binary);
-
-		//invalid file path
-		if (!mReadFileStream) {
-			//in unit tests go back three directories to find the smoke
-			if (!(mReadFileStream = std::ifstream("../../../Saved-Smoke/" + fileName + ".dat", std::ios::out | std::ios::binary))) {
-				std::cout << "Cannot open file!" << "\n";
-				throw std::invalid_argument("Cannot open file");
-				return;
-			}
+	//try given filename as full file path, otherwise try name in other directories
+	if (!MapFile(fileName) && !MapFile("../../Saved-Smoke/" + fileName + ".dat")) {
+		//in unit tests go back three directories to find the smoke
+		if (!MapFile("../../../Saved-Smoke/" + fileName + ".dat")) {
+			std::cout << "Cannot open file!" << "\n";
+			throw std::invalid_argument("Cannot open file");
 		}
-
 	}
-	
+
 	//read file header to get info about the smoke 
-	uint32_t* fileHeader = new uint32_t[8];
-	mReadFileStream.read((char*)fileHeader, 8 * sizeof(uint32_t));
+	uint32_t fileHeader[8] = {};
+	if (mMappedSize < sizeof(fileHeader)) {
+		UnmapFile();
+		throw std::invalid_argument("File is too small to be a smoke simulation");
+	}
+	memcpy(fileHeader, mMappedFile, sizeof(fileHeader));
 
 	//assign all info from the file header and calculate other values 
 	DecodeFileHeader(fileHeader, mGridWidth, mBlockWidth, mBlockArrayWidth, mFrameHeaderSize, mSimulationTotalFrames);
+	DecodeFileHeader(fileHeader, mKeyframeInterval, mFileFlags);
 	mBlockSize = mBlockWidth * mBlockWidth * mBlockWidth;
 
+	uint32_t blockEncoding = (mFileFlags >> BlockEncodingShift) & 0xFF;
+	if (blockEncoding > Quantised8Blocks) {
+		UnmapFile();
+		throw std::invalid_argument("Unknown block encoding");
+	}
+	mBlockEncoding = (BlockEncoding)blockEncoding;
+	mEncodedBlockSize = GetEncodedBlockSize();
+	bCompressBlocks = (mFileFlags & CompressedBlocksFlag) != 0;
+	bBlockModes = (mFileFlags & BlockModesFlag) != 0;
+	bHeaderSummary = (mFileFlags & HeaderSummaryFlag) != 0;
+
 	//start smoke as blank grid
 	mCurrentFrameSmokeGrid = (float*)calloc(mGridWidth * mGridWidth * mGridWidth, sizeof(float));
 
-	//clear pointers
-	delete[](fileHeader);
+	mFrameHeaderBuffer = new uint64_t[GetFrameHeaderWords()];
+
+	//find where every frame starts from the table, or by walking the frames if there isn't one, nothing has been read yet
+	uint64_t trailerEnd = mMappedSize;
+	bFrameOffsetTable = ReadFrameOffsetTable(trailerEnd);
+	if (!bFrameOffsetTable) {
+		BuildFrameOffsets();
+		trailerEnd = mMappedSize;
+	}
+	mCurrentFrame = -1;
+
+	//keyframes come from the trailer, or from the interval if the file has none
+	if (!ReadKeyframeTrailer(trailerEnd)) {
+		mKeyframeOffsets.clear();
+		for (int frame = 0; frame < (int)mFrameOffsets.size(); frame++) {
+			if (IsKeyframe(frame)) { mKeyframeOffsets.push_back(mFrameOffsets[frame]); }
+		}
+	}
 
-	mFrameHeaderBuffer = new uint64_t[mFrameHeaderSize];
-	mReadBlockBuffer = new float[mBlockSize];
+	//a loop mode set before opening the file takes its snapshot now
+	SetLoopMode(mLoopMode);
 
 	std::cout << "Reading '" << fileName << "' - Settings: grid width: " << mGridWidth << ", block array width: " << mBlockArrayWidth << ", \nblock width: " << mBlockWidth << ", frame header size: " << mFrameHeaderSize << ", total Frames: " << mSimulationTotalFrames << "\n\n";
 }
 
 void ReadWriteSmoke::AddFrame(float* smokeDensity)
 {
-	//split the grid and find the differences between this and the previous' frames smoke
-	std::vector<float*> currentFrameSmoke = SplitGrid(smokeDensity);
-	std::vector<int> differenceIds = GetDifferenceSplitGrids(mPreviousFrameSmoke, currentFrameSmoke);
+	//the previous frame isn't kept while writing from changed brick masks, so every block is written to compare against again
+	bool restarted = AllocateFrameCopies();
 
-	//write the header which notes which blocks have changed and are written to the file
-	WriteFrameHeader(differenceIds);
+	//split the grid into the spare arena
+	SplitGrid(smokeDensity, mCurrentFrameSmoke);
+
+	//flag the blocks which changed from the previous frame's smoke straight into the header
+	EncodeChangedBlocks(mPreviousFrameSmoke, mCurrentFrameSmoke, restarted);
 
 	//write the blocks of the current frame's smoke which have changed from the previous frame's smoke
-	WriteFrame(currentFrameSmoke, differenceIds);
+	WriteFrame(mCurrentFrameSmoke, mWriteHeaderBuffer);
+
+	//the current frame becomes the previous one, and the old previous arena is reused next frame
+	std::swap(mPreviousFrameSmoke, mCurrentFrameSmoke);
+
+	EndFrame();
+	mFrameCounter++;
+}
+
+void ReadWriteSmoke::AddFrame(const BrickGrid& smokeDensity)
+{
+	if (!MatchesBrickLayout(smokeDensity)) {
+		throw std::invalid_argument("Brick grid doesn't match the simulation's blocks");
+	}
 
-	//clear the previous frame's allocated memory
-	ClearVec(mPreviousFrameSmoke);
+	bool restarted = AllocateFrameCopies();
+
+	//compare each brick against the previous frame's block, a missing brick is an empty block
+	static float emptyBlock[BrickGrid::BrickCellCount] = {};
+	for (int b = 0; b < (int)mBrickBlocks.size(); b++) {
+		float* brick = smokeDensity.GetBrick(b);
+		mBrickBlocks[b] = (brick) ? brick : emptyBlock;
+	}
+	EncodeChangedBlocks(mPreviousFrameSmoke, mBrickBlocks, restarted);
+
+	//keep a copy of each written block to compare the next frame against, then write them from the copies
+	for (int word = 0; word < mFrameHeaderSize; word++) {
+		for (uint64_t bits = mWriteHeaderBuffer[word]; bits != 0; bits &= bits - 1) {
+			int b = word * 64 + LowestSetBit(bits);
+			std::copy_n(mBrickBlocks[b], mBlockSize, mPreviousFrameSmoke[b]);
+		}
+	}
 
-	//update the preivous frame's smoke
-	std::copy(currentFrameSmoke.begin(), currentFrameSmoke.end(), mPreviousFrameSmoke.begin());
+	WriteFrame(mPreviousFrameSmoke, mWriteHeaderBuffer);
 
+	EndFrame();
 	mFrameCounter++;
 }
 
+void ReadWriteSmoke::AddFrame(float* smokeDensity, const uint64_t* changedBricks)
+{
+	if (!UsesBrickBlocks()) {
+		throw std::invalid_argument("Changed bricks don't match the simulation's blocks");
+	}
+
+	//the mask replaces comparing against the previous frame, so its copy isn't kept
+	FreeFrameCopies();
+
+	if (StartFrame()) { EncodeFrameHeader(mFullBlockIds, mWriteHeaderBuffer); }
+	else { std::copy_n(changedBricks, mFrameHeaderSize, mWriteHeaderBuffer); }
+
+	//copy each flagged block out of the grid as it's written
+	for (int word = 0; word < mFrameHeaderSize; word++) {
+		for (uint64_t bits = mWriteHeaderBuffer[word]; bits != 0; bits &= bits - 1) {
+			int b = word * 64 + LowestSetBit(bits);
+			CopyGridToBlock(b, smokeDensity, mWriteBlockBuffer.data());
+			WriteBlock(mWriteBlockBuffer.data(), b);
+		}
+	}
+
+	EndFrame();
+	mFrameCounter++;
+}
+
+void ReadWriteSmoke::SetFrameSink(std::function<void(std::vector<char>&)> sink)
+{
+	mFrameSink = sink;
+}
+
+void ReadWriteSmoke::WriteFrameBytes(const std::vector<char>& frame)
+{
+	mWriteFileStream.write(frame.data(), frame.size());
+}
+
+bool ReadWriteSmoke::MatchesBrickLayout(const BrickGrid& grid)
+{
+	return UsesBrickBlocks() && mBlockArrayWidth == grid.GetBricksPerAxis();
+}
+
+bool ReadWriteSmoke::UsesBrickBlocks()
+{
+	return mBlockWidth == BrickGrid::BrickWidth;
+}
+
 float* ReadWriteSmoke::ReadNextFrame()
 {
-	//read the frame header data
-	mReadFileStream.read((char*)mFrameHeaderBuffer, mFrameHeaderSize * sizeof(uint64_t));
+	//loop back to the first frame after the last one
+	int nextFrame = mCurrentFrame + 1;
+	if (nextFrame >= (int)mFrameOffsets.size()) {
+		nextFrame = 0;
+	}
 
-	//find the indexs of all the blocks that need updating 
-	std::vector<int> blockIds = DecodeFrameHeader(mFrameHeaderBuffer);
+	return SeekFrame(nextFrame);
+}
 
-	//if no changes between frames return last frame's smoke 
-	if (blockIds.size() == 0) {
+float* ReadWriteSmoke::SeekFrame(int frame)
+{
+	if (mFrameOffsets.empty()) {
+		return mCurrentFrameSmokeGrid;
+	}
+
+	frame = std::min(std::max(frame, 0), (int)mFrameOffsets.size() - 1);
+	if (frame == mCurrentFrame) {
 		return mCurrentFrameSmokeGrid;
 	}
 
-	//read blocks from file and apply changes to grid
-	ApplyFrameChanges(blockIds);
+	//going backwards starts again from the first frame, the walk back stops at the keyframe before the frame
+	int firstFrame = (frame < mCurrentFrame) ? 0 : mCurrentFrame + 1;
+	if (firstFrame == 0 && CopyLoopSnapshot(frame, mCurrentFrameSmokeGrid)) { firstFrame = 1; }
+	if (!mThreadPool) { mThreadPool = new ThreadPool(); }
+	DecodeFrames(frame, firstFrame, mCurrentFrameSmokeGrid, nullptr, mFrameHeaderBuffer, mThreadPool);
 
-	//return the grid
+	mCurrentFrame = frame;
 	return mCurrentFrameSmokeGrid;
 }
 
-void ReadWriteSmoke::ApplyFrameChanges(std::vector<int> changedBlocksIds)
+void ReadWriteSmoke::DecodeFrame(int frame, float* grid, int gridFrame)
 {
-	int x{}, y{}, z{}, blockIndex, blockCounter;
+	if (mFrameOffsets.empty()) { return; }
+
+	frame = std::min(std::max(frame, 0), (int)mFrameOffsets.size() - 1);
+	if (frame == gridFrame) { return; }
+
+	int firstFrame = GetDecodeStart(frame, gridFrame);
+	if (firstFrame == 0 && CopyLoopSnapshot(frame, grid)) { firstFrame = 1; }
 
-	//iterate over all the changed blocks
-	for (size_t i = 0; i < changedBlocksIds.size(); i++)
+	//own header buffer, so threads never share anything they write to
+	std::vector<uint64_t> headerBuffer(GetFrameHeaderWords());
+	DecodeFrames(frame, firstFrame, grid, nullptr, headerBuffer.data());
+}
+
+void ReadWriteSmoke::DecodeFrame(int frame, BrickGrid& grid, int gridFrame)
+{
+	if (mFrameOffsets.empty()) { return; }
+	if (!MatchesBrickLayout(grid)) {
+		throw std::invalid_argument("Brick grid doesn't match the simulation's blocks");
+	}
+
+	frame = std::min(std::max(frame, 0), (int)mFrameOffsets.size() - 1);
+	if (frame == gridFrame) { return; }
+
+	std::vector<uint64_t> headerBuffer(GetFrameHeaderWords());
+	DecodeFrames(frame, GetDecodeStart(frame, gridFrame), nullptr, &grid, headerBuffer.data());
+}
+
+void ReadWriteSmoke::SetLoopMode(LoopMode loopMode)
+{
+	mLoopMode = loopMode;
+	if (loopMode == LoopFromKeyframe || mFrameOffsets.empty()) {
+		std::vector<float>().swap(mLoopSnapshot);
+		return;
+	}
+
+	//decoded once, then only ever read, so threads decoding frames can share it
+	if (!mThreadPool) { mThreadPool = new ThreadPool(); }
+	mLoopSnapshot.assign((size_t)mGridWidth * mGridWidth * mGridWidth, 0.0f);
+	DecodeFrames(0, 0, mLoopSnapshot.data(), nullptr, mFrameHeaderBuffer, mThreadPool);
+}
+
+ReadWriteSmoke::LoopMode ReadWriteSmoke::GetLoopMode()
+{
+	return mLoopMode;
+}
+
+bool ReadWriteSmoke::CopyLoopSnapshot(int frame, float* grid)
+{
+	//only helps before the second keyframe, after that decoding stops at a later keyframe
+	if (mLoopSnapshot.empty() || (mKeyframeInterval > 0 && frame >= mKeyframeInterval)) { return false; }
+
+	std::copy(mLoopSnapshot.begin(), mLoopSnapshot.end(), grid);
+	return true;
+}
+
+int ReadWriteSmoke::GetDecodeStart(int frame, int gridFrame)
+{
+	//the grid's frame only helps if there's no keyframe between it and the wanted frame
+	int keyframe = (mKeyframeInterval > 0) ? frame - frame % mKeyframeInterval : 0;
+	return (gridFrame >= keyframe && gridFrame < frame) ? gridFrame + 1 : 0;
+}
+
+void ReadWriteSmoke::DecodeFrames(int frame, int firstFrame, float* grid, BrickGrid* bricks, uint64_t* headerBuffer, ThreadPool* threadPool)
+{
+	uint64_t headerBytes = GetFrameHeaderWords() * sizeof(uint64_t);
+	int totalBlocks = mBlockArrayWidth * mBlockArrayWidth * mBlockArrayWidth;
+
+	//only the newest copy of each block is needed, so walk back from the wanted frame and take each block 
+	//the first time it's seen. a keyframe sets every block, so the walk never goes past one
+	struct StoredBlock { int id; BlockMode mode; const char* data; uint32_t size; float* brick; };
+	std::vector<StoredBlock> newestBlocks;
+	std::vector<bool> blockDone(totalBlocks, false);
+	int blocksLeft = totalBlocks;
+
+	//reused by every frame of the walk
+	std::vector<int> blockIds;
+	blockIds.reserve(totalBlocks);
+	uint64_t summaryBytes = GetHeaderSummaryWords() * sizeof(uint64_t);
+
+	for (int f = frame; f >= firstFrame && blocksLeft > 0; f--)
 	{
-		//read the next block into memory
-		mReadFileStream.read((char*)mReadBlockBuffer, mBlockSize * sizeof(float));
+		const char* frameStart = mMappedFile + mFrameOffsets[f];
 
-		//calculate the block's starting coords
-		blockIndex = changedBlocksIds[i];
-		x = mBlockWidth * (blockIndex % mBlockArrayWidth);
-		y = mBlockWidth * ((blockIndex / (mBlockArrayWidth)) % mBlockArrayWidth);
-		z = mBlockWidth * ((blockIndex / (mBlockArrayWidth * mBlockArrayWidth)));
+		//a frame where nothing changed has an empty summary, so the rest of its header isn't needed
+		if (bHeaderSummary) {
+			uint64_t* summary = headerBuffer + GetFrameHeaderWords() - GetHeaderSummaryWords();
+			memcpy(summary, frameStart + headerBytes - summaryBytes, summaryBytes);
+			if (std::all_of(summary, summary + GetHeaderSummaryWords(), [](uint64_t word) { return word == 0; })) { continue; }
+		}
+
+		//read the frame header data
+		memcpy(headerBuffer, frameStart, headerBytes);
 
-		//iterate over whole block
-		blockCounter = 0;
+		//find the indexs of all the blocks stored in this frame, they're stored in the same order
+		DecodeFrameHeader(headerBuffer, blockIds);
+		const char* lengthTable = frameStart + headerBytes;
+		const char* blockData = lengthTable + ((bCompressBlocks) ? blockIds.size() * sizeof(uint32_t) : 0);
 
-		//loop through all the block's values, updating the grid, in the blocks location, using the file data
-		for (size_t gridZ = z; gridZ < z + mBlockWidth; gridZ++)
+		for (size_t i = 0; i < blockIds.size(); i++)
 		{
-			for (size_t gridY = y; gridY < y + mBlockWidth; gridY++)
-			{
-				for (size_t gridX = x; gridX < x + mBlockWidth; gridX++)
-				{
-					mCurrentFrameSmokeGrid[I3D(gridX, gridY, gridZ)] = mReadBlockBuffer[blockCounter];
-					blockCounter++;
+			uint32_t size = GetStoredBlockSize(headerBuffer, blockIds[i], lengthTable, (int)i);
+
+			if (!blockDone[blockIds[i]]) {
+				//files without modes only have raw blocks, or compressed ones which are shorter
+				BlockMode mode = (bBlockModes) ? GetBlockMode(headerBuffer, blockIds[i])
+					: ((size != (uint32_t)mEncodedBlockSize) ? CompressedBlock : RawBlock);
+
+				//bricks are allocated here, as allocating isn't safe across threads
+				float* brick = (bricks) ? bricks->Touch(blockIds[i]) : nullptr;
+				newestBlocks.push_back({ blockIds[i], mode, blockData, size, brick });
+				blockDone[blockIds[i]] = true;
+				blocksLeft--;
+			}
+			blockData += size;
+		}
+	}
+
+	//every block is written to a different place, so they can be decoded in any order. a corrupt block can't
+	//throw on a worker thread, so it stops every thread and is thrown once they're done
+	std::atomic<bool> corrupt{ false };
+	auto decodeBlocks = [&](int start, int end) {
+		std::vector<char> encoded((bCompressBlocks) ? mEncodedBlockSize : 0), scratch(encoded.size());
+		std::vector<float> decoded((mBlockEncoding == FloatBlocks) ? 0 : mBlockSize);
+
+		for (int b = start; b < end && !corrupt; b++) {
+			const StoredBlock& block = newestBlocks[b];
+			const char* data = block.data;
+
+			//zero and constant blocks are filled straight in, they have nothing to decode
+			if (block.mode == ZeroBlock || block.mode == ConstantBlock) {
+				float value = 0.0f;
+				if (block.mode == ConstantBlock) { memcpy(&value, data, sizeof(float)); }
+
+				if (block.brick) { std::fill_n(block.brick, mBlockSize, value); }
+				else { FillBlockInGrid(block.id, value, grid); }
+				continue;
+			}
+
+			if (block.mode == CompressedBlock) {
+				if (!BlockCodec::Decompress(data, block.size, mEncodedBlockSize, GetEncodedValueSize(), GetEncodedPrefixSize(), encoded.data(), scratch.data())) {
+					corrupt = true;
+					return;
 				}
+				data = encoded.data();
 			}
+
+			//bricks are laid out the same as blocks, so the whole block is decoded in one go
+			if (block.brick) { DecodeBlock(data, block.brick); }
+			else if (mBlockEncoding == FloatBlocks) { CopyBlockToGrid(block.id, (const float*)data, grid); }
+			else {
+				DecodeBlock(data, decoded.data());
+				CopyBlockToGrid(block.id, decoded.data(), grid);
+			}
+		}
+	};
+
+	if (threadPool) { threadPool->ParallelFor(0, (int)newestBlocks.size(), decodeBlocks); }
+	else { decodeBlocks(0, (int)newestBlocks.size()); }
+
+	if (corrupt) { throw std::runtime_error("Compressed block is corrupt"); }
+}
+
+void ReadWriteSmoke::CopyBlockToGrid(int blockIndex, const float* block, float* grid)
+{
+	//calculate the block's starting coords and how much of it is inside the grid
+	int x, y, z, width, height, depth;
+	GetBlockExtent(blockIndex, x, y, z, width, height, depth);
+
+	//copy each row of the block into the grid, in the blocks location
+	for (int blockZ = 0; blockZ < depth; blockZ++)
+	{
+		for (int blockY = 0; blockY < height; blockY++)
+		{
+			memcpy(&grid[I3D(x, y + blockY, z + blockZ)],
+				block + mBlockWidth * blockY + mBlockWidth * mBlockWidth * blockZ, width * sizeof(float));
 		}
 	}
+}
+
+void ReadWriteSmoke::GetBlockExtent(int blockIndex, int& x, int& y, int& z, int& width, int& height, int& depth)
+{
+	x = mBlockWidth * (blockIndex % mBlockArrayWidth);
+	y = mBlockWidth * ((blockIndex / (mBlockArrayWidth)) % mBlockArrayWidth);
+	z = mBlockWidth * ((blockIndex / (mBlockArrayWidth * mBlockArrayWidth)));
+
+	//blocks on the far edges can hang over the grid
+	width = std::min(mBlockWidth, mGridWidth - x);
+	height = std::min(mBlockWidth, mGridWidth - y);
+	depth = std::min(mBlockWidth, mGridWidth - z);
+}
+
+void ReadWriteSmoke::FillBlockInGrid(int blockIndex, float value, float* grid)
+{
+	//calculate the block's starting coords and how much of it is inside the grid
+	int x, y, z, width, height, depth;
+	GetBlockExtent(blockIndex, x, y, z, width, height, depth);
+
+	//fill each row of the block's location in the grid
+	for (int blockZ = 0; blockZ < depth; blockZ++)
+	{
+		for (int blockY = 0; blockY < height; blockY++)
+		{
+			std::fill_n(&grid[I3D(x, y + blockY, z + blockZ)], width, value);
+		}
+	}
+}
+
+void ReadWriteSmoke::CopyGridToBlock(int blockIndex, const float* grid, float* block)
+{
+	//calculate the block's starting coords and how much of it is inside the grid
+	int x, y, z, width, height, depth;
+	GetBlockExtent(blockIndex, x, y, z, width, height, depth);
+
+	//the block buffer is reused, so cells over the grid's edge are cleared to the padding's 0
+	if (width < mBlockWidth || height < mBlockWidth || depth < mBlockWidth) { std::fill_n(block, mBlockSize, 0.0f); }
+
+	//copy each row of the grid in the block's location into the block
+	for (int blockZ = 0; blockZ < depth; blockZ++)
+	{
+		for (int blockY = 0; blockY < height; blockY++)
+		{
+			memcpy(block + mBlockWidth * blockY + mBlockWidth * mBlockWidth * blockZ,
+				&grid[I3D(x, y + blockY, z + blockZ)], width * sizeof(float));
+		}
+	}
+}
+
+void ReadWriteSmoke::WriteBlock(const float* block, int blockIndex)
+{
+	size_t frameSize = mFramePayload.size();
+
+	//blocks of one value, usually empty space, only need the value if anything
+	bool constant = true;
+	for (int i = 1; i < mBlockSize && constant; i++) { constant = block[i] == block[0]; }
+
+	if (constant) {
+		BlockMode mode = (block[0] == 0.0f) ? ZeroBlock : ConstantBlock;
+		uint32_t length = (mode == ConstantBlock) ? sizeof(float) : 0;
+
+		mFramePayload.resize(frameSize + length);
+		if (length > 0) { memcpy(mFramePayload.data() + frameSize, block, sizeof(float)); }
+		SetBlockMode(mWriteHeaderBuffer, blockIndex, mode);
+		mPayloadLengths.push_back(length);
+		return;
+	}
+
+	const char* encoded = (const char*)block;
+	if (mBlockEncoding != FloatBlocks) {
+		EncodeBlock(block, mEncodedBlockBuffer.data());
+		encoded = mEncodedBlockBuffer.data();
+	}
+
+	mFramePayload.resize(frameSize + mEncodedBlockSize);
+	uint32_t length = mEncodedBlockSize;
+	if (bCompressBlocks) {
+		length = BlockCodec::Compress(encoded, mEncodedBlockSize, GetEncodedValueSize(), GetEncodedPrefixSize(),
+			mFramePayload.data() + frameSize, mCompressionScratch.data());
+	}
+	else { memcpy(mFramePayload.data() + frameSize, encoded, mEncodedBlockSize); }
+
+	SetBlockMode(mWriteHeaderBuffer, blockIndex, (length < (uint32_t)mEncodedBlockSize) ? CompressedBlock : RawBlock);
+	mFramePayload.resize(frameSize + length);
+	mPayloadLengths.push_back(length);
+}
+
+void ReadWriteSmoke::EndFrame()
+{
+	if (bHeaderSummary) { BuildHeaderSummary(mWriteHeaderBuffer); }
+
+	//the header goes first, now every block's mode is known, then the length of each block if they're compressed, then the blocks
+	size_t headerBytes = GetFrameHeaderWords() * sizeof(uint64_t);
+	size_t tableBytes = (bCompressBlocks) ? mPayloadLengths.size() * sizeof(uint32_t) : 0;
+
+	if (mFrameSink) {
+		mFrameBytes.resize(headerBytes + tableBytes + mFramePayload.size());
+		memcpy(mFrameBytes.data(), mWriteHeaderBuffer, headerBytes);
+		memcpy(mFrameBytes.data() + headerBytes, mPayloadLengths.data(), tableBytes);
+		memcpy(mFrameBytes.data() + headerBytes + tableBytes, mFramePayload.data(), mFramePayload.size());
+		mFrameSink(mFrameBytes);
+	}
+	else {
+		mWriteFileStream.write((const char*)mWriteHeaderBuffer, headerBytes);
+		mWriteFileStream.write((const char*)mPayloadLengths.data(), tableBytes);
+		mWriteFileStream.write(mFramePayload.data(), mFramePayload.size());
+	}
+	mWrittenFrameOffsets.push_back(mWriteOffset);
+	mWriteOffset += headerBytes + tableBytes + mFramePayload.size();
+
+	mPayloadLengths.clear();
+	mFramePayload.clear();
+	std::fill_n(mWriteHeaderBuffer + mFrameHeaderSize, GetFrameHeaderWords() - mFrameHeaderSize, 0);
+}
+
+void ReadWriteSmoke::BuildHeaderSummary(uint64_t* frameHeader)
+{
+	//the summary is the header's last words
+	uint64_t* summary = frameHeader + GetFrameHeaderWords() - GetHeaderSummaryWords();
+	std::fill_n(summary, GetHeaderSummaryWords(), 0);
+
+	for (int word = 0; word < mFrameHeaderSize; word++) {
+		if (frameHeader[word] != 0) { summary[word / 64] |= 1ULL << (word % 64); }
+	}
+}
+
+void ReadWriteSmoke::SetBlockMode(uint64_t* frameHeader, int blockIndex, BlockMode mode)
+{
+	//2 bits per block after the flagged bits
+	uint64_t& word = frameHeader[mFrameHeaderSize + blockIndex / 32];
+	int shift = (blockIndex % 32) * 2;
+	word = (word & ~(3ULL << shift)) | ((uint64_t)mode << shift);
+}
+
+ReadWriteSmoke::BlockMode ReadWriteSmoke::GetBlockMode(const uint64_t* frameHeader, int blockIndex)
+{
+	return (BlockMode)((frameHeader[mFrameHeaderSize + blockIndex / 32] >> ((blockIndex % 32) * 2)) & 3);
+}
+
+uint32_t ReadWriteSmoke::GetStoredBlockSize(const uint64_t* frameHeader, int blockIndex, const char* lengthTable, int tableIndex)
+{
+	uint32_t size = mEncodedBlockSize;
+	if (bCompressBlocks) { memcpy(&size, lengthTable + tableIndex * sizeof(uint32_t), sizeof(uint32_t)); }
+	else if (bBlockModes) {
+		BlockMode mode = GetBlockMode(frameHeader, blockIndex);
+		if (mode == ZeroBlock) { size = 0; }
+		else if (mode == ConstantBlock) { size = sizeof(float); }
+	}
+
+	return size;
+}
+
+void ReadWriteSmoke::EncodeBlock(const float* block, char* encoded)
+{
+	if (mBlockEncoding == FloatBlocks) {
+		memcpy(encoded, block, mBlockSize * sizeof(float));
+		return;
+	}
+
+	//range of the block's values, split into the most steps the value size can count
+	float minValue = block[0], maxValue = block[0];
+	for (int i = 1; i < mBlockSize; i++) {
+		minValue = std::min(minValue, block[i]);
+		maxValue = std::max(maxValue, block[i]);
+	}
+	float steps = (mBlockEncoding == Quantised8Blocks) ? 255.0f : 65535.0f;
+	float step = (maxValue - minValue) / steps;
+	float inverseStep = (step > 0.0f) ? 1.0f / step : 0.0f;
+
+	memcpy(encoded, &minValue, sizeof(float));
+	memcpy(encoded + sizeof(float), &step, sizeof(float));
+	char* values = encoded + 2 * sizeof(float);
+
+	//round each value to the nearest step
+	for (int i = 0; i < mBlockSize; i++) {
+		float count = std::min((block[i] - minValue) * inverseStep + 0.5f, steps);
+
+		if (mBlockEncoding == Quantised8Blocks) { ((uint8_t*)values)[i] = (uint8_t)count; }
+		else {
+			uint16_t value = (uint16_t)count;
+			memcpy(values + i * sizeof(uint16_t), &value, sizeof(uint16_t));
+		}
+	}
+}
+
+void ReadWriteSmoke::DecodeBlock(const char* encoded, float* block)
+{
+	if (mBlockEncoding == FloatBlocks) {
+		memcpy(block, encoded, mBlockSize * sizeof(float));
+		return;
+	}
 
+	float minValue, step;
+	memcpy(&minValue, encoded, sizeof(float));
+	memcpy(&step, encoded + sizeof(float), sizeof(float));
+	const char* values = encoded + 2 * sizeof(float);
+
+	if (mBlockEncoding == Quantised8Blocks) {
+		for (int i = 0; i < mBlockSize; i++) { block[i] = minValue + ((const uint8_t*)values)[i] * step; }
+	}
+	else {
+		for (int i = 0; i < mBlockSize; i++) {
+			uint16_t value;
+			memcpy(&value, values + i * sizeof(uint16_t), sizeof(uint16_t));
+			block[i] = minValue + value * step;
+		}
+	}
 }
 
 void ReadWriteSmoke::StopRead()
 {
-	//close file stream and free memory
-	mReadFileStream.close();
+	//unmap the file and free memory
+	UnmapFile();
 
-	delete[](mReadBlockBuffer);
 	delete[](mFrameHeaderBuffer);
-	delete[](mCurrentFrameSmokeGrid);
+	free(mCurrentFrameSmokeGrid);
+	std::vector<float>().swap(mLoopSnapshot);
+	mFrameHeaderBuffer = nullptr;
+	mCurrentFrameSmokeGrid = nullptr;
+}
+
+bool ReadWriteSmoke::MapFile(const std::string& path)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) { return false; }
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	//the view keeps the mapping and file open, so the handles can be closed straight away
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping) { return false; }
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view) { return false; }
+
+	mMappedSize = (uint64_t)fileSize.QuadPart;
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) { return false; }
+
+	struct stat fileInfo;
+	if (fstat(file, &fileInfo) != 0 || fileInfo.st_size == 0) {
+		close(file);
+		return false;
+	}
+
+	//the mapping keeps the file open, so it can be closed straight away
+	void* view = mmap(nullptr, fileInfo.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (view == MAP_FAILED) { return false; }
+
+	mMappedSize = (uint64_t)fileInfo.st_size;
+#endif
+
+	mMappedFile = (const char*)view;
+	return true;
+}
+
+void ReadWriteSmoke::UnmapFile()
+{
+	if (!mMappedFile) { return; }
+
+#if defined(_WIN32)
+	UnmapViewOfFile(mMappedFile);
+#else
+	munmap((void*)mMappedFile, mMappedSize);
+#endif
+
+	mMappedFile = nullptr;
+	mMappedSize = 0;
+	mFrameOffsets.clear();
+	bFrameOffsetTable = false;
+}
+
+bool ReadWriteSmoke::ReadKeyframeTrailer(uint64_t trailerEnd)
+{
+	if (!(mFileFlags & KeyframeTrailerFlag) || trailerEnd < 8 * sizeof(uint32_t) + sizeof(uint64_t)) { return false; }
+
+	//the amount of keyframes is the last value in the trailer, their offsets come before it
+	uint64_t keyframeCount;
+	memcpy(&keyframeCount, mMappedFile + trailerEnd - sizeof(uint64_t), sizeof(uint64_t));
+	if (keyframeCount == 0 || keyframeCount > (trailerEnd - 8 * sizeof(uint32_t)) / sizeof(uint64_t) - 1) { return false; }
+
+	mKeyframeOffsets.resize(keyframeCount);
+	memcpy(mKeyframeOffsets.data(), mMappedFile + trailerEnd - (keyframeCount + 1) * sizeof(uint64_t), keyframeCount * sizeof(uint64_t));
+
+	//every offset has to start a frame
+	for (uint64_t offset : mKeyframeOffsets) {
+		if (!std::binary_search(mFrameOffsets.begin(), mFrameOffsets.end(), offset)) {
+			mKeyframeOffsets.clear();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ReadWriteSmoke::ReadFrameOffsetTable(uint64_t& tableStart)
+{
+	uint64_t fileHeaderBytes = 8 * sizeof(uint32_t);
+	if (!(mFileFlags & FrameOffsetTableFlag) || mMappedSize < fileHeaderBytes + sizeof(uint64_t)) { return false; }
+
+	//the amount of frames is the last value in the file, their offsets come before it
+	uint64_t frameCount;
+	memcpy(&frameCount, mMappedFile + mMappedSize - sizeof(uint64_t), sizeof(uint64_t));
+	if (frameCount == 0 || frameCount > (mMappedSize - fileHeaderBytes) / sizeof(uint64_t) - 1) { return false; }
+
+	tableStart = mMappedSize - (frameCount + 1) * sizeof(uint64_t);
+	mFrameOffsets.resize(frameCount);
+	memcpy(mFrameOffsets.data(), mMappedFile + tableStart, frameCount * sizeof(uint64_t));
+
+	//frames start straight after the file header, and each one after the last, before the trailers
+	bool valid = mFrameOffsets[0] == fileHeaderBytes;
+	for (uint64_t f = 1; f < frameCount && valid; f++) {
+		valid = mFrameOffsets[f] > mFrameOffsets[f - 1];
+	}
+	valid = valid && mFrameOffsets.back() + GetFrameHeaderWords() * sizeof(uint64_t) <= tableStart;
+
+	if (!valid) {
+		mFrameOffsets.clear();
+		return false;
+	}
+
+	return true;
+}
+
+void ReadWriteSmoke::BuildFrameOffsets()
+{
+	mFrameOffsets.clear();
+
+	uint64_t headerBytes = GetFrameHeaderWords() * sizeof(uint64_t);
+	uint64_t blockBytes = mEncodedBlockSize;
+
+	//frames start straight after the file header
+	uint64_t offset = 8 * sizeof(uint32_t);
+
+	//the starting frame plus every added frame, stopping early if the file was cut short
+	for (int frame = 0; frame <= mSimulationTotalFrames; frame++)
+	{
+		if (offset + headerBytes > mMappedSize) { break; }
+
+		//each flagged bit is one block stored after the header
+		memcpy(mFrameHeaderBuffer, mMappedFile + offset, headerBytes);
+		uint64_t blockCount = 0;
+		for (int i = 0; i < mFrameHeaderSize; i++) {
+			blockCount += CountBits(mFrameHeaderBuffer[i]);
+		}
+
+		uint64_t frameEnd = offset + headerBytes + blockCount * blockBytes;
+
+		//zero and constant blocks are shorter, so without a length table each flagged block's mode is needed
+		if (bBlockModes && !bCompressBlocks) {
+			frameEnd = offset + headerBytes;
+			for (int word = 0; word < mFrameHeaderSize; word++) {
+				for (uint64_t bits = mFrameHeaderBuffer[word]; bits != 0; bits &= bits - 1) {
+					int b = word * 64 + LowestSetBit(bits);
+					frameEnd += GetStoredBlockSize(mFrameHeaderBuffer, b, nullptr, 0);
+				}
+			}
+		}
+
+		//compressed blocks are each as long as the table after the header says
+		if (bCompressBlocks) {
+			uint64_t tableEnd = offset + headerBytes + blockCount * sizeof(uint32_t);
+			if (tableEnd > mMappedSize) { break; }
+
+			frameEnd = tableEnd;
+			for (uint64_t b = 0; b < blockCount; b++) {
+				uint32_t length;
+				memcpy(&length, mMappedFile + offset + headerBytes + b * sizeof(uint32_t), sizeof(uint32_t));
+				frameEnd += length;
+			}
+		}
+		if (frameEnd > mMappedSize) { break; }
+
+		mFrameOffsets.push_back(offset);
+		offset = frameEnd;
+	}
 }
 
 void ReadWriteSmoke::StopWrite()
 {
+	//write where each keyframe starts, followed by how many there are
+	uint64_t keyframeCount = mKeyframeOffsets.size();
+	mWriteFileStream.write((char*)mKeyframeOffsets.data(), keyframeCount * sizeof(uint64_t));
+	mWriteFileStream.write((char*)&keyframeCount, sizeof(uint64_t));
+
+	//then where every frame starts, followed by how many there are, so reading doesn't walk every frame
+	uint64_t frameCount = mWrittenFrameOffsets.size();
+	mWriteFileStream.write((char*)mWrittenFrameOffsets.data(), frameCount * sizeof(uint64_t));
+	mWriteFileStream.write((char*)&frameCount, sizeof(uint64_t));
+	mWrittenFrameOffsets.clear();
+
 	//close file stream
 	mWriteFileStream.close();
+	FreeBlockArenas();
 	std::fstream fileStream;
 
 #ifdef NDEBUG
@@ -226,7 +968,8 @@ void ReadWriteSmoke::StopWrite()
 #endif 
 
 	//encode the header with the final frame count to block of 4-byte-ints
-	uint32_t* header = EncodeFileHeader(mGridWidth, mBlockWidth, mBlockArrayWidth, mFrameHeaderSize, mFrameCounter);
+	uint32_t* header = EncodeFileHeader(mGridWidth, mBlockWidth, mBlockArrayWidth, mFrameHeaderSize, mFrameCounter, mKeyframeInterval,
+		KeyframeTrailerFlag | FrameOffsetTableFlag | GetBlockFlags());
 	
 	//set the file stream to the start of the file
 	fileStream.seekp(0, std::ios_base::beg);
@@ -237,19 +980,40 @@ void ReadWriteSmoke::StopWrite()
 	//close file
 	fileStream.close();
 
-	delete[](header);
+	free(header);
+}
+
+bool ReadWriteSmoke::StartFrame()
+{
+	//keyframes store every block, so decoding can start from them
+	if (!IsKeyframe(mFrameCounter + 1)) { return false; }
+
+	mKeyframeOffsets.push_back(mWriteOffset);
+	return true;
 }
 
-void ReadWriteSmoke::WriteFrameHeader(std::vector<int> blockIndexs)
+void ReadWriteSmoke::EncodeChangedBlocks(const std::vector<float*>& previousFrame, const std::vector<float*>& currentFrame, bool allBlocks)
 {
-	//encode the block indexs to frame header format
-	uint64_t* header = EncodeFrameHeader(blockIndexs);
+	if (StartFrame() || allBlocks) {
+		EncodeFrameHeader(mFullBlockIds, mWriteHeaderBuffer);
+	}
+	else {
+		GetDifferenceBitset(previousFrame, currentFrame, mWriteHeaderBuffer);
+	}
+}
 
-	//write the frame's header to file
-	mWriteFileStream.write((char*)header, mFrameHeaderSize * sizeof(uint64_t));
+void ReadWriteSmoke::WriteFrame(const std::vector<float*>& currentDensity, const uint64_t* frameHeader)
+{
+	//write each flagged block, lowest index first
+	for (int word = 0; word < mFrameHeaderSize; word++) {
+		for (uint64_t bits = frameHeader[word]; bits != 0; bits &= bits - 1) {
+			int bit = LowestSetBit(bits);
+			WriteBlock(currentDensity[word * 64 + bit], word * 64 + bit);
+		}
+	}
 }
 
-void ReadWriteSmoke::WriteFrame(const std::vector<float*>& currentDensity, std::vector<int> blockIndexs)
+void ReadWriteSmoke::WriteFrame(const std::vector<float*>& currentDensity, const std::vector<int>& blockIndexs)
 {
 	//loop through all idexes of the blocks needing writing to file
 	for (size_t i = 0; i < blockIndexs.size(); i++)
@@ -258,14 +1022,15 @@ void ReadWriteSmoke::WriteFrame(const std::vector<float*>& currentDensity, std::
 		float* block = currentDensity[blockIndexs[i]];
 
 		//write whole block to file
-		mWriteFileStream.write((char*)block, mBlockSize * sizeof(float));
+		WriteBlock(block, blockIndexs[i]);
 	}
 }
 
-uint32_t* ReadWriteSmoke::EncodeFileHeader(uint32_t gridWidth, uint32_t blockWidth, uint32_t blockGridWidth, uint32_t frameHeaderSize, uint32_t totalFrames)
+uint32_t* ReadWriteSmoke::EncodeFileHeader(uint32_t gridWidth, uint32_t blockWidth, uint32_t blockGridWidth, uint32_t frameHeaderSize, uint32_t totalFrames,
+	uint32_t keyframeInterval, uint32_t flags)
 {
-	//allocate 256 bit header, using the first 20 bytes for info on format of the saved file
-	uint32_t* header = (uint32_t*)malloc(8 * sizeof(uint32_t));
+	//allocate 256 bit header, using all 32 bytes for info on format of the saved file
+	uint32_t* header = (uint32_t*)calloc(8, sizeof(uint32_t));
 
 	//assign the first 5 values
 	header[0] = gridWidth;
@@ -274,6 +1039,11 @@ uint32_t* ReadWriteSmoke::EncodeFileHeader(uint32_t gridWidth, uint32_t blockWid
 	header[3] = frameHeaderSize;
 	header[4] = totalFrames;
 
+	//format version and keyframe settings
+	header[5] = FileFormatVersion;
+	header[6] = keyframeInterval;
+	header[7] = flags;
+
 	return header;
 }
 
@@ -287,9 +1057,26 @@ void ReadWriteSmoke::DecodeFileHeader(uint32_t* header, int& gridWidth, int& blo
 	totalFrames = header[4];
 }
 
-uint64_t* ReadWriteSmoke::EncodeFrameHeader(std::vector<int> blockIndexs)
+void ReadWriteSmoke::DecodeFileHeader(uint32_t* header, int& keyframeInterval, uint32_t& flags)
 {
-	uint64_t* frameHeader = (uint64_t*)calloc(mFrameHeaderSize, sizeof(uint64_t));
+	//files from before the version was stored have unset values here
+	bool hasVersion = header[5] == FileFormatVersion;
+	keyframeInterval = (hasVersion) ? (int)header[6] : 0;
+	flags = (hasVersion) ? header[7] : 0;
+}
+
+uint64_t* ReadWriteSmoke::EncodeFrameHeader(const std::vector<int>& blockIndexs)
+{
+	//room for the modes and summary too, so the header can be decoded like one from the file
+	uint64_t* frameHeader = (uint64_t*)calloc(GetFrameHeaderWords(), sizeof(uint64_t));
+	EncodeFrameHeader(blockIndexs, frameHeader);
+
+	return frameHeader;
+}
+
+void ReadWriteSmoke::EncodeFrameHeader(const std::vector<int>& blockIndexs, uint64_t* frameHeader)
+{
+	std::fill_n(frameHeader, mFrameHeaderSize, 0);
 
 	for (size_t i = 0; i < blockIndexs.size(); i++)
 	{
@@ -303,44 +1090,56 @@ uint64_t* ReadWriteSmoke::EncodeFrameHeader(std::vector<int> blockIndexs)
 		frameHeader[index] += 1LL << bitIndex;
 	}
 
-	return frameHeader;
+	if (bHeaderSummary) { BuildHeaderSummary(frameHeader); }
 }
 
 std::vector<int> ReadWriteSmoke::DecodeFrameHeader(uint64_t* frameHeader)
 {
 	//holds the indexes of all flaged blocks
 	std::vector<int> blockIds = std::vector<int>();
+	DecodeFrameHeader(frameHeader, blockIds);
 
-	for (size_t i = 0; i < mFrameHeaderSize; i++)
-	{
-		//contains info about 64 blocks, i.e: i = 0, info is about 0-64 blocks
-		uint64_t blocksInfo = frameHeader[i];
+	return blockIds;
+}
 
-		for (size_t j = 0; j < 64; j++)
-		{
-			//check if the current bit is flagged
-			if ((blocksInfo >> j) & 1) {
-				blockIds.push_back(j + 64 * i);
+int ReadWriteSmoke::DecodeFrameHeader(const uint64_t* frameHeader, std::vector<int>& blockIds)
+{
+	blockIds.clear();
+
+	//each word contains info about 64 blocks, i.e: word 0 is about blocks 0-63. only the flagged bits are visited
+	auto decodeWord = [&](int word) {
+		for (uint64_t bits = frameHeader[word]; bits != 0; bits &= bits - 1) {
+			blockIds.push_back(word * 64 + LowestSetBit(bits));
+		}
+	};
+
+	if (bHeaderSummary) {
+		//each summary bit marks a word with flagged blocks, so empty words are never read
+		const uint64_t* summary = frameHeader + GetFrameHeaderWords() - GetHeaderSummaryWords();
+		for (int summaryWord = 0; summaryWord < GetHeaderSummaryWords(); summaryWord++) {
+			for (uint64_t words = summary[summaryWord]; words != 0; words &= words - 1) {
+				decodeWord(summaryWord * 64 + LowestSetBit(words));
 			}
 		}
 	}
+	else {
+		for (int word = 0; word < mFrameHeaderSize; word++) { decodeWord(word); }
+	}
 
-	return blockIds;
+	return (int)blockIds.size();
 }
 
 
 bool ReadWriteSmoke::IsValidSplit(int blockWidth, int& blockArrayWidth)
 {
-	//get number of blocks in one dimension
-	blockArrayWidth = mGridWidth / blockWidth;
-	int excess = mGridWidth % blockWidth;
-
-	//check if there are excess cells outside of the blocks
-	if (excess != 0) {
-		std::cout << "ERROR: there are excces cells: " << mGridWidth % blockWidth << " from " << mGridWidth << " blockwidth:" << blockWidth << "\n";
+	if (blockWidth <= 0 || blockWidth > mGridWidth) {
+		std::cout << "ERROR: block width " << blockWidth << " doesn't fit grid width " << mGridWidth << "\n";
 		return false;
 	}
 
+	//get number of blocks in one dimension, excess cells go in padded blocks on the far edges
+	blockArrayWidth = (mGridWidth + blockWidth - 1) / blockWidth;
+
 	return true;
 }
 
@@ -356,38 +1155,47 @@ std::vector<float*> ReadWriteSmoke::SplitGrid(float* grid)
 	//create an array of blocks, using ptr to float arrays
 	std::vector<float*> blocks = std::vector<float*>();
 
-	//allocate and fill the blocks 
+	//allocate the blocks 
 	for (size_t i = 0; i < mBlockArrayWidth * mBlockArrayWidth * mBlockArrayWidth; i++)
 	{
 		float* block = (float*)calloc(mBlockSize, sizeof(float));
 		blocks.push_back(block);
 	}
 
-	//loop through grid
-	for (size_t z = 0; z < mGridWidth; z++)
+	//fill the blocks
+	SplitGrid(grid, blocks);
+
+	return blocks;
+}
+
+void ReadWriteSmoke::SplitGrid(const float* grid, const std::vector<float*>& blocks)
+{
+	//loop through grid in memory order, each row of x is split into a row of each block along it
+	for (int z = 0; z < mGridWidth; z++)
 	{
-		for (size_t x = 0; x < mGridWidth; x++)
-		{
-			for (size_t y = 0; y < mGridWidth; y++)
-			{
-				//find index of the block for the grid's current cell
-				int blockIndex = (int)(x / mBlockWidth) + mBlockArrayWidth * (int)(y / mBlockWidth) + mBlockArrayWidth * mBlockArrayWidth * (int)(z / mBlockWidth);
+		int zBlockIndexOffset = mBlockArrayWidth * mBlockArrayWidth * (z / mBlockWidth);
+		int zCellIndexOffset = mBlockWidth * mBlockWidth * (z % mBlockWidth);
 
-				//find the cell in the block for the grid's current cell
-				int cellIndex = (x % mBlockWidth) + (mBlockWidth * (y % mBlockWidth)) + (mBlockWidth * mBlockWidth * (z % mBlockWidth));
+		for (int y = 0; y < mGridWidth; y++)
+		{
+			int blockIndex = mBlockArrayWidth * (y / mBlockWidth) + zBlockIndexOffset;
+			int cellIndex = mBlockWidth * (y % mBlockWidth) + zCellIndexOffset;
+			const float* row = grid + I3D(0, y, z);
 
-				//set the cell in the split grid
-				blocks[blockIndex][cellIndex] = grid[I3D(x, y, z)];
+			//copy the row's section in each block, the last can be cut short by the grid's edge
+			for (int blockX = 0; blockX < mBlockArrayWidth; blockX++)
+			{
+				int width = std::min(mBlockWidth, mGridWidth - blockX * mBlockWidth);
+				std::copy_n(row + blockX * mBlockWidth, width, blocks[blockIndex + blockX] + cellIndex);
 			}
 		}
 	}
-
-	return blocks;
 }
 
 float* ReadWriteSmoke::JoinGrids(std::vector<float*> grids)
 {
-	int totalGridCellCount = mBlockArrayWidth * mBlockArrayWidth * mBlockArrayWidth * mBlockSize;
+	//padding in the edge blocks is dropped
+	int totalGridCellCount = mGridWidth * mGridWidth * mGridWidth;
 
 	//create the resulting grid
 	float* resultGrid = (float*)malloc(totalGridCellCount * sizeof(float));
@@ -431,31 +1239,142 @@ int ReadWriteSmoke::GetTotalFrameCount()
 	return mSimulationTotalFrames;
 }
 
+int ReadWriteSmoke::GetFrameHeaderSize()
+{
+	return mFrameHeaderSize;
+}
+
+int ReadWriteSmoke::GetStoredFrameCount()
+{
+	return (int)mFrameOffsets.size();
+}
+
+int ReadWriteSmoke::GetCurrentFrame()
+{
+	return mCurrentFrame;
+}
+
+uint64_t ReadWriteSmoke::GetFrameOffset(int frame)
+{
+	return mFrameOffsets[frame];
+}
+
+int ReadWriteSmoke::GetKeyframeInterval()
+{
+	return mKeyframeInterval;
+}
+
+bool ReadWriteSmoke::HasFrameOffsetTable()
+{
+	return bFrameOffsetTable;
+}
+
+ReadWriteSmoke::BlockEncoding ReadWriteSmoke::GetBlockEncoding()
+{
+	return mBlockEncoding;
+}
+
+int ReadWriteSmoke::GetEncodedValueSize()
+{
+	switch (mBlockEncoding) {
+	case Quantised16Blocks: return sizeof(uint16_t);
+	case Quantised8Blocks: return sizeof(uint8_t);
+	default: return sizeof(float);
+	}
+}
+
+int ReadWriteSmoke::GetEncodedPrefixSize()
+{
+	//quantised blocks start with their min and step size
+	return (mBlockEncoding == FloatBlocks) ? 0 : 2 * sizeof(float);
+}
+
+uint32_t ReadWriteSmoke::GetBlockFlags()
+{
+	return ((uint32_t)mBlockEncoding << BlockEncodingShift) | ((bCompressBlocks) ? CompressedBlocksFlag : 0) | ((bBlockModes) ? BlockModesFlag : 0)
+		| ((bHeaderSummary) ? HeaderSummaryFlag : 0);
+}
+
+bool ReadWriteSmoke::HasCompressedBlocks()
+{
+	return bCompressBlocks;
+}
+
+bool ReadWriteSmoke::HasBlockModes()
+{
+	return bBlockModes;
+}
+
+bool ReadWriteSmoke::HasHeaderSummary()
+{
+	return bHeaderSummary;
+}
+
+int ReadWriteSmoke::GetFrameHeaderWords()
+{
+	//two 64-bit-ints of modes for every one of flagged bits, then a bit for each one of flagged bits
+	return ((bBlockModes) ? 3 * mFrameHeaderSize : mFrameHeaderSize) + GetHeaderSummaryWords();
+}
+
+int ReadWriteSmoke::GetHeaderSummaryWords()
+{
+	return (bHeaderSummary) ? (mFrameHeaderSize + 63) / 64 : 0;
+}
+
+int ReadWriteSmoke::GetEncodedBlockSize()
+{
+	return GetEncodedPrefixSize() + mBlockSize * GetEncodedValueSize();
+}
+
+bool ReadWriteSmoke::IsKeyframe(int frame)
+{
+	return frame == 0 || (mKeyframeInterval > 0 && frame % mKeyframeInterval == 0);
+}
+
+const std::vector<uint64_t>& ReadWriteSmoke::GetKeyframeOffsets()
+{
+	return mKeyframeOffsets;
+}
+
 inline std::vector<int> ReadWriteSmoke::GetDifferenceSplitGrids(const std::vector<float*>& grid1, const std::vector<float*>& grid2)
 {
 	//stores the indexs of all the blocks which are different 
 	std::vector<int> differentBlocks = std::vector<int>();
+	GetDifferenceSplitGrids(grid1, grid2, differentBlocks);
+
+	return differentBlocks;
+}
+
+inline void ReadWriteSmoke::GetDifferenceSplitGrids(const std::vector<float*>& grid1, const std::vector<float*>& grid2, std::vector<int>& differentBlocks)
+{
+	differentBlocks.clear();
 
 	for (size_t i = 0; i < grid1.size(); i++)
 	{
-		//get current block of values from both grids
-		float* block1 = grid1[i];
-		float* block2 = grid2[i];
-
-		//iterate over the whole block checking for a difference
-		for (size_t j = 0; j < mBlockSize; j++)
-		{
-			//if difference between the two, add the block index to the list of differences
-			if (abs(block1[j] - block2[j]) > 0.000001) {
-				differentBlocks.push_back(i);
-				break;
-			}
+		//if difference between the two, add the block index to the list of differences
+		if (BlocksDiffer(grid1[i], grid2[i], mBlockSize)) {
+			differentBlocks.push_back(i);
 		}
 	}
+}
 
-	std::cout << "Block Differences: " << differentBlocks.size() << " / " << grid1.size() << "\n";
+void ReadWriteSmoke::GetDifferenceBitset(const std::vector<float*>& grid1, const std::vector<float*>& grid2, uint64_t* frameHeader)
+{
+	if (!mThreadPool) { mThreadPool = new ThreadPool(); }
+	int totalBlocks = (int)grid1.size();
 
-	return differentBlocks;
+	//split by header word, so each thread only writes its own 64 blocks' bits
+	mThreadPool->ParallelFor(0, mFrameHeaderSize, [&](int wordStart, int wordEnd) {
+		for (int word = wordStart; word < wordEnd; word++) {
+			uint64_t bits = 0;
+			int blockEnd = std::min(word * 64 + 64, totalBlocks);
+
+			for (int b = word * 64; b < blockEnd; b++) {
+				if (BlocksDiffer(grid1[b], grid2[b], mBlockSize)) { bits |= 1ULL << (b - word * 64); }
+			}
+			frameHeader[word] = bits;
+		}
+	});
 }
 
 inline std::vector<int> ReadWriteSmoke::GetFullBlockIdList()
@@ -479,3 +1398,52 @@ inline void ReadWriteSmoke::ClearVec(std::vector<float*> vec)
 		delete[]( vec[i] );
 	}
 }
+
+void ReadWriteSmoke::AllocateBlockArenas()
+{
+	FreeBlockArenas();
+	AllocateFrameCopies();
+
+	int totalBlocks = mBlockArrayWidth * mBlockArrayWidth * mBlockArrayWidth;
+	mWriteHeaderBuffer = (uint64_t*)calloc(GetFrameHeaderWords(), sizeof(uint64_t));
+	mWriteBlockBuffer.resize(mBlockSize);
+	mEncodedBlockBuffer.resize(mEncodedBlockSize);
+	mCompressionScratch.resize(mEncodedBlockSize);
+	mBrickBlocks.resize(totalBlocks);
+	mFullBlockIds = GetFullBlockIdList();
+}
+
+void ReadWriteSmoke::FreeBlockArenas()
+{
+	FreeFrameCopies();
+	free(mWriteHeaderBuffer);
+	mWriteHeaderBuffer = nullptr;
+}
+
+bool ReadWriteSmoke::AllocateFrameCopies()
+{
+	if (mBlockArenas[0]) { return false; }
+
+	int totalBlocks = mBlockArrayWidth * mBlockArrayWidth * mBlockArrayWidth;
+	mBlockArenas[0] = (float*)calloc((size_t)totalBlocks * mBlockSize, sizeof(float));
+	mBlockArenas[1] = (float*)calloc((size_t)totalBlocks * mBlockSize, sizeof(float));
+
+	//each block is a slice of its frame's arena
+	mPreviousFrameSmoke.resize(totalBlocks);
+	mCurrentFrameSmoke.resize(totalBlocks);
+	for (int b = 0; b < totalBlocks; b++) {
+		mPreviousFrameSmoke[b] = mBlockArenas[0] + (size_t)b * mBlockSize;
+		mCurrentFrameSmoke[b] = mBlockArenas[1] + (size_t)b * mBlockSize;
+	}
+
+	return true;
+}
+
+void ReadWriteSmoke::FreeFrameCopies()
+{
+	free(mBlockArenas[0]); free(mBlockArenas[1]);
+	mBlockArenas[0] = mBlockArenas[1] = nullptr;
+
+	mPreviousFrameSmoke.clear();
+	mCurrentFrameSmoke.clear();
+}
@@ -6,6 +6,10 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <functional>
+
+#include "BrickGrid.hpp"
+#include "ThreadPool.hpp"
 
 /**
 * SIMULATION COMPRESSION:
@@ -15,6 +19,8 @@
 * 
 * the file only stores the differences between frames, but first splits the grid into smaller sections called 'blocks'
 * eg. for a block width of 8: block 1. x(0,7), y(0,7), z(0,7) | block 2. x(8,15), y(0,7), z(0,7) etc.
+* if the grid isn't a multiple of the block width, the last blocks on each axis hang over the edge and the 
+* cells outside the grid are stored as 0
 * 
 * when storing a frame, it splits the density and compares blocks from the preivous frame's density
 * only needed to store blocks which have changed
@@ -33,14 +39,39 @@
 *   3. read the blocks data back into the current density grid
 *	4. repeat for next frame 
 * 
+* the file is memory mapped when reading, and where each frame starts is read from the file's trailer. files 
+* without one have their frame headers walked once to build the same table. a frame's size is its header plus 
+* the size of each flagged block, from its mode or the length table, so this never touches the block data. any 
+* frame can then be found without reading the ones before it, and seeking or looping back to the start never 
+* reopens the file
+* 
+* with 8 wide blocks the blocks are laid out the same as the bricks of a BrickGrid, so a simulation using 
+* sparse storage can be written from and read into its bricks directly, without splitting or joining the grid
+* 
+* every K frames a keyframe is written, storing every block like the first frame. decoding a frame only needs
+* the frames back to the keyframe before it, so seeking is cheap and separate threads can decode the frames 
+* between different keyframes at the same time
+* 
 * 
 * SIMULATION FILE FORMAT:
 * 
-* 32 bytes - File header: contains the simulation information - smoke size, compression details, frame count
+* 32 bytes - File header: 8 4-byte-ints
+*	0. grid width, 1. block width, 2. blocks along one side, 3. frame header size, 4. frame count
+*	5. format version, 6. keyframe interval, 7. flags - older files have no version and only the first frame is a keyframe
+*	flags: bit 0 keyframe trailer, bit 1 compressed blocks, bit 2 block modes, bit 3 frame offset table, 
+*	bit 4 header summary, bits 8-15 block encoding
 * 
 * Frame header - block of 64-bit-ints, amount determined from file header 
+*	with the block modes flag the bits are followed by twice as many 64-bit-ints holding 2 bits per block, 
+*	saying how each flagged block is stored: raw, all zero, one constant value, or compressed. zero blocks have 
+*	no data and constant blocks are just the value as a 32-bit-float, so reading them never decodes anything
+*	with the header summary flag the header ends with 1 bit for each 64-bit-int of flagged bits, set if any 
+*	block in it is flagged, so frames where little changed are read without looking at every bit
 * 
-* Frame Data - blocks of simulation data, 32-bit-floats, amount of blocks and indexes determined from frame header
+* Frame Data - blocks of simulation data, amount of blocks and indexes determined from frame header. 
+*	float blocks are 32-bit-floats. quantised blocks are the block's min and step size as 32-bit-floats, 
+*	followed by each value as an 8 or 16 bit count of steps above the min
+*	compressed blocks have a table of each block's length as 32-bit-ints before them, see BlockCodec
 * 
 * Frame Header 
 * 
@@ -48,7 +79,11 @@
 * 
 * etc.
 * 
-* no end file, using frame count to stop reading
+* Keyframe trailer - the byte offset of each keyframe as 64-bit-ints, followed by the amount of keyframes.
+* only written if the trailer flag is set
+* 
+* Frame offset table - the byte offset of every frame as 64-bit-ints, followed by the amount of frames. after 
+* the keyframe trailer, only written if the frame offset table flag is set
 **/
 
 
@@ -61,7 +96,32 @@ public:
 
 	//default constructor and desctructor
 	ReadWriteSmoke() = default;
-	~ReadWriteSmoke() = default;
+	~ReadWriteSmoke();
+
+	//file header values for the current format
+	static const uint32_t FileFormatVersion = 0x534D4B02;
+	static const uint32_t KeyframeTrailerFlag = 1;
+	static const uint32_t CompressedBlocksFlag = 2;
+	static const uint32_t BlockModesFlag = 4;
+	static const uint32_t FrameOffsetTableFlag = 8;
+	static const uint32_t HeaderSummaryFlag = 16;
+	static const int DefaultKeyframeInterval = 30;
+	static const uint32_t BlockEncodingShift = 8;
+
+	//a block is only written again once a value moves further than this from the last written frame
+	static const float ChangeTolerance;
+
+	//how each block's values are stored. quantised blocks store every value as a step between the block's min and
+	//max, so no value is further than half a step from what was written: (max - min) / 65535 / 2 for 16 bit and
+	//(max - min) / 255 / 2 for 8 bit. files are 2 or 4 times smaller
+	enum BlockEncoding { FloatBlocks = 0, Quantised16Blocks = 1, Quantised8Blocks = 2 };
+
+	//how a flagged block is stored in a frame, zero and constant blocks are written whatever the block encoding
+	enum BlockMode { RawBlock = 0, ZeroBlock = 1, ConstantBlock = 2, CompressedBlock = 3 };
+
+	//how reading gets back to the start when it loops or seeks backwards. from the keyframe decodes every block of
+	//the first frame again, from a snapshot copies a decoded first frame kept for the whole read
+	enum LoopMode { LoopFromKeyframe = 0, LoopFromSnapshot = 1 };
 
 	//Writing
 	/// <summary>
@@ -72,7 +132,11 @@ public:
 	/// <param name="gridWidth">- smoke grid width in one dimesion </param>
 	/// <param name="startingSmokeDensity">- pointer to smoke's starting density  </param>
 	/// <param name="blockWidth">- size of the blocks a simulation is split into   </param>
-	void WriteInit(std::string fileName, int gridWidth, float * startingSmokeDensity, int blockWidth);
+	/// <param name="keyframeInterval">- frames between keyframes which store every block, 0 for only the first frame </param>
+	/// <param name="blockEncoding">- how each block's values are stored, quantised blocks are smaller but lossy </param>
+	/// <param name="compressBlocks">- losslessly compresses each encoded block </param>
+	void WriteInit(std::string fileName, int gridWidth, float * startingSmokeDensity, int blockWidth, int keyframeInterval = DefaultKeyframeInterval,
+		BlockEncoding blockEncoding = FloatBlocks, bool compressBlocks = false);
 
 	/// <summary>
 	/// adds the frame to the current simulation and saves to disk
@@ -80,6 +144,42 @@ public:
 	/// <param name="smokeDensity"> current frame's smoke density </param>
 	void AddFrame(float* smokeDensity);
 
+	/// <summary>
+	/// adds the frame straight from a brick grid, comparing and writing each brick without splitting the grid.
+	/// missing bricks are written as empty blocks. the bricks must match the blocks, see MatchesBrickLayout
+	/// </summary>
+	void AddFrame(const BrickGrid& smokeDensity);
+
+	/// <summary>
+	/// true if the file's blocks are the same as the bricks of the given grid
+	/// </summary>
+	bool MatchesBrickLayout(const BrickGrid& grid);
+
+	/// <summary>
+	/// adds the frame using a mask of the blocks which changed, as given by Smoke::GetChangedBricks, instead of 
+	/// comparing against the previous frame. the previous frame's copy is freed and only rebuilt if a frame is 
+	/// added without a mask again. needs UsesBrickBlocks
+	/// </summary>
+	/// <param name="changedBricks"> one bit per block, in frame header order </param>
+	void AddFrame(float* smokeDensity, const uint64_t* changedBricks);
+
+	/// <summary>
+	/// true if the blocks are 8 wide, so they're the same as a simulation's bricks, including those over the edge
+	/// </summary>
+	bool UsesBrickBlocks();
+
+	/// <summary>
+	/// hands each finished frame to the sink instead of writing it, so frames can be encoded on one thread and
+	/// written on another with WriteFrameBytes. the sink may swap the bytes out to keep them. nullptr writes
+	/// frames straight to file again
+	/// </summary>
+	void SetFrameSink(std::function<void(std::vector<char>&)> sink);
+
+	/// <summary>
+	/// writes a frame given to the frame sink, frames must be written in the order they were added
+	/// </summary>
+	void WriteFrameBytes(const std::vector<char>& frame);
+
 	//Reading
 	/// <summary>
 	/// reading smoke simulation initalisation, opens the file and decodes the header, setting all values
@@ -88,16 +188,44 @@ public:
 	void ReadInit(std::string fileName);
 
 	/// <summary>
-	/// read the next frame from the simulation file
+	/// read the next frame from the simulation file, after the last frame it loops back to the first, see SetLoopMode
 	/// </summary>
 	/// <returns> pointer to grid of the next frames density values </returns>
 	float* ReadNextFrame();
 
 	/// <summary>
-	/// Reads each changed block from the file and directly applys to simulation
+	/// sets the density grid to the given frame. frames only store the blocks that changed, so moving forward 
+	/// applies each frame in between, and moving backwards starts again from the first frame which stores every block
+	/// </summary>
+	/// <returns> pointer to grid of the frame's density values </returns>
+	float* SeekFrame(int frame);
+
+	/// <summary>
+	/// decodes a frame into the given grid without changing the reader, so several threads can decode at once.
+	/// starts from the keyframe before the frame, unless the grid already holds an earlier frame after that keyframe
+	/// </summary>
+	/// <param name="grid"> - grid of the simulation's size to decode into </param>
+	/// <param name="gridFrame"> - frame already in the grid, -1 if unknown </param>
+	void DecodeFrame(int frame, float* grid, int gridFrame = -1);
+
+	/// <summary>
+	/// decodes a frame into a brick grid, copying each block straight into its brick
+	/// </summary>
+	void DecodeFrame(int frame, BrickGrid& grid, int gridFrame = -1);
+
+	/// <summary>
+	/// sets how reading loops back to the start. a snapshot is decoded straight away and costs a grid of memory,
+	/// then looping, seeking back and decoding any frame before the second keyframe start from it. the file 
+	/// stays open and nothing is reallocated either way. call it after ReadInit but before a FramePrefetcher
+	/// starts decoding from this reader, it replaces the snapshot those decodes read and uses the reader's
+	/// own frame header buffer and thread pool
+	/// </summary>
+	void SetLoopMode(LoopMode loopMode);
+
+	/// <summary>
+	/// how reading loops back to the start
 	/// </summary>
-	/// <param name="changedBlocksIds"></param>
-	void ApplyFrameChanges(std::vector<int> changedBlocksIds);
+	LoopMode GetLoopMode();
 
 	//closing
 	/// <summary>
@@ -115,7 +243,8 @@ public:
 	/// encode the simluation information to a block of 4-byte-ints
 	/// </summary>
 	/// <returns> a block of 8 4-byte-ints containing simulation info </returns>
-	uint32_t* EncodeFileHeader(uint32_t gridWidth, uint32_t blockWidth, uint32_t blockGridWidth, uint32_t frameHeaderSize, uint32_t totalFrames);
+	uint32_t* EncodeFileHeader(uint32_t gridWidth, uint32_t blockWidth, uint32_t blockGridWidth, uint32_t frameHeaderSize, uint32_t totalFrames,
+		uint32_t keyframeInterval = 0, uint32_t flags = 0);
 
 	/// <summary>
 	/// decode the simulation information from the file header to the output parameters 
@@ -123,34 +252,52 @@ public:
 	/// <param name="header"> file header as a block of 4-byte-ints </param>
 	void DecodeFileHeader(uint32_t* header, int& gridWidth, int& blockWidth, int& blockGridWidth, int& frameHeaderSizeint, int& totalFrames);
 
+	/// <summary>
+	/// decode the keyframe settings, older files without a version only have the first frame as a keyframe
+	/// </summary>
+	void DecodeFileHeader(uint32_t* header, int& keyframeInterval, uint32_t& flags);
+
 	//Writing Frames
 	/// <summary>
 	/// Writes the data for this frame to file, writes every block which changed since last frame
 	/// </summary>
 	/// <param name="currentDensity"> this frame's smoke density grid </param>
 	/// <param name="blockIndexs"> indexes of every block which needs to be written to file </param>
-	void WriteFrame(const std::vector<float*>& currentDensity, std::vector<int> blockIndexs);
+	void WriteFrame(const std::vector<float*>& currentDensity, const std::vector<int>& blockIndexs);
 
 	/// <summary>
-	/// writes the current frame's header to file, containing the indexes of all blocks which changed from last frames
+	/// writes every block flagged in the frame header, in the order they're flagged
 	/// </summary>
-	/// <param name="blockIndexs"> list indexes of all blocks which changed from last frames </param>
-	void WriteFrameHeader(std::vector<int> blockIndexs);
+	void WriteFrame(const std::vector<float*>& currentDensity, const uint64_t* frameHeader);
 
 	/// <summary>
 	/// encode the indexes to a header of a block of 8-byte-ints  
 	/// </summary>
 	/// <param name="blockIndexs"> list of indexes of flagged blocks </param>
-	/// <returns> a block of 8-byte-ints encoded with the block indexes </returns>
-	uint64_t* EncodeFrameHeader(std::vector<int> blockIndexs);
+	/// <returns> a block of GetFrameHeaderWords 8-byte-ints encoded with the block indexes and their summary </returns>
+	uint64_t* EncodeFrameHeader(const std::vector<int>& blockIndexs);
+
+	/// <summary>
+	/// encode the indexes into an existing frame header, so writing doesn't allocate. the header needs
+	/// GetFrameHeaderWords 8-byte-ints, the modes are left as they are and the summary is rebuilt
+	/// </summary>
+	void EncodeFrameHeader(const std::vector<int>& blockIndexs, uint64_t* frameHeader);
 
 	/// <summary>
 	/// read the frame header from a block of 8-byte-ints to a list of indexes of each flagged block id
 	/// </summary>
-	/// <param name="frameHeader"> block of 8-byte-ints containing encoded index data </param>
+	/// <param name="frameHeader"> GetFrameHeaderWords 8-byte-ints containing encoded index data </param>
 	/// <returns> list of all flaged indexes </returns>
 	std::vector<int> DecodeFrameHeader(uint64_t* frameHeader);
 
+	/// <summary>
+	/// read the flagged block ids into an existing list, so decoding a frame doesn't allocate. only the words
+	/// marked in the header summary are looked at if the file has one
+	/// </summary>
+	/// <param name="blockIds"> out - cleared then filled with the flagged indexes, lowest first </param>
+	/// <returns> amount of flagged blocks </returns>
+	int DecodeFrameHeader(const uint64_t* frameHeader, std::vector<int>& blockIds);
+
 	//Splitting and Joining Grids
 	/// <summary>
 	/// splits the grid into a list of blocks, based on position of each cell 
@@ -159,6 +306,12 @@ public:
 	/// <returns> returns a list of the split grids </returns>
 	std::vector<float*> SplitGrid(float* grid);
 
+	/// <summary>
+	/// splits the grid into existing blocks, reading the grid in order a row of x at a time
+	/// </summary>
+	/// <param name="blocks"> blocks to fill, one per block index </param>
+	void SplitGrid(const float* grid, const std::vector<float*>& blocks);
+
 	/// <summary>
 	/// rejoin split grids into a singular array
 	/// </summary>
@@ -171,9 +324,20 @@ public:
 	/// <returns> list of indexes of each block that differs </returns>
 	inline std::vector<int> GetDifferenceSplitGrids(const std::vector<float*>& grid1, const std::vector<float*>& grid2);
 
+	/// <summary>
+	/// fills the list with the indexs of all blocks that differ, reusing the list's memory
+	/// </summary>
+	inline void GetDifferenceSplitGrids(const std::vector<float*>& grid1, const std::vector<float*>& grid2, std::vector<int>& differentBlocks);
+
+	/// <summary>
+	/// flags every block that differs in a frame header, comparing ranges of blocks on each thread
+	/// </summary>
+	/// <param name="frameHeader"> frame header to fill, one bit per block </param>
+	void GetDifferenceBitset(const std::vector<float*>& grid1, const std::vector<float*>& grid2, uint64_t* frameHeader);
+
 	//Checks
 	/// <summary>
-	/// checks if the wanted block width is valid
+	/// checks if the wanted block width is valid, any width up to the grid's is, padding the edge blocks
 	/// </summary>
 	/// <param name="blockWidth"> size of one dimension of a block </param>
 	/// <returns> true if grid can be split into blocks of the given size </returns>
@@ -181,7 +345,7 @@ public:
 
 	/// <summary>
 	/// checks if the wanted block width is valid, sets the amount of blocks per grid, in one dimesion,
-	/// through parameter
+	/// through parameter, including the padded blocks over the edge
 	/// </summary>
 	/// <param name="blockWidth"> size of one dimension of a block </param>
 	/// <param name="blockArrayWidth"> out - amount of blocks in one side of the grid </param>
@@ -192,6 +356,86 @@ public:
 	int GetSimulationGridWidth();
 	int GetTotalFrameCount();
 
+	/// <summary>
+	/// 64-bit-ints of flagged block bits in each frame header, the size of a changed brick mask
+	/// </summary>
+	int GetFrameHeaderSize();
+
+	/// <summary>
+	/// frames stored in the file, including the starting frame
+	/// </summary>
+	int GetStoredFrameCount();
+
+	/// <summary>
+	/// frame currently in the density grid, -1 before the first read
+	/// </summary>
+	int GetCurrentFrame();
+
+	/// <summary>
+	/// byte offset of the frame's header from the start of the file
+	/// </summary>
+	uint64_t GetFrameOffset(int frame);
+
+	/// <summary>
+	/// frames between keyframes, 0 if only the first frame is a keyframe
+	/// </summary>
+	int GetKeyframeInterval();
+
+	/// <summary>
+	/// true if the frame offsets were read from the file's table instead of walking the frame headers
+	/// </summary>
+	bool HasFrameOffsetTable();
+
+	/// <summary>
+	/// how the blocks are stored in the file
+	/// </summary>
+	BlockEncoding GetBlockEncoding();
+
+	/// <summary>
+	/// bytes one stored block takes up in the file
+	/// </summary>
+	int GetEncodedBlockSize();
+
+	/// <summary>
+	/// true if the blocks are compressed
+	/// </summary>
+	bool HasCompressedBlocks();
+
+	/// <summary>
+	/// true if the frame headers say how each block is stored, so zero and constant blocks take no space
+	/// </summary>
+	bool HasBlockModes();
+
+	/// <summary>
+	/// true if the frame headers end with a summary of which 64-bit-ints have flagged blocks
+	/// </summary>
+	bool HasHeaderSummary();
+
+	/// <summary>
+	/// 64-bit-ints in each frame header, the flagged blocks followed by their modes and summary if the file has them
+	/// </summary>
+	int GetFrameHeaderWords();
+
+	/// <summary>
+	/// 64-bit-ints of summary at the end of each frame header, 0 if the file has none
+	/// </summary>
+	int GetHeaderSummaryWords();
+
+	/// <summary>
+	/// how a block is stored, from a frame header with block modes
+	/// </summary>
+	BlockMode GetBlockMode(const uint64_t* frameHeader, int blockIndex);
+
+	/// <summary>
+	/// true if the frame stores every block
+	/// </summary>
+	bool IsKeyframe(int frame);
+
+	/// <summary>
+	/// byte offsets of the keyframes, from the file's trailer or worked out from the interval
+	/// </summary>
+	const std::vector<uint64_t>& GetKeyframeOffsets();
+
 	/// <summary>
 	/// returns list of ids from 0 - max amount of blocks
 	/// </summary>
@@ -203,21 +447,222 @@ public:
 	inline void ClearVec(std::vector<float*> vec);
 
 private:
+	/// <summary>
+	/// maps the whole file into memory for reading
+	/// </summary>
+	/// <returns> false if the file can't be opened </returns>
+	bool MapFile(const std::string& path);
+
+	/// <summary>
+	/// unmaps the file
+	/// </summary>
+	void UnmapFile();
+
+	/// <summary>
+	/// allocates the two block arenas the writer splits frames into, and the buffers used for every frame
+	/// </summary>
+	void AllocateBlockArenas();
+
+	/// <summary>
+	/// frees the block arenas and write buffers
+	/// </summary>
+	void FreeBlockArenas();
+
+	/// <summary>
+	/// allocates the previous and current frame's blocks if they aren't already
+	/// </summary>
+	/// <returns> true if they were allocated, and so don't hold the previous frame </returns>
+	bool AllocateFrameCopies();
+
+	/// <summary>
+	/// frees the previous and current frame's blocks
+	/// </summary>
+	void FreeFrameCopies();
+
+	/// <summary>
+	/// notes where the frame starts if it's a keyframe
+	/// </summary>
+	/// <returns> true if the frame is a keyframe, and so stores every block </returns>
+	bool StartFrame();
+
+	/// <summary>
+	/// fills the write header with the blocks to write this frame, every block on a keyframe or if allBlocks is set
+	/// </summary>
+	void EncodeChangedBlocks(const std::vector<float*>& previousFrame, const std::vector<float*>& currentFrame, bool allBlocks);
+
+	/// <summary>
+	/// walks the frame headers to find where each frame starts
+	/// </summary>
+	void BuildFrameOffsets();
+
+	/// <summary>
+	/// reads the keyframe offsets from the end of the file, or from before the frame offset table
+	/// </summary>
+	/// <param name="trailerEnd"> byte after the keyframe trailer </param>
+	/// <returns> false if the file has no trailer </returns>
+	bool ReadKeyframeTrailer(uint64_t trailerEnd);
+
+	/// <summary>
+	/// reads where each frame starts from the end of the file, checking each offset is in order and in the file
+	/// </summary>
+	/// <param name="tableStart"> out - first byte of the table </param>
+	/// <returns> false if the file has no table </returns>
+	bool ReadFrameOffsetTable(uint64_t& tableStart);
+
+	/// <summary>
+	/// cells of a block inside the grid along each axis, less than the block width for edge blocks
+	/// </summary>
+	void GetBlockExtent(int blockIndex, int& x, int& y, int& z, int& width, int& height, int& depth);
+
+	/// <summary>
+	/// decodes the frame into the grid, or the brick grid if given, walking back from it and taking each block's 
+	/// newest copy until every block is set or the first frame is reached. throws std::runtime_error after every
+	/// thread has stopped if a compressed block is corrupt
+	/// </summary>
+	/// <param name="threadPool"> threads to decode the blocks on, nullptr decodes them on the calling thread </param>
+	void DecodeFrames(int frame, int firstFrame, float* grid, BrickGrid* bricks, uint64_t* headerBuffer, ThreadPool* threadPool = nullptr);
+
+	/// <summary>
+	/// first frame to decode from to reach the frame, using the frame already in the grid if it helps
+	/// </summary>
+	int GetDecodeStart(int frame, int gridFrame);
+
+	/// <summary>
+	/// copies the first frame's snapshot into the grid if decoding the frame would otherwise start from the first frame
+	/// </summary>
+	/// <returns> true if copied, so decoding can start from the second frame </returns>
+	bool CopyLoopSnapshot(int frame, float* grid);
+
+	/// <summary>
+	/// copies a block's values into the density grid, in the block's location
+	/// </summary>
+	void CopyBlockToGrid(int blockIndex, const float* block, float* grid);
+
+	/// <summary>
+	/// copies the values in a block's location in the grid into the block
+	/// </summary>
+	void CopyGridToBlock(int blockIndex, const float* grid, float* block);
+
+	/// <summary>
+	/// adds a block to the frame being written, noting in the header if it's zero or constant so only 
+	/// what's needed is stored, otherwise storing it in the file's block encoding
+	/// </summary>
+	void WriteBlock(const float* block, int blockIndex);
+
+	/// <summary>
+	/// sets how a block is stored in the frame header's modes
+	/// </summary>
+	void SetBlockMode(uint64_t* frameHeader, int blockIndex, BlockMode mode);
+
+	/// <summary>
+	/// bytes a stored block takes up in the frame, from the length table if the blocks are compressed
+	/// </summary>
+	uint32_t GetStoredBlockSize(const uint64_t* frameHeader, int blockIndex, const char* lengthTable, int tableIndex);
+
+	/// <summary>
+	/// fills a block's location in the density grid with one value
+	/// </summary>
+	void FillBlockInGrid(int blockIndex, float value, float* grid);
+
+	/// <summary>
+	/// sets the summary bit of every 64-bit-int of the frame header with a flagged block
+	/// </summary>
+	void BuildHeaderSummary(uint64_t* frameHeader);
+
+	/// <summary>
+	/// writes the frame header, then the compressed blocks' lengths, then the blocks, once every block of the frame is added,
+	/// or hands them to the frame sink together
+	/// </summary>
+	void EndFrame();
+
+	/// <summary>
+	/// bytes of each encoded value, and of the values before them
+	/// </summary>
+	int GetEncodedValueSize();
+	int GetEncodedPrefixSize();
+
+	/// <summary>
+	/// file header flags for the block encoding and compression
+	/// </summary>
+	uint32_t GetBlockFlags();
+
+	/// <summary>
+	/// stores a block's values in the block encoding, quantising each value between the block's min and max
+	/// </summary>
+	/// <param name="encoded"> GetEncodedBlockSize bytes to fill </param>
+	void EncodeBlock(const float* block, char* encoded);
+
+	/// <summary>
+	/// reads an encoded block back to floats
+	/// </summary>
+	void DecodeBlock(const char* encoded, float* block);
+
 	std::string mFileName;
 
-	//file streams
+	//file stream for writing, and where the next frame starts in it, counted so frames can be encoded without the stream
 	std::ofstream mWriteFileStream;
-	std::ifstream mReadFileStream;
-
-	//for writing
+	uint64_t mWriteOffset{};
+
+	//takes finished frames instead of the file stream, and the frame it's given
+	std::function<void(std::vector<char>&)> mFrameSink;
+	std::vector<char> mFrameBytes;
+
+	//whole file mapped into memory for reading, and the byte offset of every frame
+	const char* mMappedFile = nullptr;
+	uint64_t mMappedSize = 0;
+	std::vector<uint64_t> mFrameOffsets;
+	bool bFrameOffsetTable = false;
+
+	//where each written frame starts, for the frame offset table
+	std::vector<uint64_t> mWrittenFrameOffsets;
+
+	//frame in the reader's grid
+	int mCurrentFrame = -1;
+
+	//decoded first frame to loop back to, only kept when looping from a snapshot
+	LoopMode mLoopMode = LoopFromKeyframe;
+	std::vector<float> mLoopSnapshot;
+
+	//frames between keyframes, and where each keyframe starts in the file
+	int mKeyframeInterval{};
+	uint32_t mFileFlags{};
+
+	//how blocks are stored, and the buffer for encoding a block to write
+	BlockEncoding mBlockEncoding = FloatBlocks;
+	int mEncodedBlockSize{};
+	std::vector<char> mEncodedBlockBuffer;
+
+	//stored blocks and their lengths for the frame being written, written together once the frame's header is done
+	bool bCompressBlocks = false;
+	bool bBlockModes = false;
+	bool bHeaderSummary = false;
+	std::vector<char> mFramePayload;
+	std::vector<uint32_t> mPayloadLengths;
+	std::vector<char> mCompressionScratch;
+	std::vector<uint64_t> mKeyframeOffsets;
+
+	//for writing, the previous and current frame's blocks point into two contiguous arenas which swap each frame,
+	//with the header and block lists kept between frames so writing never allocates
 	std::vector<float*> mPreviousFrameSmoke;
+	std::vector<float*> mCurrentFrameSmoke;
+	float* mBlockArenas[2] = { nullptr, nullptr };
+	uint64_t* mWriteHeaderBuffer = nullptr;
+	std::vector<int> mFullBlockIds;
+
+	//block copied out of the grid when writing from a changed brick mask
+	std::vector<float> mWriteBlockBuffer;
+
+	//each brick when writing from a brick grid, with missing bricks pointing at an empty block
+	std::vector<float*> mBrickBlocks;
+
+	//threads for diffing blocks and decoding frames, created on first use
+	ThreadPool* mThreadPool = nullptr;
 
 	//for reading track smoke grid
 	float* mCurrentFrameSmokeGrid;
 
-	//buffers for reading smoke files
+	//buffer for reading frame headers
 	uint64_t* mFrameHeaderBuffer;
-	float* mReadBlockBuffer;
 
 	int mFrameHeaderSize{};
 	int mBlockSize{};
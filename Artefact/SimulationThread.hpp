@@ -0,0 +1,239 @@
+#pragma once
+
+#include "Smoke.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+/**
+*	Runs a smoke simulation on its own thread, so the simulation and rendering overlap
+*
+*	finished density grids are handed to the renderer through a triple buffer. the simulation thread
+*	writes into the back buffer then swaps it with the middle one, the renderer swaps the middle
+*	buffer with its front buffer whenever a new one is waiting. neither side ever waits on the other
+*
+*	the smoke must only be changed through the command queue while the thread is running, commands
+*	are run on the simulation thread between updates
+**/
+
+
+class SimulationThread
+{
+public:
+	/// <summary>
+	/// starts simulating the smoke straight away
+	/// </summary>
+	/// <param name="stepSource"> - called on the simulation thread before every update, to add density or forces </param>
+	SimulationThread(Smoke* smoke, std::function<void(Smoke&)> stepSource = nullptr);
+	~SimulationThread();
+
+	/// <summary>
+	/// latest finished density grid, stays valid until the next call
+	/// </summary>
+	float* GetLatestDensity();
+
+	/// <summary>
+	/// queues a change to the smoke, run on the simulation thread before its next update
+	/// </summary>
+	void Submit(std::function<void(Smoke&)> command);
+
+	//common commands
+	void AddRandomDensityCloud(int radius, float density);
+	void ClearDensity();
+
+	/// <summary>
+	/// stops updating the smoke, commands are still run
+	/// </summary>
+	void SetPaused(bool paused);
+
+	/// <summary>
+	/// runs one update while paused
+	/// </summary>
+	void RequestStep();
+
+	/// <summary>
+	/// updates finished since the thread started
+	/// </summary>
+	int GetStepCount();
+
+	//longest time a single update simulates, so a slow update doesn't make the next one unstable,
+	//and the shortest, so the thread sleeps instead of spinning when the simulation is faster than real time
+	float maxStepTime = 0.1f;
+	float minStepTime = 1.0f / 120.0f;
+
+private:
+	/// <summary>
+	/// simulation loop, runs commands, updates the smoke and publishes the density
+	/// </summary>
+	void SimulationLoop();
+
+	/// <summary>
+	/// adds the step source, updates the smoke and publishes the density
+	/// </summary>
+	void Step(float deltaTime);
+
+	/// <summary>
+	/// copies the density into the back buffer and swaps it into the middle of the triple buffer
+	/// </summary>
+	void PublishDensity();
+
+	/// <summary>
+	/// runs every queued command
+	/// </summary>
+	/// <returns> true if any commands were run </returns>
+	bool RunCommands();
+
+	Smoke* mSmoke;
+	std::function<void(Smoke&)> mStepSource;
+
+	//triple buffer, the middle buffer's index and whether it's newer than the front one are kept together
+	//so both are swapped in one atomic exchange
+	static const int FreshBit = 4;
+	static const int IndexMask = 3;
+	float* mBuffers[3];
+	std::atomic<int> mMiddle;
+	int mBackIndex = 0;
+	int mFrontIndex = 2;
+
+	//commands waiting to be run on the simulation thread
+	std::mutex mCommandMutex;
+	std::vector<std::function<void(Smoke&)>> mCommands;
+
+	std::atomic<bool> bPaused{ false };
+	std::atomic<bool> bStepRequested{ false };
+	std::atomic<bool> bStopping{ false };
+	std::atomic<int> mStepCount{ 0 };
+
+	std::thread mThread;
+};
+
+
+inline SimulationThread::SimulationThread(Smoke* smoke, std::function<void(Smoke&)> stepSource) :
+	mSmoke(smoke), mStepSource(stepSource), mMiddle(1)
+{
+	//every buffer starts as the current density, so the renderer has something to draw before the first update
+	for (int b = 0; b < 3; b++) {
+		mBuffers[b] = (float*)calloc(mSmoke->mTotalCellCount, sizeof(float));
+		std::copy_n(mSmoke->mCurrentDensity, mSmoke->mTotalCellCount, mBuffers[b]);
+	}
+
+	mThread = std::thread(&SimulationThread::SimulationLoop, this);
+}
+
+inline SimulationThread::~SimulationThread()
+{
+	bStopping = true;
+	mThread.join();
+
+	for (int b = 0; b < 3; b++) { free(mBuffers[b]); }
+}
+
+inline float* SimulationThread::GetLatestDensity()
+{
+	//take the middle buffer if it's newer, giving back the one that was being drawn
+	if (mMiddle.load(std::memory_order_relaxed) & FreshBit) {
+		int middle = mMiddle.exchange(mFrontIndex, std::memory_order_acq_rel);
+		mFrontIndex = middle & IndexMask;
+	}
+
+	return mBuffers[mFrontIndex];
+}
+
+inline void SimulationThread::Submit(std::function<void(Smoke&)> command)
+{
+	std::lock_guard<std::mutex> lock(mCommandMutex);
+	mCommands.push_back(command);
+}
+
+inline void SimulationThread::AddRandomDensityCloud(int radius, float density)
+{
+	Submit([radius, density](Smoke& smoke) { smoke.AddRandomDensityCloud(radius, density); });
+}
+
+inline void SimulationThread::ClearDensity()
+{
+	Submit([](Smoke& smoke) { smoke.ClearDensity(); });
+}
+
+inline void SimulationThread::SetPaused(bool paused)
+{
+	bPaused = paused;
+}
+
+inline void SimulationThread::RequestStep()
+{
+	bStepRequested = true;
+}
+
+inline int SimulationThread::GetStepCount()
+{
+	return mStepCount;
+}
+
+inline void SimulationThread::SimulationLoop()
+{
+	auto previousStep = std::chrono::steady_clock::now();
+
+	while (!bStopping)
+	{
+		//changes from the render thread go in before the update
+		bool changed = RunCommands();
+
+		auto now = std::chrono::steady_clock::now();
+		float deltaTime = std::chrono::duration<float>(now - previousStep).count();
+
+		//paused time isn't simulated, a requested step simulates the shortest step
+		if (bPaused) {
+			previousStep = now;
+			if (bStepRequested.exchange(false)) { Step(minStepTime); continue; }
+
+			if (changed) { PublishDensity(); }
+			std::this_thread::sleep_for(std::chrono::duration<float>(minStepTime));
+			continue;
+		}
+
+		//sleep off the rest of a short step
+		if (deltaTime < minStepTime) {
+			if (changed) { PublishDensity(); }
+			std::this_thread::sleep_for(std::chrono::duration<float>(minStepTime - deltaTime));
+			continue;
+		}
+
+		previousStep = now;
+		Step(std::min(deltaTime, maxStepTime));
+	}
+}
+
+inline void SimulationThread::Step(float deltaTime)
+{
+	if (mStepSource) { mStepSource(*mSmoke); }
+	mSmoke->Update(deltaTime);
+
+	PublishDensity();
+	mStepCount++;
+}
+
+inline void SimulationThread::PublishDensity()
+{
+	std::copy_n(mSmoke->mCurrentDensity, mSmoke->mTotalCellCount, mBuffers[mBackIndex]);
+
+	//swap the back buffer into the middle, marked as new, and write into whatever was there next
+	int middle = mMiddle.exchange(mBackIndex | FreshBit, std::memory_order_acq_rel);
+	mBackIndex = middle & IndexMask;
+}
+
+inline bool SimulationThread::RunCommands()
+{
+	std::vector<std::function<void(Smoke&)>> commands;
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+		commands.swap(mCommands);
+	}
+
+	for (auto& command : commands) { command(*mSmoke); }
+	return !commands.empty();
+}
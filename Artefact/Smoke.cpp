@@ -2,48 +2,129 @@
 #include <iostream>
 #include <chrono>
 #include <ctime>
-
-Smoke::Smoke(int resolution):
-	mGridWidth(resolution - 2)
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <memory>
+
+//vectorised advection is only built for x86, checking the cpu supports it at runtime
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SMOKE_SIMD_ADVECTION
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+//msvc allows any instruction set's intrinsics in any function
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#include <cpuid.h>
+//gcc and clang need each function marked with the instruction set it uses
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#endif
+
+Smoke::Smoke(int resolution, GridStorage storage):
+	mGridWidth(resolution - 2), mStorage(storage)
 {
 	SetupRandomGenerator();
 
 	//total cells in each grid
 	mTotalCellCount = (mGridWidth + 2) * (mGridWidth + 2) * (mGridWidth + 2);
 
-	//allocate density grid pointers at 0
+	//allocate density grid pointers at 0, with sparse storage this is a copy of the density bricks
 	mCurrentDensity = (float*)calloc(mTotalCellCount, sizeof(float));
-	mPrevDensity = (float*)calloc(mTotalCellCount, sizeof(float));
 
-	//allocate velocity grid pointers at 0
-	mCurVelU = (float*)calloc(mTotalCellCount, sizeof(float));
-	mCurVelV = (float*)calloc(mTotalCellCount, sizeof(float));
-	mCurVelW = (float*)calloc(mTotalCellCount, sizeof(float));
+	if (mStorage == SparseStorage) {
+		//density and velocity bricks, plus pressure and divergence for projecting
+		mBrickDensity = new BrickGrid(mGridWidth); mBrickPrevDensity = new BrickGrid(mGridWidth);
+		mBrickVelU = new BrickGrid(mGridWidth); mBrickVelV = new BrickGrid(mGridWidth); mBrickVelW = new BrickGrid(mGridWidth);
+		mBrickPrevVelU = new BrickGrid(mGridWidth); mBrickPrevVelV = new BrickGrid(mGridWidth); mBrickPrevVelW = new BrickGrid(mGridWidth);
+		mBrickPressure = new BrickGrid(mGridWidth); mBrickDivergence = new BrickGrid(mGridWidth);
+
+		//none of the dense grids are used
+		mPrevDensity = nullptr;
+		mCurVelU = mCurVelV = mCurVelW = nullptr;
+		mPrevVelU = mPrevVelV = mPrevVelW = nullptr;
+		tempBufX = tempBuf = mCurlPlanes = nullptr;
+		mAmbientVelU = mAmbientVelV = mAmbientVelW = nullptr;
+	}
+	else {
+		mPrevDensity = (float*)calloc(mTotalCellCount, sizeof(float));
+
+		//allocate velocity grid pointers at 0
+		mCurVelU = (float*)calloc(mTotalCellCount, sizeof(float));
+		mCurVelV = (float*)calloc(mTotalCellCount, sizeof(float));
+		mCurVelW = (float*)calloc(mTotalCellCount, sizeof(float));
+
+		mPrevVelU = (float*)calloc(mTotalCellCount, sizeof(float));
+		mPrevVelV = (float*)calloc(mTotalCellCount, sizeof(float));
+		mPrevVelW = (float*)calloc(mTotalCellCount, sizeof(float));
+
+		//allocate temporary buffers
+		tempBufX = (float*)calloc(mTotalCellCount, sizeof(float));
+		tempBuf = (float*)calloc(mTotalCellCount, sizeof(float));
+
+		//rolling curl planes for the force sweep, x y z and magnitude for each plane
+		mCurlPlanes = (float*)calloc(mCurlPlaneCount * 4 * (mGridWidth + 2) * (mGridWidth + 2), sizeof(float));
+
+		//allocate ambient vel grids
+		mAmbientVelU = (float*)calloc(mTotalCellCount, sizeof(float));
+		mAmbientVelV = (float*)calloc(mTotalCellCount, sizeof(float));
+		mAmbientVelW = (float*)calloc(mTotalCellCount, sizeof(float));
+	}
+
+	//worker threads for the solver kernels, one per core
+	mThreadPool = new ThreadPool();
 
-	mPrevVelU = (float*)calloc(mTotalCellCount, sizeof(float));
-	mPrevVelV = (float*)calloc(mTotalCellCount, sizeof(float));
-	mPrevVelW = (float*)calloc(mTotalCellCount, sizeof(float));
+	//nothing to simulate until density or velocity is added
+	mActiveRegion = EmptyRegion();
 
-	//allocate temporary buffers
-	tempBufX = (float*)calloc(mTotalCellCount, sizeof(float));
-	tempBufY = (float*)calloc(mTotalCellCount, sizeof(float));
-	tempBufZ = (float*)calloc(mTotalCellCount, sizeof(float));
-	tempBuf = (float*)calloc(mTotalCellCount, sizeof(float));
+	//nothing has changed since the empty first frame
+	mChangedBricksPerAxis = (mGridWidth + 2 + BrickGrid::BrickWidth - 1) / BrickGrid::BrickWidth;
+	int totalBricks = mChangedBricksPerAxis * mChangedBricksPerAxis * mChangedBricksPerAxis;
+	mChangedBricks.assign(totalBricks, 0);
+	mChangedBrickMask.assign((totalBricks + 63) / 64, 0);
+	mBrickHadDensity.assign(totalBricks, 0);
 
-	//allocate ambient vel grids
-	mAmbientVelU = (float*)calloc(mTotalCellCount, sizeof(float));	
-	mAmbientVelV = (float*)calloc(mTotalCellCount, sizeof(float));
-	mAmbientVelW = (float*)calloc(mTotalCellCount, sizeof(float));
+	//use the widest vector instructions available
+	advectionKernel = DetectAdvectionKernel();
 }
 
 Smoke::~Smoke()
 {
+	//the prefetcher decodes from the reader, so it stops first
+	delete(mFramePrefetcher);
+	if (mCurrentReadSmoke) {
+		mCurrentReadSmoke->StopRead();
+		delete(mCurrentReadSmoke);
+	}
+
 	//clear allocated memory 
 	free(mCurrentDensity); free(mPrevDensity);
 	free(mCurVelU); free(mCurVelV); free(mCurVelW);
 	free(mPrevVelU); free(mPrevVelV); free(mPrevVelW);
 	free(mAmbientVelU);	free(mAmbientVelV); free(mAmbientVelW);
-	free(tempBuf); free(tempBufX); free(tempBufY); free(tempBufZ);
+	free(tempBuf); free(tempBufX); free(mCurlPlanes); free(mReferenceCurlZ);
+
+	delete(mBrickDensity); delete(mBrickPrevDensity);
+	delete(mBrickVelU); delete(mBrickVelV); delete(mBrickVelW);
+	delete(mBrickPrevVelU); delete(mBrickPrevVelV); delete(mBrickPrevVelW);
+	delete(mBrickPressure); delete(mBrickDivergence);
+
+	delete(mThreadPool);
+
+	//level 0 solves straight into the given grid, so only free its own buffers
+	for (size_t i = 0; i < mMultigridLevels.size(); i++)
+	{
+		if (i > 0) { free(mMultigridLevels[i].x); }
+		free(mMultigridLevels[i].rhs); free(mMultigridLevels[i].residual);
+	}
+
+	//conjugate gradient buffers, only allocated if it was used
+	free(mCGResidual); free(mCGAux); free(mCGSearch); free(mCGProduct); free(mCGPrecon);
 }
 
 void Smoke::CreateAndSaveSimulation(std::string fileName, int frames)
@@ -53,7 +134,19 @@ void Smoke::CreateAndSaveSimulation(std::string fileName, int frames)
 
 	//saving interface and initalise writing to file
 	ReadWriteSmoke smokeFileReadWrite{};
-	smokeFileReadWrite.WriteInit(fileName, GetGridWidth(), mCurrentDensity, 8);
+	smokeFileReadWrite.WriteInit(fileName, GetGridWidth(), mCurrentDensity, 8, ReadWriteSmoke::DefaultKeyframeInterval, saveBlockEncoding, bCompressSavedBlocks);
+	bool writeBricks = mStorage == SparseStorage && smokeFileReadWrite.MatchesBrickLayout(*mBrickDensity);
+	bool writeChanged = !writeBricks && smokeFileReadWrite.UsesBrickBlocks();
+	ClearChangedBricks();
+
+	//saved frames aren't in a hurry, so every update stays within the cfl number
+	int realTimeMaxSubSteps = maxSubSteps;
+	maxSubSteps = 0;
+
+	//frames are snapshotted and written behind the simulation, the pipeline finishes before the writer is destroyed.
+	//the pipeline snapshots dense grids, so bricks are written straight from the simulation instead
+	std::unique_ptr<PipelinedWriter> pipeline;
+	if (bPipelinedSave && !writeBricks) { pipeline.reset(new PipelinedWriter(&smokeFileReadWrite)); }
 
 	SetAmbientVelocity(0, 0, 0);
 
@@ -64,15 +157,24 @@ void Smoke::CreateAndSaveSimulation(std::string fileName, int frames)
 		//add density to bottom middle of simulation 
 		AddDensity((mGridWidth + 2) / 2, 5, (mGridWidth + 2) / 2, 15.0f, 8);
 
-		//step simulation 
+		//step simulation, sub-stepping fast frames to keep them stable
 		Update(0.1f);
 
 		std::cout << "Smoke Grid Frame " << i << " / " << frames << "\n";
 
-		std::cout << "Density: " << GetTotalDensity() << "\n";
+		//summing the density reads the whole grid, so it's skipped when the simulation shouldn't wait
+		if (!pipeline) {
+			std::cout << "Density: " << GetTotalDensity() << "\n";
+		}
 
-		//write frame 
-		smokeFileReadWrite.AddFrame(mCurrentDensity);
+		//write frame, straight from the bricks with sparse storage, otherwise only the bricks the simulation 
+		//changed if they line up with the file's blocks
+		const uint64_t* changedBricks = (writeChanged) ? GetChangedBricks() : nullptr;
+		if (writeBricks) { smokeFileReadWrite.AddFrame(*mBrickDensity); }
+		else if (pipeline) { pipeline->AddFrame(mCurrentDensity, changedBricks); }
+		else if (writeChanged) { smokeFileReadWrite.AddFrame(mCurrentDensity, changedBricks); }
+		else { smokeFileReadWrite.AddFrame(mCurrentDensity); }
+		ClearChangedBricks();
 		
 		//calculate timing information
 		auto frameEndTime = std::chrono::system_clock::now();
@@ -89,8 +191,14 @@ void Smoke::CreateAndSaveSimulation(std::string fileName, int frames)
 			<< "\n\n";
 	}
 
-	//finish writing to file
+	//wait for the queued frames, then finish writing to file
+	if (pipeline) {
+		pipeline->Finish();
+		pipeline->PrintThroughput();
+		pipeline.reset();
+	}
 	smokeFileReadWrite.StopWrite();
+	maxSubSteps = realTimeMaxSubSteps;
 
 	auto endTime = std::chrono::system_clock::now();
 	std::chrono::duration<double> elapsedTime = endTime - startTime;
@@ -99,7 +207,7 @@ void Smoke::CreateAndSaveSimulation(std::string fileName, int frames)
 	std::cout << "\nSuccessfully Created and Saved new Smoke Simulation. Elapsed Time: " << int(elapsedTime.count()) / 60 << "m " << int(elapsedTime.count()) % 60 << "s";
 }
 
-Smoke* Smoke::OpenSavedSimulation(std::string fileName, int& gridSize)
+Smoke* Smoke::OpenSavedSimulation(std::string fileName, int& gridSize, int prefetchFrames)
 {
 	//create simulation file interface and initalise read mode
 	ReadWriteSmoke* simulationLoader = new ReadWriteSmoke();
@@ -111,6 +219,9 @@ Smoke* Smoke::OpenSavedSimulation(std::string fileName, int& gridSize)
 	smoke->mReadSimTotalFrames = simulationLoader->GetTotalFrameCount();
 	smoke->mCurrentFile = fileName;
 
+	//start decoding the frames ahead of playback
+	if (prefetchFrames > 0) { smoke->mFramePrefetcher = new FramePrefetcher(simulationLoader, prefetchFrames); }
+
 	//set out parameters
 	gridSize = simulationLoader->GetSimulationGridWidth();
 	int totalFrames = simulationLoader->GetTotalFrameCount();
@@ -123,30 +234,67 @@ void Smoke::ReadNextSimulationFrame()
 {
 	//std::cout << "Read Next Frame\n";
 
-	//check not over frame limit
-	mReadFrameCounter++;
-	if (mReadFrameCounter >= mReadSimTotalFrames - 1) {
-
-		//close the file and delete the reader
-		mCurrentReadSmoke->StopRead();
-		delete(mCurrentReadSmoke);
+	//take the next prefetched frame without waiting on the file
+	float* frame;
+	if (mFramePrefetcher) {
+		frame = mFramePrefetcher->GetNextFrame();
+		mReadFrameCounter = mFramePrefetcher->GetCurrentFrame();
+	}
+	//read next frame, after the last frame the reader loops back to the first without reopening the file
+	else {
+		frame = mCurrentReadSmoke->ReadNextFrame();
+		mReadFrameCounter = mCurrentReadSmoke->GetCurrentFrame();
+	}
 
-		//create new reader obj and re open the file
-		mCurrentReadSmoke = new ReadWriteSmoke();
-		mCurrentReadSmoke->ReadInit(mCurrentFile);
-		mCurrentDensity = mCurrentReadSmoke->ReadNextFrame();
+	//copied into the smoke's own density, which the reader's buffers never replace
+	std::copy_n(frame, mTotalCellCount, mCurrentDensity);
+	MarkAllBricksChanged();
+}
 
-		mReadFrameCounter = 1;
+void Smoke::Update(float deltaTime)
+{
+	//split the update into equal sub-steps, short enough that nothing is backtraced further than the cfl number of cells
+	int subSteps = (bAdaptiveTimeStep) ? GetStableSubSteps(deltaTime) : 1;
+	bLastSubStepsCapped = bAdaptiveTimeStep && !(mMaxVelocity * deltaTime * mGridWidth <= cflNumber * subSteps);
+	float stepTime = deltaTime / subSteps;
 
-		return;
+	for (int s = 0; s < subSteps; s++) {
+		SimulationStep(stepTime);
 	}
 
-	//read next frame into density grid
-	mCurrentDensity = mCurrentReadSmoke->ReadNextFrame();
+	mLastSubStepCount = subSteps;
 }
 
-void Smoke::Update(float deltaTime)
+int Smoke::GetStableSubSteps(float deltaTime)
+{
+	//cells the fastest velocity moves in the whole update
+	float cellsMoved = mMaxVelocity * deltaTime * mGridWidth;
+	int cap = (maxSubSteps > 0) ? maxSubSteps : mSubStepLimit;
+	if (!(cellsMoved <= cflNumber * cap)) { return cap; }
+
+	int subSteps = (int)ceilf(cellsMoved / cflNumber);
+	return std::min(std::max(subSteps, 1), cap);
+}
+
+void Smoke::SimulationStep(float deltaTime)
 {
+	//grow the region far enough that this step can't move smoke past it
+	mActiveRegionMargin = GetActiveRegionMargin(deltaTime);
+
+	//sparse storage simulates the bricks around the smoke instead
+	if (mStorage == SparseStorage) {
+		RequireSparseSolvers();
+		UpdateActiveBricks();
+		if (bVelocityStep) { SparseVelocityStep(deltaTime); }
+		if (bDensityStep) { SparseDensityStep(deltaTime); }
+		UpdateDensityMirror();
+		return;
+	}
+
+	//find the part of the grid with smoke in it, the kernels skip everything else
+	ActiveRegion previousRegion = mActiveRegion;
+	UpdateActiveRegion();
+
 	//update velocity field 
 	if (bVelocityStep) {
 		VelocityStep(deltaTime);
@@ -157,19 +305,30 @@ void Smoke::Update(float deltaTime)
 		DensityStep(deltaTime);
 	}
 
+	//density can only have changed inside the regions
+	MarkChangedRegionBricks(previousRegion);
+
 	//std::cout << "Smoke's Total Density: " << GetTotalDensity() << "Smoke's vel: " << GetGridTotal(mCurVelV) << "\n";
 }
 
 void Smoke::DensityStep(float deltaTime)
 {
+	if (mStorage == SparseStorage) {
+		RequireSparseSolvers();
+		UpdateActiveBricks();
+		SparseDensityStep(deltaTime);
+		UpdateDensityMirror();
+		return;
+	}
+
 	//diffusion: spread density to surrounding cells
 	if (bDiffuse) {
 		SWAPPOINTER(mCurrentDensity, mPrevDensity);
 		Diffuse(0, mCurrentDensity, mPrevDensity, mDiffuseRate, deltaTime);
 	}
 
-	//advection: move density along velocity field 
-	if (bAdvect) {
+	//advection: move density along velocity field, unless already done in the velocity step
+	if (bAdvect && !(bFuseDensityAdvection && bVelocityStep)) {
 		SWAPPOINTER(mCurrentDensity, mPrevDensity);
 		Advect(0, mCurrentDensity, mPrevDensity, mCurVelU, mCurVelV, mCurVelW, deltaTime);
 	}	
@@ -177,16 +336,15 @@ void Smoke::DensityStep(float deltaTime)
 
 void Smoke::VelocityStep(float deltaTime)
 {
-	//add ambient velocity
-	AddSource(mCurVelU, mAmbientVelU, deltaTime);
-	AddSource(mCurVelV, mAmbientVelV, deltaTime);
-	AddSource(mCurVelW, mAmbientVelW, deltaTime);
-
-	//add upward force to areas of high density
-	AddBuoyancy(deltaTime);
+	if (mStorage == SparseStorage) {
+		RequireSparseSolvers();
+		UpdateActiveBricks();
+		SparseVelocityStep(deltaTime);
+		return;
+	}
 
-	//add natural curls to the velocity field
-	VorticityConfinement(deltaTime);
+	//add ambient velocity, upward force to areas of high density and natural curls in one pass
+	AddForces(deltaTime);
 
 	//diffusion: spread out the velocity throughout the grid
 	if (bDiffuse) {
@@ -202,10 +360,9 @@ void Smoke::VelocityStep(float deltaTime)
 	//advection: move the velocity grids along itself 
 	if (bAdvect) {
 		SwapVelPointers();
+		if (bFuseDensityAdvection && bDensityStep) { SWAPPOINTER(mCurrentDensity, mPrevDensity); }
 
-		Advect(1, mCurVelU, mPrevVelU, mPrevVelU, mPrevVelV, mPrevVelW, deltaTime);
-		Advect(2, mCurVelV, mPrevVelV, mPrevVelU, mPrevVelV, mPrevVelW, deltaTime);
-		Advect(3, mCurVelW, mPrevVelW, mPrevVelU, mPrevVelV, mPrevVelW, deltaTime);
+		AdvectVelocity(deltaTime);
 
 		Project();
 	}	
@@ -213,118 +370,413 @@ void Smoke::VelocityStep(float deltaTime)
 
 void Smoke::Diffuse(int boundaryCondition, float* current, float* previous, float rate, float dt)
 {
+	RequireDenseStorage("Diffuse");
+
 	//eqaution constant to determine rate of diffusion including grid size and time passed
 	float a = dt * rate * mGridWidth * mGridWidth * mGridWidth;
 
-	//number of diffusion cylcles, the higher - the more accurate
-	for (size_t k = 0; k < mLinearSolveTimes; k++)
-	{
-		for (size_t z = 1; z <= mGridWidth; z++) {
-
-			for (size_t i = 1; i <= mGridWidth; i++) {
+	//conjugate gradient starts from the previous values, so calm frames finish straight away
+	if (diffusionSolver == ConjugateGradient) {
+		std::copy(previous, previous + mTotalCellCount, current);
+	}
 
-				for (size_t j = 1; j <= mGridWidth; j++) {
+	//calculate density transferred into each grid cell, from surrounding cells
+	LinearSolve(diffusionSolver, boundaryCondition, current, previous, a, 1 + 6 * a);
+}
 
-					//calculate density transferred into this grid cell, from surrounding cells
-					current[INDEX3D(i, j, z)] = (previous[INDEX3D(i, j, z)] + a *
-						(current[INDEX3D(i - 1, j, z)] + current[INDEX3D(i + 1, j, z)] +	//neighbouring x
-							current[INDEX3D(i, j - 1, z)] + current[INDEX3D(i, j + 1, z)] +	//y
-							current[INDEX3D(i, j, z - 1)] + current[INDEX3D(i, j, z + 1)])	//z
-						) / (1 + 6 * a);
-				}
-			}
-		}
-		//manage grid boundary
-		SetBoundary(boundaryCondition, current);
+/// <summary>
+/// largest velocity component along a row, read straight after advecting it so the row is still in cache
+/// </summary>
+static inline float RowMaxVelocity(const float* u, const float* v, const float* w, int index, int count)
+{
+	float maxVelocity = 0;
+	for (int i = index; i < index + count; i++) {
+		maxVelocity = std::max(maxVelocity, std::max(std::abs(u[i]), std::max(std::abs(v[i]), std::abs(w[i]))));
 	}
+	return maxVelocity;
 }
 
 void Smoke::Advect(int boundaryCondition, float* current, float* previous, float* u, float* v, float* w, float dt)
 {
-	//loop vairables;
-	int i, j, k, i0, j0, k0, i1, j1, k1;
-	float x, y, z, s0, t0, s1, t1, u1, u0, dtx, dty, dtz;
+	RequireDenseStorage("Advect");
 
 	//coeficients
-	dtx = dty = dtz = dt * mGridWidth;
+	float dt0 = dt * mGridWidth;
+
+	AdvectedField field{ current, previous };
+	ActiveRegion& r = mActiveRegion;
+
+	//fastest velocity is found while the rows are advected, for picking the next time step
+	float maxVelocity = 0;
+	std::mutex maxMutex;
+
+	//each thread advects its own slab of z planes, a row of x at a time so memory is read in order
+	mThreadPool->ParallelFor(r.startZ, r.endZ + 1, [&](int zStart, int zEnd) {
+		float sliceMax = 0;
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = r.startY; j <= r.endY; j++) {
+				AdvectRow(&field, 1, u, v, w, j, k, r.startX, r.endX, dt0);
+				sliceMax = std::max(sliceMax, RowMaxVelocity(u, v, w, INDEX3D(r.startX, j, k), r.endX - r.startX + 1));
+			}
+		}
 
-	//loop over all cells
-	for (i = 1; i <= mGridWidth; i++) {
-		for (j = 1; j <= mGridWidth; j++) {
-			for (k = 1; k <= mGridWidth; k++) {
+		std::lock_guard<std::mutex> lock(maxMutex);
+		if (sliceMax > maxVelocity) { maxVelocity = sliceMax; }
+	});
+	mMaxVelocity = maxVelocity;
+
+	//manage grid boundary
+	SetBoundary(boundaryCondition, current);
+}
 
-				//calculate predicted movement from backtracing velcoity
-				x = i - dtx * u[INDEX3D(i, j, k)]; 
-				y = j - dty * v[INDEX3D(i, j, k)]; 
-				z = k - dtz * w[INDEX3D(i, j, k)];
+void Smoke::AdvectVelocity(float dt)
+{
+	RequireDenseStorage("AdvectVelocity");
 
-				//make sure all coords are in bounds
-				if (x < 0.5f) x = 0.5f; if (x > mGridWidth + 0.5f) x = mGridWidth + 0.5f;
-				i0 = (int)x; i1 = i0 + 1;
+	//coeficients
+	float dt0 = dt * mGridWidth;
 
-				if (y < 0.5f) y = 0.5f; if (y > mGridWidth + 0.5f) y = mGridWidth + 0.5f;
-				j0 = (int)y; j1 = j0 + 1;
+	//every component moves along the previous velocity, so they share the backtrace and weights
+	AdvectedField fields[4] = {
+		{ mCurVelU, mPrevVelU }, { mCurVelV, mPrevVelV }, { mCurVelW, mPrevVelW }, { mCurrentDensity, mPrevDensity } };
+	bool fuseDensity = bFuseDensityAdvection && bDensityStep;
+	int fieldCount = (fuseDensity) ? 4 : 3;
 
-				if (z < 0.5f) z = 0.5f; if (z > mGridWidth + 0.5f) z = mGridWidth + 0.5f;
-				k0 = (int)z; k1 = k0 + 1;
+	ActiveRegion& r = mActiveRegion;
 
-				s1 = x - i0; s0 = 1 - s1;
-				t1 = y - j0; t0 = 1 - t1;
-				u1 = z - k0; u0 = 1 - u1;
+	float maxVelocity = 0;
+	std::mutex maxMutex;
 
-				//update the grid with the movement 
-				current[INDEX3D(i, j, k)] = s0 * (
-					t0 * u0 * previous[INDEX3D(i0, j0, k0)] + t1 * u0 * previous[INDEX3D(i0, j1, k0)]
-					+ t0 * u1 * previous[INDEX3D(i0, j0, k1)] + t1 * u1 * previous[INDEX3D(i0, j1, k1)]) +
-					s1 * (t0 * u0 * previous[INDEX3D(i1, j0, k0)] + t1 * u0 * previous[INDEX3D(i1, j1, k0)] +
-						t0 * u1 * previous[INDEX3D(i1, j0, k1)] + t1 * u1 * previous[INDEX3D(i1, j1, k1)]);
+	mThreadPool->ParallelFor(r.startZ, r.endZ + 1, [&](int zStart, int zEnd) {
+		float sliceMax = 0;
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = r.startY; j <= r.endY; j++) {
+				AdvectRow(fields, fieldCount, mPrevVelU, mPrevVelV, mPrevVelW, j, k, r.startX, r.endX, dt0);
+				sliceMax = std::max(sliceMax, RowMaxVelocity(mPrevVelU, mPrevVelV, mPrevVelW, INDEX3D(r.startX, j, k), r.endX - r.startX + 1));
 			}
 		}
+
+		std::lock_guard<std::mutex> lock(maxMutex);
+		if (sliceMax > maxVelocity) { maxVelocity = sliceMax; }
+	});
+	mMaxVelocity = maxVelocity;
+
+	//manage grid boundaries
+	SetBoundary(1, mCurVelU); SetBoundary(2, mCurVelV); SetBoundary(3, mCurVelW);
+	if (fuseDensity) { SetBoundary(0, mCurrentDensity); }
+}
+
+//---- ADVECTION KERNELS ----//
+
+/// <summary>
+/// scalar advection of cells [iStart, iEnd] in one row, also finishes the cells left over by the vector kernels.
+/// the backtrace and weights are calculated once per cell and used for every field
+/// </summary>
+static void AdvectRowScalar(Smoke::AdvectedField* fields, int fieldCount, float* u, float* v, float* w, 
+	int gridWidth, int j, int k, int iStart, int iEnd, float dt0)
+{
+	//loop vairables
+	int i0, j0, k0, i1, j1, k1, index;
+	float x, y, z, s0, t0, s1, t1, u1, u0;
+	int N = gridWidth;
+
+	for (int i = iStart; i <= iEnd; i++)
+	{
+		index = INDEX3DW(i, j, k, N);
+
+		//calculate predicted movement from backtracing velcoity
+		x = i - dt0 * u[index];
+		y = j - dt0 * v[index];
+		z = k - dt0 * w[index];
+
+		//make sure all coords are in bounds
+		if (x < 0.5f) x = 0.5f; if (x > N + 0.5f) x = N + 0.5f;
+		i0 = (int)x; i1 = i0 + 1;
+
+		if (y < 0.5f) y = 0.5f; if (y > N + 0.5f) y = N + 0.5f;
+		j0 = (int)y; j1 = j0 + 1;
+
+		if (z < 0.5f) z = 0.5f; if (z > N + 0.5f) z = N + 0.5f;
+		k0 = (int)z; k1 = k0 + 1;
+
+		s1 = x - i0; s0 = 1 - s1;
+		t1 = y - j0; t0 = 1 - t1;
+		u1 = z - k0; u0 = 1 - u1;
+
+		//update each grid with the movement 
+		for (int f = 0; f < fieldCount; f++)
+		{
+			float* previous = fields[f].previous;
+			fields[f].current[index] = s0 * (
+				t0 * u0 * previous[INDEX3DW(i0, j0, k0, N)] + t1 * u0 * previous[INDEX3DW(i0, j1, k0, N)]
+				+ t0 * u1 * previous[INDEX3DW(i0, j0, k1, N)] + t1 * u1 * previous[INDEX3DW(i0, j1, k1, N)]) +
+				s1 * (t0 * u0 * previous[INDEX3DW(i1, j0, k0, N)] + t1 * u0 * previous[INDEX3DW(i1, j1, k0, N)] +
+					t0 * u1 * previous[INDEX3DW(i1, j0, k1, N)] + t1 * u1 * previous[INDEX3DW(i1, j1, k1, N)]);
+		}
 	}
-	//manage grid boundary
-	SetBoundary(boundaryCondition, current);
+}
+
+#ifdef SMOKE_SIMD_ADVECTION
+
+/// <summary>
+/// avx2 advection, 8 cells along x per iteration using gathers for the 8 trilinear samples
+/// </summary>
+/// <returns> the first cell not yet advected </returns>
+TARGET_AVX2 static int AdvectRowAvx2(Smoke::AdvectedField* fields, int fieldCount, float* u, float* v, float* w, 
+	int gridWidth, int j, int k, int iStart, int iEnd, float dt0)
+{
+	int N = gridWidth;
+	int rowWidth = N + 2, planeWidth = (N + 2) * (N + 2);
+
+	//constants shared by every iteration
+	const __m256 dt = _mm256_set1_ps(dt0);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 minCoord = _mm256_set1_ps(0.5f), maxCoord = _mm256_set1_ps(N + 0.5f);
+	const __m256 laneOffsets = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256 jCoord = _mm256_set1_ps((float)j), kCoord = _mm256_set1_ps((float)k);
+	const __m256i rowStride = _mm256_set1_epi32(rowWidth), planeStride = _mm256_set1_epi32(planeWidth);
+	const __m256i xStep = _mm256_set1_epi32(1);
+
+	int i = iStart;
+	for (; i + 7 <= iEnd; i += 8)
+	{
+		int index = INDEX3DW(i, j, k, N);
+
+		//backtrace the 8 cells and clamp in bounds
+		__m256 x = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps((float)i), laneOffsets), _mm256_mul_ps(dt, _mm256_loadu_ps(u + index)));
+		__m256 y = _mm256_sub_ps(jCoord, _mm256_mul_ps(dt, _mm256_loadu_ps(v + index)));
+		__m256 z = _mm256_sub_ps(kCoord, _mm256_mul_ps(dt, _mm256_loadu_ps(w + index)));
+		x = _mm256_min_ps(_mm256_max_ps(x, minCoord), maxCoord);
+		y = _mm256_min_ps(_mm256_max_ps(y, minCoord), maxCoord);
+		z = _mm256_min_ps(_mm256_max_ps(z, minCoord), maxCoord);
+
+		//coords are positive so truncating floors them
+		__m256i i0 = _mm256_cvttps_epi32(x), j0 = _mm256_cvttps_epi32(y), k0 = _mm256_cvttps_epi32(z);
+
+		__m256 s1 = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i0)), s0 = _mm256_sub_ps(one, s1);
+		__m256 t1 = _mm256_sub_ps(y, _mm256_cvtepi32_ps(j0)), t0 = _mm256_sub_ps(one, t1);
+		__m256 u1 = _mm256_sub_ps(z, _mm256_cvtepi32_ps(k0)), u0 = _mm256_sub_ps(one, u1);
+
+		//index of the lowest corner, the other corners are offsets from it
+		__m256i c000 = _mm256_add_epi32(i0, _mm256_add_epi32(_mm256_mullo_epi32(j0, rowStride), _mm256_mullo_epi32(k0, planeStride)));
+		__m256i c010 = _mm256_add_epi32(c000, rowStride);
+		__m256i c001 = _mm256_add_epi32(c000, planeStride);
+		__m256i c011 = _mm256_add_epi32(c010, planeStride);
+
+		__m256i c100 = _mm256_add_epi32(c000, xStep), c110 = _mm256_add_epi32(c010, xStep);
+		__m256i c101 = _mm256_add_epi32(c001, xStep), c111 = _mm256_add_epi32(c011, xStep);
+
+		//same weighting order as the scalar kernel
+		__m256 t0u0 = _mm256_mul_ps(t0, u0), t1u0 = _mm256_mul_ps(t1, u0);
+		__m256 t0u1 = _mm256_mul_ps(t0, u1), t1u1 = _mm256_mul_ps(t1, u1);
+
+		//gather the 8 samples of each field and blend them
+		for (int f = 0; f < fieldCount; f++)
+		{
+			float* previous = fields[f].previous;
+
+			__m256 p000 = _mm256_i32gather_ps(previous, c000, 4), p010 = _mm256_i32gather_ps(previous, c010, 4);
+			__m256 p001 = _mm256_i32gather_ps(previous, c001, 4), p011 = _mm256_i32gather_ps(previous, c011, 4);
+			__m256 p100 = _mm256_i32gather_ps(previous, c100, 4), p110 = _mm256_i32gather_ps(previous, c110, 4);
+			__m256 p101 = _mm256_i32gather_ps(previous, c101, 4), p111 = _mm256_i32gather_ps(previous, c111, 4);
+
+			__m256 low = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(t0u0, p000), _mm256_mul_ps(t1u0, p010)),
+				_mm256_mul_ps(t0u1, p001)), _mm256_mul_ps(t1u1, p011));
+			__m256 high = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(t0u0, p100), _mm256_mul_ps(t1u0, p110)),
+				_mm256_mul_ps(t0u1, p101)), _mm256_mul_ps(t1u1, p111));
+
+			_mm256_storeu_ps(fields[f].current + index, _mm256_add_ps(_mm256_mul_ps(s0, low), _mm256_mul_ps(s1, high)));
+		}
+	}
+
+	return i;
+}
+
+/// <summary>
+/// avx-512 advection, 16 cells along x per iteration
+/// </summary>
+/// <returns> the first cell not yet advected </returns>
+TARGET_AVX512 static int AdvectRowAvx512(Smoke::AdvectedField* fields, int fieldCount, float* u, float* v, float* w,
+	int gridWidth, int j, int k, int iStart, int iEnd, float dt0)
+{
+	int N = gridWidth;
+	int rowWidth = N + 2, planeWidth = (N + 2) * (N + 2);
+
+	//constants shared by every iteration
+	const __m512 dt = _mm512_set1_ps(dt0);
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 minCoord = _mm512_set1_ps(0.5f), maxCoord = _mm512_set1_ps(N + 0.5f);
+	const __m512 laneOffsets = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m512 jCoord = _mm512_set1_ps((float)j), kCoord = _mm512_set1_ps((float)k);
+	const __m512i rowStride = _mm512_set1_epi32(rowWidth), planeStride = _mm512_set1_epi32(planeWidth);
+	const __m512i xStep = _mm512_set1_epi32(1);
+
+	//gcc's unmasked intrinsics start from an undefined vector and warn it may be used uninitialised, so every
+	//lane is selected through the masked forms instead, which give the same results
+	const __mmask16 allLanes = 0xFFFF;
+	const __m512 zero = _mm512_setzero_ps();
+
+	int i = iStart;
+	for (; i + 15 <= iEnd; i += 16)
+	{
+		int index = INDEX3DW(i, j, k, N);
+
+		//backtrace the 16 cells and clamp in bounds
+		__m512 x = _mm512_sub_ps(_mm512_add_ps(_mm512_set1_ps((float)i), laneOffsets), _mm512_mul_ps(dt, _mm512_loadu_ps(u + index)));
+		__m512 y = _mm512_sub_ps(jCoord, _mm512_mul_ps(dt, _mm512_loadu_ps(v + index)));
+		__m512 z = _mm512_sub_ps(kCoord, _mm512_mul_ps(dt, _mm512_loadu_ps(w + index)));
+		x = _mm512_maskz_min_ps(allLanes, _mm512_maskz_max_ps(allLanes, x, minCoord), maxCoord);
+		y = _mm512_maskz_min_ps(allLanes, _mm512_maskz_max_ps(allLanes, y, minCoord), maxCoord);
+		z = _mm512_maskz_min_ps(allLanes, _mm512_maskz_max_ps(allLanes, z, minCoord), maxCoord);
+
+		//coords are positive so truncating floors them
+		__m512i i0 = _mm512_maskz_cvttps_epi32(allLanes, x), j0 = _mm512_maskz_cvttps_epi32(allLanes, y), k0 = _mm512_maskz_cvttps_epi32(allLanes, z);
+
+		__m512 s1 = _mm512_sub_ps(x, _mm512_maskz_cvtepi32_ps(allLanes, i0)), s0 = _mm512_sub_ps(one, s1);
+		__m512 t1 = _mm512_sub_ps(y, _mm512_maskz_cvtepi32_ps(allLanes, j0)), t0 = _mm512_sub_ps(one, t1);
+		__m512 u1 = _mm512_sub_ps(z, _mm512_maskz_cvtepi32_ps(allLanes, k0)), u0 = _mm512_sub_ps(one, u1);
+
+		//index of the lowest corner, the other corners are offsets from it
+		__m512i c000 = _mm512_add_epi32(i0, _mm512_add_epi32(_mm512_mullo_epi32(j0, rowStride), _mm512_mullo_epi32(k0, planeStride)));
+		__m512i c010 = _mm512_add_epi32(c000, rowStride);
+		__m512i c001 = _mm512_add_epi32(c000, planeStride);
+		__m512i c011 = _mm512_add_epi32(c010, planeStride);
+
+		__m512i c100 = _mm512_add_epi32(c000, xStep), c110 = _mm512_add_epi32(c010, xStep);
+		__m512i c101 = _mm512_add_epi32(c001, xStep), c111 = _mm512_add_epi32(c011, xStep);
+
+		//same weighting order as the scalar kernel
+		__m512 t0u0 = _mm512_mul_ps(t0, u0), t1u0 = _mm512_mul_ps(t1, u0);
+		__m512 t0u1 = _mm512_mul_ps(t0, u1), t1u1 = _mm512_mul_ps(t1, u1);
+
+		//gather the 8 samples of each field and blend them
+		for (int f = 0; f < fieldCount; f++)
+		{
+			float* previous = fields[f].previous;
+
+			__m512 p000 = _mm512_mask_i32gather_ps(zero, allLanes, c000, previous, 4), p010 = _mm512_mask_i32gather_ps(zero, allLanes, c010, previous, 4);
+			__m512 p001 = _mm512_mask_i32gather_ps(zero, allLanes, c001, previous, 4), p011 = _mm512_mask_i32gather_ps(zero, allLanes, c011, previous, 4);
+			__m512 p100 = _mm512_mask_i32gather_ps(zero, allLanes, c100, previous, 4), p110 = _mm512_mask_i32gather_ps(zero, allLanes, c110, previous, 4);
+			__m512 p101 = _mm512_mask_i32gather_ps(zero, allLanes, c101, previous, 4), p111 = _mm512_mask_i32gather_ps(zero, allLanes, c111, previous, 4);
+
+			__m512 low = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(t0u0, p000), _mm512_mul_ps(t1u0, p010)),
+				_mm512_mul_ps(t0u1, p001)), _mm512_mul_ps(t1u1, p011));
+			__m512 high = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(t0u0, p100), _mm512_mul_ps(t1u0, p110)),
+				_mm512_mul_ps(t0u1, p101)), _mm512_mul_ps(t1u1, p111));
+
+			_mm512_storeu_ps(fields[f].current + index, _mm512_add_ps(_mm512_mul_ps(s0, low), _mm512_mul_ps(s1, high)));
+		}
+	}
+
+	return i;
+}
+
+#endif
+
+void Smoke::AdvectRow(AdvectedField* fields, int fieldCount, float* u, float* v, float* w, int j, int k, int iStart, int iEnd, float dt0)
+{
+	int i = iStart;
+
+	//vector kernels do as many cells as fit, the scalar kernel finishes the row
+#ifdef SMOKE_SIMD_ADVECTION
+	if (advectionKernel == Avx512Kernel) {
+		i = AdvectRowAvx512(fields, fieldCount, u, v, w, mGridWidth, j, k, i, iEnd, dt0);
+	}
+	else if (advectionKernel == Avx2Kernel) {
+		i = AdvectRowAvx2(fields, fieldCount, u, v, w, mGridWidth, j, k, i, iEnd, dt0);
+	}
+#endif
+
+	AdvectRowScalar(fields, fieldCount, u, v, w, mGridWidth, j, k, i, iEnd, dt0);
+}
+
+Smoke::AdvectionKernel Smoke::DetectAdvectionKernel()
+{
+#ifdef SMOKE_SIMD_ADVECTION
+	unsigned int regs[4] = {};
+
+	//cpu feature flags, leaf 1 for os saved avx state, leaf 7 for avx2 and avx-512
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) { return ScalarKernel; }
+	__cpuidex(info, 1, 0);
+	bool osSavesAvx = (info[2] >> 27) & 1;
+	__cpuidex(info, 7, 0);
+	for (int r = 0; r < 4; r++) { regs[r] = (unsigned int)info[r]; }
+#else
+	if (__get_cpuid_max(0, nullptr) < 7) { return ScalarKernel; }
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) { return ScalarKernel; }
+	bool osSavesAvx = (ecx >> 27) & 1;
+	__cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+
+	if (!osSavesAvx) { return ScalarKernel; }
+
+	//check the os saves the vector registers on context switches
+#if defined(_MSC_VER)
+	unsigned long long enabledState = _xgetbv(0);
+#else
+	unsigned int stateLow, stateHigh;
+	__asm__("xgetbv" : "=a"(stateLow), "=d"(stateHigh) : "c"(0));
+	unsigned long long enabledState = ((unsigned long long)stateHigh << 32) | stateLow;
+#endif
+
+	bool avxState = (enabledState & 0x6) == 0x6;
+	bool avx512State = (enabledState & 0xE6) == 0xE6;
+
+	bool avx2 = (regs[1] >> 5) & 1;
+	bool avx512 = (regs[1] >> 16) & 1;
+
+	if (avx512 && avx512State) { return Avx512Kernel; }
+	if (avx2 && avxState) { return Avx2Kernel; }
+#endif
+
+	return ScalarKernel;
 }
 
 void Smoke::Project()
 {
+	if (mStorage == SparseStorage) {
+		RequireSparseSolvers();
+		UpdateActiveBricks();
+		SparseProject();
+		return;
+	}
+
 	//use temp buffers
 	float* p = tempBuf, * div = tempBufX;
 	float h = 1.0f / mGridWidth;
+	ActiveRegion& r = mActiveRegion;
+
+	//pressure starts at 0, including the layer of cells around the active region which holds it at 0
+	for (int k = r.startZ - 1; k <= r.endZ + 1; k++) {
+		for (int j = r.startY - 1; j <= r.endY + 1; j++) {
+			std::fill_n(p + INDEX3D(r.startX - 1, j, k), r.endX - r.startX + 3, 0.0f);
+		}
+	}
 
 	//calculate values for div
-	for (int k = 1; k <= mGridWidth; k++) {
-		for (int j = 1; j <= mGridWidth; j++) {
-			for (int i = 1; i <= mGridWidth; i++) {
+	for (int k = r.startZ; k <= r.endZ; k++) {
+		for (int j = r.startY; j <= r.endY; j++) {
+			for (int i = r.startX; i <= r.endX; i++) {
 				div[INDEX3D(i, j, k)] = -h * (
 					mCurVelU[INDEX3D(i + 1, j, k)] - mCurVelU[INDEX3D(i - 1, j, k)] +
 					mCurVelV[INDEX3D(i, j + 1, k)] - mCurVelV[INDEX3D(i, j - 1, k)] +
 					mCurVelW[INDEX3D(i, j, k + 1)] - mCurVelW[INDEX3D(i, j, k - 1)]) / 3;
-				p[INDEX3D(i, j, k)] = 0;
 			}
 		}
 	}
 	SetBoundary(0, div); SetBoundary(0, p);
 
 	//linearly solve int p grid 
-	for (int l = 0; l < mLinearSolveTimes; l++)
-	{
-		for (int k = 1; k <= mGridWidth; k++) {
-			for (int j = 1; j <= mGridWidth; j++) {
-				for (int i = 1; i <= mGridWidth; i++) {
-					p[INDEX3D(i, j, k)] = (div[INDEX3D(i, j, k)] +
-						p[INDEX3D(i - 1, j, k)] + p[INDEX3D(i + 1, j, k)] +
-						p[INDEX3D(i, j - 1, k)] + p[INDEX3D(i, j + 1, k)] +
-						p[INDEX3D(i, j, k - 1)] + p[INDEX3D(i, j, k + 1)]) / 6;
-				}
-			}
-		}
-		SetBoundary(0, p);
-	}
+	LinearSolve(pressureSolver, 0, p, div, 1, 6);
 
 	//intergrate into velocity field 
-	for (int k = 1; k <= mGridWidth; k++) {
-		for (int j = 1; j <= mGridWidth; j++) {
-			for (int i = 1; i <= mGridWidth; i++) {
+	for (int k = r.startZ; k <= r.endZ; k++) {
+		for (int j = r.startY; j <= r.endY; j++) {
+			for (int i = r.startX; i <= r.endX; i++) {
 				mCurVelU[INDEX3D(i, j, k)] -= (p[INDEX3D(i + 1, j, k)] - p[INDEX3D(i - 1, j, k)]) / 3 / h;
 				mCurVelV[INDEX3D(i, j, k)] -= (p[INDEX3D(i, j + 1, k)] - p[INDEX3D(i, j - 1, k)]) / 3 / h;
 				mCurVelW[INDEX3D(i, j, k)] -= (p[INDEX3D(i, j, k + 1)] - p[INDEX3D(i, j, k - 1)]) / 3 / h;
@@ -335,155 +787,1716 @@ void Smoke::Project()
 	SetBoundary(1, mCurVelU); SetBoundary(2, mCurVelV);
 }
 
-void Smoke::VorticityConfinement(float dt)
+void Smoke::LinearSolve(LinearSolver solver, int boundaryCondition, float* x, float* x0, float a, float c)
 {
-	//curl grids using the pre allocated temp buffers
-	float* curlX = tempBufX, * curlY = tempBufZ, * curlZ = tempBufZ, * curl = tempBuf;
-
-	//curl coeficient 
-	float dt0 = dt * mVorticityCoef;
-	
-	//in loop variables 
-	int index;
-	float x, y, z;
-
-	//calculate curl in each direction using current velocity field
-	for (int k = 1; k < mGridWidth; k++) {
-		for (int j = 1; j < mGridWidth; j++) {
-			for (int i = 1; i < mGridWidth; i++) {
-				index = INDEX3D(i, j, k);
-				// curlx = dw/dy - dv/dz
-				x = curlX[index] = (mCurVelW[INDEX3D(i, j + 1, k)] - mCurVelW[INDEX3D(i, j - 1, k)]) * 0.5f -
-					(mCurVelV[INDEX3D(i, j, k + 1)] - mCurVelV[INDEX3D(i, j, k - 1)]) * 0.5f;
-
-				// curly = du/dz - dw/dx
-				y = curlY[index] = (mCurVelU[INDEX3D(i, j, k + 1)] - mCurVelU[INDEX3D(i, j, k - 1)]) * 0.5f -
-					(mCurVelW[INDEX3D(i + 1, j, k)] - mCurVelW[INDEX3D(i - 1, j, k)]) * 0.5f;
+	if (solver == ConjugateGradient) {
+		ConjugateGradientSolve(boundaryCondition, x, x0, a, c);
+	}
+	else if (solver == Multigrid) {
+		MultigridSolve(boundaryCondition, x, x0, a, c);
+	}
+	else if (solver == RedBlackGaussSeidel) {
+		RedBlackGaussSeidelSolve(boundaryCondition, x, x0, a, c);
+	}
+	else {
+		GaussSeidelSolve(boundaryCondition, x, x0, a, c);
+	}
+}
 
-				// curlz = dv/dx - du/dy
-				z = curlZ[index] = (mCurVelV[INDEX3D(i + 1, j, k)] - mCurVelV[INDEX3D(i - 1, j, k)]) * 0.5f -
-					(mCurVelU[INDEX3D(i, j + 1, k)] - mCurVelU[INDEX3D(i, j - 1, k)]) * 0.5f;
+void Smoke::GaussSeidelSolve(int boundaryCondition, float* x, float* x0, float a, float c)
+{
+	float cRecip = 1.0f / c;
+	ActiveRegion& r = mActiveRegion;
 
-				// curl = |curl|
-				curl[index] = sqrtf(x * x + y * y + z * z);
+	//number of solver cylcles, the higher - the more accurate
+	for (int l = 0; l < mLinearSolveTimes; l++)
+	{
+		for (int k = r.startZ; k <= r.endZ; k++) {
+			for (int j = r.startY; j <= r.endY; j++) {
+				for (int i = r.startX; i <= r.endX; i++) {
+					x[INDEX3D(i, j, k)] = (x0[INDEX3D(i, j, k)] + a *
+						(x[INDEX3D(i - 1, j, k)] + x[INDEX3D(i + 1, j, k)] +	//neighbouring x
+							x[INDEX3D(i, j - 1, k)] + x[INDEX3D(i, j + 1, k)] +	//y
+							x[INDEX3D(i, j, k - 1)] + x[INDEX3D(i, j, k + 1)])	//z
+						) * cRecip;
+				}
 			}
 		}
+		//manage grid boundary
+		SetBoundary(boundaryCondition, x);
 	}
+}
 
-	//add curl to current velocity field
-	for (int k = 1; k < mGridWidth; k++) {
-		for (int j = 1; j < mGridWidth; j++) {
-			for (int i = 1; i < mGridWidth; i++) {
-				index = INDEX3D(i, j, k);
-
-				//confine magnitude of curls 
-				float Nx = (curl[INDEX3D(i + 1, j, k)] - curl[INDEX3D(i - 1, j, k)]) * 0.5f;
-				float Ny = (curl[INDEX3D(i, j + 1, k)] - curl[INDEX3D(i, j - 1, k)]) * 0.5f;
-				float Nz = (curl[INDEX3D(i, j, k + 1)] - curl[INDEX3D(i, j, k - 1)]) * 0.5f;
-				float len1 = 1.0f / (sqrtf(Nx * Nx + Ny * Ny + Nz * Nz) + 0.0000001f);
-				Nx *= len1;
-				Ny *= len1;
-				Nz *= len1;
+void Smoke::RedBlackGaussSeidelSolve(int boundaryCondition, float* x, float* x0, float a, float c)
+{
+	RedBlackRelax(boundaryCondition, x, x0, a, c, mGridWidth, mLinearSolveTimes, mActiveRegion);
+}
 
-				//add to current velocity field 
-				mCurVelU[index] += (Ny * curlZ[index] - Nz * curlY[index]) * dt0;
-				mCurVelV[index] += (Nz * curlX[index] - Nx * curlZ[index]) * dt0;
-				mCurVelW[index] += (Nx * curlY[index] - Ny * curlX[index]) * dt0;
-			}
-		}
-	}
-	
+void Smoke::RedBlackRelax(int boundaryCondition, float* x, float* x0, float a, float c, int gridWidth, int sweeps)
+{
+	RedBlackRelax(boundaryCondition, x, x0, a, c, gridWidth, sweeps, WholeGrid(gridWidth));
 }
 
-void Smoke::SetBoundary(int boundaryCondition, float* grid)
+void Smoke::RedBlackRelax(int boundaryCondition, float* x, float* x0, float a, float c, int gridWidth, int sweeps, const ActiveRegion& region)
 {
-	//shorten var names for readability
-	int N = mGridWidth, b = boundaryCondition;
-	float* x = grid;
+	float cRecip = 1.0f / c;
+	int w = gridWidth;
+	const ActiveRegion& r = region;
 
-	for (int i = 1; i <= mGridWidth; i++)
+	for (int l = 0; l < sweeps; l++)
 	{
-		for (int j = 1; j <= mGridWidth; j++) {
-			//set the boundary faces
-			x[INDEX3D(0, i, j)] = (b == 1) ? -x[INDEX3D(1, i, j)] : x[INDEX3D(1, i, j)];
-			x[INDEX3D(N + 1, i, j)] = (b == 1) ? -x[INDEX3D(N, i, j)] : x[INDEX3D(N, i, j)];
-			x[INDEX3D(i, 0, j)] = (b == 2) ? -x[INDEX3D(i, 1, j)] : x[INDEX3D(i, 1, j)];
-			x[INDEX3D(i, N + 1, j)] = (b == 2) ? -x[INDEX3D(i, N, j)] : x[INDEX3D(i, N, j)];
-			x[INDEX3D(i, j, 0)] = (b == 3) ? -x[INDEX3D(i, j, 1)] : x[INDEX3D(i, j, 1)];
-			x[INDEX3D(i, j, N + 1)] = (b == 3) ? -x[INDEX3D(i, j, N)] : x[INDEX3D(i, j, N)];
+		//relax the red cells, (i + j + k) even, then the black cells using the new red values
+		for (int colour = 0; colour < 2; colour++)
+		{
+			//each thread relaxes its own slab of z planes
+			mThreadPool->ParallelFor(r.startZ, r.endZ + 1, [&](int zStart, int zEnd) {
+				for (int k = zStart; k < zEnd; k++) {
+					for (int j = r.startY; j <= r.endY; j++) {
+
+						//first cell in this row with the current colour
+						int iStart = r.startX + ((r.startX + j + k + colour) & 1);
+
+						for (int i = iStart; i <= r.endX; i += 2) {
+							x[INDEX3DW(i, j, k, w)] = (x0[INDEX3DW(i, j, k, w)] + a *
+								(x[INDEX3DW(i - 1, j, k, w)] + x[INDEX3DW(i + 1, j, k, w)] +
+									x[INDEX3DW(i, j - 1, k, w)] + x[INDEX3DW(i, j + 1, k, w)] +
+									x[INDEX3DW(i, j, k - 1, w)] + x[INDEX3DW(i, j, k + 1, w)])
+								) * cRecip;
+						}
+					}
+				}
+			});
 		}
+		//manage grid boundary
+		SetBoundary(boundaryCondition, x, w);
 	}
-
-	//set corners
-	x[INDEX3D(0, 0, 0)] = (x[INDEX3D(1, 0, 0)] + x[INDEX3D(0, 1, 0)] + x[INDEX3D(0, 0, 1)]) / 3;
-	x[INDEX3D(0, N + 1, 0)] = (x[INDEX3D(1, N + 1, 0)] + x[INDEX3D(0, N, 0)] + x[INDEX3D(0, N + 1, 1)]) / 3;
-	x[INDEX3D(N + 1, 0, 0)] = (x[INDEX3D(N, 0, 0)] + x[INDEX3D(N + 1, 1, 0)] + x[INDEX3D(N + 1, 0, 1)]) / 3;
-	x[INDEX3D(N + 1, N + 1, 0)] = (x[INDEX3D(N, N + 1, 0)] + x[INDEX3D(N + 1, N, 0)] + x[INDEX3D(N + 1, N + 1, 1)]) / 3;
-	x[INDEX3D(0, 0, N + 1)] = (x[INDEX3D(1, 0, N + 1)] + x[INDEX3D(0, 1, N + 1)] + x[INDEX3D(0, 0, N)]) / 3;
-	x[INDEX3D(0, N + 1, N + 1)] = (x[INDEX3D(1, N + 1, N + 1)] + x[INDEX3D(0, N, N + 1)] + x[INDEX3D(0, N + 1, N)]) / 3;
-	x[INDEX3D(N + 1, 0, N + 1)] = (x[INDEX3D(N, 0, N + 1)] + x[INDEX3D(N + 1, 1, N + 1)] + x[INDEX3D(N + 1, 0, N)]) / 3;
-	x[INDEX3D(N + 1, N + 1, N + 1)] = (x[INDEX3D(N, N + 1, N + 1)] + x[INDEX3D(N + 1, N, N + 1)] + x[INDEX3D(N + 1, N + 1, N)]) / 3;
 }
 
-inline void Smoke::SwapVelPointers()
+void Smoke::SetupMultigrid()
 {
-	SWAPPOINTER(mPrevVelU, mCurVelU);
-	SWAPPOINTER(mPrevVelV, mCurVelV);
-	SWAPPOINTER(mPrevVelW, mCurVelW);
+	//keep halving the grid until it's small enough to solve with a few sweeps
+	int gridWidth = mGridWidth;
+	while (true)
+	{
+		int cellCount = (gridWidth + 2) * (gridWidth + 2) * (gridWidth + 2);
+
+		MultigridLevel level{};
+		level.gridWidth = gridWidth;
+		level.x = (mMultigridLevels.empty()) ? nullptr : (float*)calloc(cellCount, sizeof(float));
+		level.rhs = (float*)calloc(cellCount, sizeof(float));
+		level.residual = (float*)calloc(cellCount, sizeof(float));
+		mMultigridLevels.push_back(level);
+
+		if (gridWidth <= mMultigridCoarsestWidth) { break; }
+
+		//odd widths round up, the last coarse cell only covers one fine cell
+		gridWidth = (gridWidth + 1) / 2;
+	}
 }
 
-void Smoke::AddSource(float* targetGrid, float* sourceGrid, float dt)
+void Smoke::MultigridSolve(int boundaryCondition, float* x, float* x0, float a, float c)
 {
-	//add the source grid to the target grid
-	for (size_t i = 0; i < mTotalCellCount; i++)
+	if (mMultigridLevels.empty()) { SetupMultigrid(); }
+
+	//finest level solves straight into the given grid
+	MultigridLevel& fine = mMultigridLevels[0];
+	fine.x = x;
+	std::copy(x0, x0 + mTotalCellCount, fine.rhs);
+
+	//pressure with a fixed boundary only has a solution when the right hand side sums to zero,
+	//so remove the average, otherwise the residual could never reach the tolerance
+	if (boundaryCondition == 0 && abs(c - 6 * a) < 0.000001f) {
+		float mean = 0;
+		for (int k = 1; k <= mGridWidth; k++) {
+			for (int j = 1; j <= mGridWidth; j++) {
+				for (int i = 1; i <= mGridWidth; i++) { mean += fine.rhs[INDEX3D(i, j, k)]; }
+			}
+		}
+		mean /= (float)mGridWidth * mGridWidth * mGridWidth;
+
+		for (int k = 1; k <= mGridWidth; k++) {
+			for (int j = 1; j <= mGridWidth; j++) {
+				for (int i = 1; i <= mGridWidth; i++) { fine.rhs[INDEX3D(i, j, k)] -= mean; }
+			}
+		}
+	}
+
+	//run v-cycles until the residual is small enough
+	mLastSolverResidual = CalculateResidual(fine.residual, x, fine.rhs, a, c, mGridWidth);
+	for (mLastSolverIterations = 0; mLastSolverIterations < maxMultigridCycles && mLastSolverResidual > solverTolerance; mLastSolverIterations++)
 	{
-		//targetGrid[i] += sourceGrid[i] * dt;
-		targetGrid[i] = (targetGrid[i] + dt * sourceGrid[i]) / (1.0f + dt);
+		VCycle(0, boundaryCondition, a, c);
+		mLastSolverResidual = CalculateResidual(fine.residual, x, fine.rhs, a, c, mGridWidth);
 	}
 }
 
-void Smoke::AddBuoyancy(float dt)
+void Smoke::VCycle(int level, int boundaryCondition, float a, float c)
 {
-	//add upward force whereever there's velocity
-	for (int i = 0; i < mTotalCellCount; i++) {
-		mCurVelV[i] += mCurrentDensity[i] * buoyancyCoef * dt;
+	MultigridLevel& current = mMultigridLevels[level];
+
+	//coarsest level, small enough to just relax until solved
+	if (level == (int)mMultigridLevels.size() - 1) {
+		RedBlackRelax(boundaryCondition, current.x, current.rhs, a, c, current.gridWidth, mMultigridCoarsestSweeps);
+		return;
 	}
-}
 
+	MultigridLevel& coarse = mMultigridLevels[level + 1];
 
-float Smoke::GetTotalDensity()
-{
-	return GetGridTotal(mCurrentDensity);
+	//smooth out the high frequency error on this level
+	RedBlackRelax(boundaryCondition, current.x, current.rhs, a, c, current.gridWidth, mMultigridSmoothSweeps);
+
+	//move the remaining error to the coarser level, starting from no correction
+	CalculateResidual(current.residual, current.x, current.rhs, a, c, current.gridWidth);
+	Restrict(current.residual, current.gridWidth, coarse.rhs, coarse.gridWidth);
+	std::fill_n(coarse.x, (coarse.gridWidth + 2) * (coarse.gridWidth + 2) * (coarse.gridWidth + 2), 0.0f);
+
+	//the neighbour term scales with the inverse cell size squared, so drops by 4 on the coarser level
+	float coarseA = a / 4;
+	float coarseC = c - 6 * a + 6 * coarseA;
+	VCycle(level + 1, boundaryCondition, coarseA, coarseC);
+
+	//correct this level and smooth the interpolation error
+	SetBoundary(boundaryCondition, coarse.x, coarse.gridWidth);
+	ProlongateAdd(coarse.x, coarse.gridWidth, current.x, current.gridWidth);
+	SetBoundary(boundaryCondition, current.x, current.gridWidth);
+
+	RedBlackRelax(boundaryCondition, current.x, current.rhs, a, c, current.gridWidth, mMultigridSmoothSweeps);
 }
 
-float Smoke::GetGridTotal(float* grid)
+float Smoke::CalculateResidual(float* residual, float* x, float* rhs, float a, float c, int gridWidth)
 {
-	//keep acculmative total
-	float total = 0;
+	int w = gridWidth;
+	float maxResidual = 0;
+	std::mutex maxMutex;
+
+	mThreadPool->ParallelFor(1, w + 1, [&](int zStart, int zEnd) {
+		float sliceMax = 0;
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = 1; j <= w; j++) {
+				for (int i = 1; i <= w; i++) {
+					float r = residual[INDEX3DW(i, j, k, w)] = rhs[INDEX3DW(i, j, k, w)] - c * x[INDEX3DW(i, j, k, w)] + a *
+						(x[INDEX3DW(i - 1, j, k, w)] + x[INDEX3DW(i + 1, j, k, w)] +
+							x[INDEX3DW(i, j - 1, k, w)] + x[INDEX3DW(i, j + 1, k, w)] +
+							x[INDEX3DW(i, j, k - 1, w)] + x[INDEX3DW(i, j, k + 1, w)]);
+
+					if (abs(r) > sliceMax) { sliceMax = abs(r); }
+				}
+			}
+		}
 
-	//loop over whole grid adding to the total
-	for (size_t i = 0; i < mTotalCellCount; i++) { total += grid[i]; }
+		//combine each thread's largest residual
+		std::lock_guard<std::mutex> lock(maxMutex);
+		if (sliceMax > maxResidual) { maxResidual = sliceMax; }
+	});
 
-	return total;
+	return maxResidual;
 }
 
-int Smoke::GetSavedSimTotalFrames()
+void Smoke::Restrict(float* fine, int fineWidth, float* coarse, int coarseWidth)
 {
-	return mReadSimTotalFrames;
+	int fw = fineWidth, cw = coarseWidth;
+
+	mThreadPool->ParallelFor(1, cw + 1, [&](int zStart, int zEnd) {
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = 1; j <= cw; j++) {
+				for (int i = 1; i <= cw; i++) {
+
+					//average the fine cells covered by this coarse cell, up to 8
+					float total = 0;
+					int count = 0;
+					for (int fk = 2 * k - 1; fk <= 2 * k && fk <= fw; fk++) {
+						for (int fj = 2 * j - 1; fj <= 2 * j && fj <= fw; fj++) {
+							for (int fi = 2 * i - 1; fi <= 2 * i && fi <= fw; fi++) {
+								total += fine[INDEX3DW(fi, fj, fk, fw)];
+								count++;
+							}
+						}
+					}
+					coarse[INDEX3DW(i, j, k, cw)] = total / count;
+				}
+			}
+		}
+	});
 }
 
-void Smoke::ClearDensity()
+void Smoke::ProlongateAdd(float* coarse, int coarseWidth, float* fine, int fineWidth)
 {
-	//loop over all cells clearing thier denisty
-	for (size_t i = 0; i < mTotalCellCount; i++)
-	{
-		mCurrentDensity[i] = 0.0f;
-		mPrevDensity[i] = 0.0f;
-	}
-}
+	int fw = fineWidth, cw = coarseWidth;
+
+	mThreadPool->ParallelFor(1, fw + 1, [&](int zStart, int zEnd) {
+		for (int k = zStart; k < zEnd; k++) {
+			//coarse cell containing this fine cell, and the nearest other coarse cell in each direction
+			int k0 = (k + 1) / 2, k1 = (k & 1) ? k0 - 1 : k0 + 1;
+
+			for (int j = 1; j <= fw; j++) {
+				int j0 = (j + 1) / 2, j1 = (j & 1) ? j0 - 1 : j0 + 1;
+
+				for (int i = 1; i <= fw; i++) {
+					int i0 = (i + 1) / 2, i1 = (i & 1) ? i0 - 1 : i0 + 1;
+
+					//cell centred trilinear weights, 3/4 from the containing cell, 1/4 from the neighbour
+					fine[INDEX3DW(i, j, k, fw)] +=
+						0.75f * (0.75f * (0.75f * coarse[INDEX3DW(i0, j0, k0, cw)] + 0.25f * coarse[INDEX3DW(i1, j0, k0, cw)]) +
+							0.25f * (0.75f * coarse[INDEX3DW(i0, j1, k0, cw)] + 0.25f * coarse[INDEX3DW(i1, j1, k0, cw)])) +
+						0.25f * (0.75f * (0.75f * coarse[INDEX3DW(i0, j0, k1, cw)] + 0.25f * coarse[INDEX3DW(i1, j0, k1, cw)]) +
+							0.25f * (0.75f * coarse[INDEX3DW(i0, j1, k1, cw)] + 0.25f * coarse[INDEX3DW(i1, j1, k1, cw)]));
+				}
+			}
+		}
+	});
+}
+
+void Smoke::SetupConjugateGradient()
+{
+	mCGResidual = (float*)calloc(mTotalCellCount, sizeof(float));
+	mCGAux = (float*)calloc(mTotalCellCount, sizeof(float));
+	mCGSearch = (float*)calloc(mTotalCellCount, sizeof(float));
+	mCGProduct = (float*)calloc(mTotalCellCount, sizeof(float));
+	mCGPrecon = (float*)calloc(mTotalCellCount, sizeof(float));
+}
+
+void Smoke::ConjugateGradientSolve(int boundaryCondition, float* x, float* x0, float a, float c)
+{
+	if (!mCGResidual) { SetupConjugateGradient(); }
+
+	//shorten var names for readability
+	float* r = mCGResidual, * z = mCGAux, * s = mCGSearch, * q = mCGProduct;
+
+	//starting residual, r = x0 - A * x
+	ApplySystemMatrix(boundaryCondition, x, q, a, c);
+	mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = 1; j <= mGridWidth; j++) {
+				for (int i = 1; i <= mGridWidth; i++) {
+					r[INDEX3D(i, j, k)] = x0[INDEX3D(i, j, k)] - q[INDEX3D(i, j, k)];
+				}
+			}
+		}
+	});
+
+	//pressure with a fixed boundary only has a solution when the residual sums to zero, so remove the average
+	if (boundaryCondition == 0 && abs(c - 6 * a) < 0.000001f) {
+		float mean = (float)(DotProduct(r) / ((double)mGridWidth * mGridWidth * mGridWidth));
+
+		mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+			for (int k = zStart; k < zEnd; k++) {
+				for (int j = 1; j <= mGridWidth; j++) {
+					for (int i = 1; i <= mGridWidth; i++) { r[INDEX3D(i, j, k)] -= mean; }
+				}
+			}
+		});
+	}
+
+	//already solved, e.g. a calm frame
+	mLastSolverIterations = 0;
+	mLastSolverResidual = MaxAbsolute(r);
+	if (mLastSolverResidual <= solverTolerance) {
+		SetBoundary(boundaryCondition, x);
+		return;
+	}
+
+	//first search direction is the preconditioned residual
+	BuildPreconditioner(boundaryCondition, a, c);
+	ApplyPreconditioner(r, z, a);
+	std::copy(z, z + mTotalCellCount, s);
+	double sigma = DotProduct(r, z);
+
+	for (mLastSolverIterations = 1; mLastSolverIterations <= maxConjugateGradientIterations; mLastSolverIterations++)
+	{
+		//step along the search direction
+		ApplySystemMatrix(boundaryCondition, s, q, a, c);
+		double sq = DotProduct(s, q);
+		if (sq == 0.0) { break; }
+		float alpha = (float)(sigma / sq);
+
+		float maxResidual = 0;
+		std::mutex maxMutex;
+		mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+			float sliceMax = 0;
+			for (int k = zStart; k < zEnd; k++) {
+				for (int j = 1; j <= mGridWidth; j++) {
+					for (int i = 1; i <= mGridWidth; i++) {
+						int index = INDEX3D(i, j, k);
+						x[index] += alpha * s[index];
+						r[index] -= alpha * q[index];
+						if (abs(r[index]) > sliceMax) { sliceMax = abs(r[index]); }
+					}
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(maxMutex);
+			if (sliceMax > maxResidual) { maxResidual = sliceMax; }
+		});
+
+		//early exit once accurate enough
+		mLastSolverResidual = maxResidual;
+		if (mLastSolverResidual <= solverTolerance) { break; }
+
+		//new search direction, conjugate to the previous ones
+		ApplyPreconditioner(r, z, a);
+		double sigmaNew = DotProduct(r, z);
+		float beta = (float)(sigmaNew / sigma);
+		sigma = sigmaNew;
+
+		mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+			for (int k = zStart; k < zEnd; k++) {
+				for (int j = 1; j <= mGridWidth; j++) {
+					for (int i = 1; i <= mGridWidth; i++) {
+						s[INDEX3D(i, j, k)] = z[INDEX3D(i, j, k)] + beta * s[INDEX3D(i, j, k)];
+					}
+				}
+			}
+		});
+	}
+
+	//manage grid boundary
+	SetBoundary(boundaryCondition, x);
+}
+
+void Smoke::ApplySystemMatrix(int boundaryCondition, float* grid, float* product, float a, float c)
+{
+	//the boundary cells mirror the cells next to them, so they act as part of the diagonal
+	SetBoundary(boundaryCondition, grid);
+
+	mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = 1; j <= mGridWidth; j++) {
+				for (int i = 1; i <= mGridWidth; i++) {
+					product[INDEX3D(i, j, k)] = c * grid[INDEX3D(i, j, k)] - a *
+						(grid[INDEX3D(i - 1, j, k)] + grid[INDEX3D(i + 1, j, k)] +
+							grid[INDEX3D(i, j - 1, k)] + grid[INDEX3D(i, j + 1, k)] +
+							grid[INDEX3D(i, j, k - 1)] + grid[INDEX3D(i, j, k + 1)]);
+				}
+			}
+		}
+	});
+}
+
+inline float Smoke::GetSystemDiagonal(int boundaryCondition, int i, int j, int k, float a, float c)
+{
+	//a boundary cell copies this cell's value, or the negative for velocity along its axis
+	float diagonal = c;
+	float xMirror = (boundaryCondition == 1) ? -1.0f : 1.0f;
+	float yMirror = (boundaryCondition == 2) ? -1.0f : 1.0f;
+	float zMirror = (boundaryCondition == 3) ? -1.0f : 1.0f;
+
+	if (i == 1) { diagonal -= a * xMirror; }
+	if (i == mGridWidth) { diagonal -= a * xMirror; }
+	if (j == 1) { diagonal -= a * yMirror; }
+	if (j == mGridWidth) { diagonal -= a * yMirror; }
+	if (k == 1) { diagonal -= a * zMirror; }
+	if (k == mGridWidth) { diagonal -= a * zMirror; }
+
+	return diagonal;
+}
+
+void Smoke::BuildPreconditioner(int boundaryCondition, float a, float c)
+{
+	float* precon = mCGPrecon;
+
+	//jacobi, inverse of the diagonal
+	if (preconditioner == JacobiPreconditioner) {
+		mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+			for (int k = zStart; k < zEnd; k++) {
+				for (int j = 1; j <= mGridWidth; j++) {
+					for (int i = 1; i <= mGridWidth; i++) {
+						precon[INDEX3D(i, j, k)] = 1.0f / GetSystemDiagonal(boundaryCondition, i, j, k, a, c);
+					}
+				}
+			}
+		});
+		return;
+	}
+
+	//modified incomplete cholesky, each cell depends on the cells before it so runs in grid order.
+	//off diagonal entries are -a between neighbouring cells inside the boundary, 0 otherwise
+	for (int k = 1; k <= mGridWidth; k++) {
+		for (int j = 1; j <= mGridWidth; j++) {
+			for (int i = 1; i <= mGridWidth; i++) {
+				float diagonal = GetSystemDiagonal(boundaryCondition, i, j, k, a, c);
+				float e = diagonal;
+
+				//previous cell in x, and its off diagonals in the other directions
+				if (i > 1) {
+					float p = precon[INDEX3D(i - 1, j, k)];
+					float offJ = (j < mGridWidth) ? -a : 0, offK = (k < mGridWidth) ? -a : 0;
+					e -= (a * p) * (a * p) + mCholeskyTuning * (-a) * (offJ + offK) * p * p;
+				}
+				//previous cell in y
+				if (j > 1) {
+					float p = precon[INDEX3D(i, j - 1, k)];
+					float offI = (i < mGridWidth) ? -a : 0, offK = (k < mGridWidth) ? -a : 0;
+					e -= (a * p) * (a * p) + mCholeskyTuning * (-a) * (offI + offK) * p * p;
+				}
+				//previous cell in z
+				if (k > 1) {
+					float p = precon[INDEX3D(i, j, k - 1)];
+					float offI = (i < mGridWidth) ? -a : 0, offJ = (j < mGridWidth) ? -a : 0;
+					e -= (a * p) * (a * p) + mCholeskyTuning * (-a) * (offI + offJ) * p * p;
+				}
+
+				//fall back to the diagonal if the factor gets too small
+				if (e < mCholeskySafety * diagonal) { e = diagonal; }
+				precon[INDEX3D(i, j, k)] = 1.0f / sqrtf(e);
+			}
+		}
+	}
+}
+
+void Smoke::ApplyPreconditioner(float* input, float* output, float a)
+{
+	float* precon = mCGPrecon;
+
+	if (preconditioner == JacobiPreconditioner) {
+		mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+			for (int k = zStart; k < zEnd; k++) {
+				for (int j = 1; j <= mGridWidth; j++) {
+					for (int i = 1; i <= mGridWidth; i++) {
+						output[INDEX3D(i, j, k)] = input[INDEX3D(i, j, k)] * precon[INDEX3D(i, j, k)];
+					}
+				}
+			}
+		});
+		return;
+	}
+
+	//incomplete cholesky, solve L * q = input going forwards through the grid
+	for (int k = 1; k <= mGridWidth; k++) {
+		for (int j = 1; j <= mGridWidth; j++) {
+			for (int i = 1; i <= mGridWidth; i++) {
+				float t = input[INDEX3D(i, j, k)];
+				if (i > 1) { t += a * precon[INDEX3D(i - 1, j, k)] * output[INDEX3D(i - 1, j, k)]; }
+				if (j > 1) { t += a * precon[INDEX3D(i, j - 1, k)] * output[INDEX3D(i, j - 1, k)]; }
+				if (k > 1) { t += a * precon[INDEX3D(i, j, k - 1)] * output[INDEX3D(i, j, k - 1)]; }
+				output[INDEX3D(i, j, k)] = t * precon[INDEX3D(i, j, k)];
+			}
+		}
+	}
+
+	//then solve L^T * output = q going backwards, in place
+	for (int k = mGridWidth; k >= 1; k--) {
+		for (int j = mGridWidth; j >= 1; j--) {
+			for (int i = mGridWidth; i >= 1; i--) {
+				float p = precon[INDEX3D(i, j, k)];
+				float t = output[INDEX3D(i, j, k)];
+				if (i < mGridWidth) { t += a * p * output[INDEX3D(i + 1, j, k)]; }
+				if (j < mGridWidth) { t += a * p * output[INDEX3D(i, j + 1, k)]; }
+				if (k < mGridWidth) { t += a * p * output[INDEX3D(i, j, k + 1)]; }
+				output[INDEX3D(i, j, k)] = t * p;
+			}
+		}
+	}
+}
+
+double Smoke::DotProduct(float* grid1, float* grid2)
+{
+	double total = 0;
+	std::mutex totalMutex;
+
+	mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+		//accumulate in double, grids can have millions of cells
+		double sliceTotal = 0;
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = 1; j <= mGridWidth; j++) {
+				for (int i = 1; i <= mGridWidth; i++) {
+					sliceTotal += (double)grid1[INDEX3D(i, j, k)] * (grid2 ? grid2[INDEX3D(i, j, k)] : 1.0f);
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(totalMutex);
+		total += sliceTotal;
+	});
+
+	return total;
+}
+
+float Smoke::MaxAbsolute(float* grid)
+{
+	float maxValue = 0;
+	std::mutex maxMutex;
+
+	mThreadPool->ParallelFor(1, mGridWidth + 1, [&](int zStart, int zEnd) {
+		float sliceMax = 0;
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = 1; j <= mGridWidth; j++) {
+				for (int i = 1; i <= mGridWidth; i++) {
+					if (abs(grid[INDEX3D(i, j, k)]) > sliceMax) { sliceMax = abs(grid[INDEX3D(i, j, k)]); }
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(maxMutex);
+		if (sliceMax > maxValue) { maxValue = sliceMax; }
+	});
+
+	return maxValue;
+}
+
+void Smoke::AddForces(float dt)
+{
+	//the bricks' forces are written to the previous velocity, then swapped to be current
+	if (mStorage == SparseStorage) {
+		UpdateActiveBricks();
+		SparseForces(dt);
+		std::swap(mBrickVelU, mBrickPrevVelU); std::swap(mBrickVelV, mBrickPrevVelV); std::swap(mBrickVelW, mBrickPrevVelW);
+		return;
+	}
+
+	ForceSweep(dt);
+}
+
+void Smoke::VorticityConfinement(float dt)
+{
+	RequireDenseStorage("VorticityConfinement");
+
+	//only the active region can change, the curl is 0 outside it the same as the fused sweep
+	ActiveRegion& r = mActiveRegion;
+	if (IsRegionEmpty(r)) { return; }
+
+	//curl grids in the temp buffers, which projection only uses within the active region, and the reference curl grid
+	if (!mReferenceCurlZ) { mReferenceCurlZ = (float*)calloc(mTotalCellCount, sizeof(float)); }
+	float* curlX = tempBufX, * curlY = tempBuf, * curlZ = mReferenceCurlZ;
+
+	//curl coeficient 
+	float dt0 = dt * mVorticityCoef;
+
+	//no curl on the layer around the region
+	for (int k = r.startZ - 1; k <= r.endZ + 1; k++) {
+		for (int j = r.startY - 1; j <= r.endY + 1; j++) {
+			for (float* grid : { curlX, curlY, curlZ }) {
+				std::fill_n(grid + INDEX3D(r.startX - 1, j, k), r.endX - r.startX + 3, 0.0f);
+			}
+		}
+	}
+
+	//calculate curl in each direction using current velocity field
+	for (int k = r.startZ; k <= r.endZ; k++) {
+		for (int j = r.startY; j <= r.endY; j++) {
+			for (int i = r.startX; i <= r.endX; i++) {
+				int index = INDEX3D(i, j, k);
+				// curlx = dw/dy - dv/dz
+				curlX[index] = (mCurVelW[INDEX3D(i, j + 1, k)] - mCurVelW[INDEX3D(i, j - 1, k)]) * 0.5f -
+					(mCurVelV[INDEX3D(i, j, k + 1)] - mCurVelV[INDEX3D(i, j, k - 1)]) * 0.5f;
+
+				// curly = du/dz - dw/dx
+				curlY[index] = (mCurVelU[INDEX3D(i, j, k + 1)] - mCurVelU[INDEX3D(i, j, k - 1)]) * 0.5f -
+					(mCurVelW[INDEX3D(i + 1, j, k)] - mCurVelW[INDEX3D(i - 1, j, k)]) * 0.5f;
+
+				// curlz = dv/dx - du/dy
+				curlZ[index] = (mCurVelV[INDEX3D(i + 1, j, k)] - mCurVelV[INDEX3D(i - 1, j, k)]) * 0.5f -
+					(mCurVelU[INDEX3D(i, j + 1, k)] - mCurVelU[INDEX3D(i, j - 1, k)]) * 0.5f;
+			}
+		}
+	}
+
+	// |curl|, worked out again for each neighbour rather than kept in a fourth grid
+	auto curl = [&](int index) {
+		return sqrtf(curlX[index] * curlX[index] + curlY[index] * curlY[index] + curlZ[index] * curlZ[index]);
+	};
+
+	//add curl to current velocity field
+	for (int k = r.startZ; k <= r.endZ; k++) {
+		for (int j = r.startY; j <= r.endY; j++) {
+			for (int i = r.startX; i <= r.endX; i++) {
+				int index = INDEX3D(i, j, k);
+
+				//confine magnitude of curls 
+				float Nx = (curl(INDEX3D(i + 1, j, k)) - curl(INDEX3D(i - 1, j, k))) * 0.5f;
+				float Ny = (curl(INDEX3D(i, j + 1, k)) - curl(INDEX3D(i, j - 1, k))) * 0.5f;
+				float Nz = (curl(INDEX3D(i, j, k + 1)) - curl(INDEX3D(i, j, k - 1))) * 0.5f;
+				float len1 = 1.0f / (sqrtf(Nx * Nx + Ny * Ny + Nz * Nz) + 0.0000001f);
+				Nx *= len1;
+				Ny *= len1;
+				Nz *= len1;
+
+				//add to current velocity field 
+				mCurVelU[index] += (Ny * curlZ[index] - Nz * curlY[index]) * dt0;
+				mCurVelV[index] += (Nz * curlX[index] - Nx * curlZ[index]) * dt0;
+				mCurVelW[index] += (Nx * curlY[index] - Ny * curlX[index]) * dt0;
+			}
+		}
+	}
+}
+
+void Smoke::ForceSweep(float dt)
+{
+	int planeWidth = mGridWidth + 2;
+	int planeSize = planeWidth * planeWidth;
+
+	//curl coeficient 
+	float dt0 = dt * mVorticityCoef;
+	float ambientScale = 1.0f / (1.0f + dt);
+	float buoyancy = buoyancyCoef * dt;
+
+	//each plane's curl x, y, z and magnitude, in a rolling set of plane buffers
+	auto curlPlane = [&](int k, int component) {
+		return mCurlPlanes + ((k % mCurlPlaneCount) * 4 + component) * planeSize;
+	};
+
+	//only the active region and the layer of cells around it can change
+	ActiveRegion& r = mActiveRegion;
+	if (IsRegionEmpty(r)) { return; }
+	int x0 = r.startX - 1, y0 = r.startY - 1, z0 = r.startZ - 1;
+	int x1 = r.endX + 1, y1 = r.endY + 1, z1 = r.endZ + 1;
+	int rowLength = x1 - x0 + 1;
+
+	//each step adds the pointwise forces to plane s, the curl of plane s - 2 and confines plane s - 4.
+	//the stages are far enough apart that the rows of one step can be split across threads: 
+	//curl only reads planes that are finished with the pointwise forces and not yet confined
+	for (int s = z0; s <= z1 + 4; s++)
+	{
+		int curlK = s - 2, confineK = s - 4;
+
+		mThreadPool->ParallelFor(y0, y1 + 1, [&](int jStart, int jEnd) {
+			//ambient velocity and buoyancy, including the layer around the region which may be the boundary
+			if (s <= z1) {
+				for (int j = jStart; j < jEnd; j++) {
+					for (int i = x0; i <= x1; i++) {
+						int index = INDEX3D(i, j, s);
+						mCurVelU[index] = (mCurVelU[index] + dt * mAmbientVelU[index]) * ambientScale;
+						mCurVelV[index] = (mCurVelV[index] + dt * mAmbientVelV[index]) * ambientScale + mCurrentDensity[index] * buoyancy;
+						mCurVelW[index] = (mCurVelW[index] + dt * mAmbientVelW[index]) * ambientScale;
+					}
+				}
+			}
+
+			//calculate curl in each direction using current velocity field
+			if (curlK >= z0 && curlK <= z1) {
+				float* curlX = curlPlane(curlK, 0), * curlY = curlPlane(curlK, 1), * curlZ = curlPlane(curlK, 2), * curl = curlPlane(curlK, 3);
+
+				for (int j = jStart; j < jEnd; j++) {
+					//no curl outside the active region
+					if (curlK == z0 || curlK == z1 || j == y0 || j == y1) {
+						for (int c = 0; c < 4; c++) {
+							std::fill_n(curlPlane(curlK, c) + x0 + planeWidth * j, rowLength, 0.0f);
+						}
+						continue;
+					}
+					for (int c = 0; c < 4; c++) {
+						curlPlane(curlK, c)[x0 + planeWidth * j] = 0.0f;
+						curlPlane(curlK, c)[x1 + planeWidth * j] = 0.0f;
+					}
+
+					int k = curlK;
+					for (int i = r.startX; i <= r.endX; i++) {
+						int index = i + planeWidth * j;
+						// curlx = dw/dy - dv/dz
+						float x = curlX[index] = (mCurVelW[INDEX3D(i, j + 1, k)] - mCurVelW[INDEX3D(i, j - 1, k)]) * 0.5f -
+							(mCurVelV[INDEX3D(i, j, k + 1)] - mCurVelV[INDEX3D(i, j, k - 1)]) * 0.5f;
+
+						// curly = du/dz - dw/dx
+						float y = curlY[index] = (mCurVelU[INDEX3D(i, j, k + 1)] - mCurVelU[INDEX3D(i, j, k - 1)]) * 0.5f -
+							(mCurVelW[INDEX3D(i + 1, j, k)] - mCurVelW[INDEX3D(i - 1, j, k)]) * 0.5f;
+
+						// curlz = dv/dx - du/dy
+						float z = curlZ[index] = (mCurVelV[INDEX3D(i + 1, j, k)] - mCurVelV[INDEX3D(i - 1, j, k)]) * 0.5f -
+							(mCurVelU[INDEX3D(i, j + 1, k)] - mCurVelU[INDEX3D(i, j - 1, k)]) * 0.5f;
+
+						// curl = |curl|
+						curl[index] = sqrtf(x * x + y * y + z * z);
+					}
+				}
+			}
+
+			//add curl to current velocity field
+			if (confineK > z0 && confineK < z1) {
+				int k = confineK;
+				float* curlX = curlPlane(k, 0), * curlY = curlPlane(k, 1), * curlZ = curlPlane(k, 2);
+				float* curl = curlPlane(k, 3), * curlBelow = curlPlane(k - 1, 3), * curlAbove = curlPlane(k + 1, 3);
+
+				for (int j = std::max(jStart, r.startY); j < std::min(jEnd, r.endY + 1); j++) {
+					for (int i = r.startX; i <= r.endX; i++) {
+						int planeIndex = i + planeWidth * j;
+						int index = INDEX3D(i, j, k);
+
+						//confine magnitude of curls 
+						float Nx = (curl[planeIndex + 1] - curl[planeIndex - 1]) * 0.5f;
+						float Ny = (curl[planeIndex + planeWidth] - curl[planeIndex - planeWidth]) * 0.5f;
+						float Nz = (curlAbove[planeIndex] - curlBelow[planeIndex]) * 0.5f;
+						float len1 = 1.0f / (sqrtf(Nx * Nx + Ny * Ny + Nz * Nz) + 0.0000001f);
+						Nx *= len1;
+						Ny *= len1;
+						Nz *= len1;
+
+						//add to current velocity field 
+						mCurVelU[index] += (Ny * curlZ[planeIndex] - Nz * curlY[planeIndex]) * dt0;
+						mCurVelV[index] += (Nz * curlX[planeIndex] - Nx * curlZ[planeIndex]) * dt0;
+						mCurVelW[index] += (Nx * curlY[planeIndex] - Ny * curlX[planeIndex]) * dt0;
+					}
+				}
+			}
+		});
+	}
+}
+
+void Smoke::SetBoundary(int boundaryCondition, float* grid)
+{
+	SetBoundary(boundaryCondition, grid, mGridWidth);
+}
+
+void Smoke::SetBoundary(int boundaryCondition, float* grid, int gridWidth)
+{
+	//shorten var names for readability
+	int N = gridWidth, b = boundaryCondition;
+	float* x = grid;
+
+	for (int i = 1; i <= N; i++)
+	{
+		for (int j = 1; j <= N; j++) {
+			//set the boundary faces
+			x[INDEX3DW(0, i, j, N)] = (b == 1) ? -x[INDEX3DW(1, i, j, N)] : x[INDEX3DW(1, i, j, N)];
+			x[INDEX3DW(N + 1, i, j, N)] = (b == 1) ? -x[INDEX3DW(N, i, j, N)] : x[INDEX3DW(N, i, j, N)];
+			x[INDEX3DW(i, 0, j, N)] = (b == 2) ? -x[INDEX3DW(i, 1, j, N)] : x[INDEX3DW(i, 1, j, N)];
+			x[INDEX3DW(i, N + 1, j, N)] = (b == 2) ? -x[INDEX3DW(i, N, j, N)] : x[INDEX3DW(i, N, j, N)];
+			x[INDEX3DW(i, j, 0, N)] = (b == 3) ? -x[INDEX3DW(i, j, 1, N)] : x[INDEX3DW(i, j, 1, N)];
+			x[INDEX3DW(i, j, N + 1, N)] = (b == 3) ? -x[INDEX3DW(i, j, N, N)] : x[INDEX3DW(i, j, N, N)];
+		}
+	}
+
+	//set corners
+	x[INDEX3DW(0, 0, 0, N)] = (x[INDEX3DW(1, 0, 0, N)] + x[INDEX3DW(0, 1, 0, N)] + x[INDEX3DW(0, 0, 1, N)]) / 3;
+	x[INDEX3DW(0, N + 1, 0, N)] = (x[INDEX3DW(1, N + 1, 0, N)] + x[INDEX3DW(0, N, 0, N)] + x[INDEX3DW(0, N + 1, 1, N)]) / 3;
+	x[INDEX3DW(N + 1, 0, 0, N)] = (x[INDEX3DW(N, 0, 0, N)] + x[INDEX3DW(N + 1, 1, 0, N)] + x[INDEX3DW(N + 1, 0, 1, N)]) / 3;
+	x[INDEX3DW(N + 1, N + 1, 0, N)] = (x[INDEX3DW(N, N + 1, 0, N)] + x[INDEX3DW(N + 1, N, 0, N)] + x[INDEX3DW(N + 1, N + 1, 1, N)]) / 3;
+	x[INDEX3DW(0, 0, N + 1, N)] = (x[INDEX3DW(1, 0, N + 1, N)] + x[INDEX3DW(0, 1, N + 1, N)] + x[INDEX3DW(0, 0, N, N)]) / 3;
+	x[INDEX3DW(0, N + 1, N + 1, N)] = (x[INDEX3DW(1, N + 1, N + 1, N)] + x[INDEX3DW(0, N, N + 1, N)] + x[INDEX3DW(0, N + 1, N, N)]) / 3;
+	x[INDEX3DW(N + 1, 0, N + 1, N)] = (x[INDEX3DW(N, 0, N + 1, N)] + x[INDEX3DW(N + 1, 1, N + 1, N)] + x[INDEX3DW(N + 1, 0, N, N)]) / 3;
+	x[INDEX3DW(N + 1, N + 1, N + 1, N)] = (x[INDEX3DW(N, N + 1, N + 1, N)] + x[INDEX3DW(N + 1, N, N + 1, N)] + x[INDEX3DW(N + 1, N + 1, N, N)]) / 3;
+}
+
+inline void Smoke::SwapVelPointers()
+{
+	SWAPPOINTER(mPrevVelU, mCurVelU);
+	SWAPPOINTER(mPrevVelV, mCurVelV);
+	SWAPPOINTER(mPrevVelW, mCurVelW);
+}
+
+void Smoke::AddSource(float* targetGrid, float* sourceGrid, float dt)
+{
+	RequireDenseStorage("AddSource");
+
+	//add the source grid to the target grid
+	for (size_t i = 0; i < mTotalCellCount; i++)
+	{
+		//targetGrid[i] += sourceGrid[i] * dt;
+		targetGrid[i] = (targetGrid[i] + dt * sourceGrid[i]) / (1.0f + dt);
+	}
+}
+
+void Smoke::AddBuoyancy(float dt)
+{
+	RequireDenseStorage("AddBuoyancy");
+
+	//add upward force whereever there's velocity
+	for (int i = 0; i < mTotalCellCount; i++) {
+		mCurVelV[i] += mCurrentDensity[i] * buoyancyCoef * dt;
+	}
+}
+
+
+void Smoke::UpdateActiveRegion()
+{
+	//the whole grid is simulated when tracking is off, there's ambient wind everywhere or a solver works on the whole grid
+	bool bWholeGridSolver = diffusionSolver == Multigrid || diffusionSolver == ConjugateGradient ||
+		pressureSolver == Multigrid || pressureSolver == ConjugateGradient;
+	if (!bTrackActiveRegion || bAmbientVelocity || bWholeGridSolver) {
+		mActiveRegion = WholeGrid(mGridWidth);
+		return;
+	}
+
+	ActiveRegion& r = mActiveRegion;
+	if (IsRegionEmpty(r)) { return; }
+
+	//bounds of the cells with density or velocity, only cells inside the current region can have any
+	ActiveRegion found = EmptyRegion();
+	found.startX = found.startY = found.startZ = mGridWidth + 1;
+	std::mutex foundMutex;
+
+	mThreadPool->ParallelFor(r.startZ, r.endZ + 1, [&](int zStart, int zEnd) {
+		ActiveRegion slab = found;
+
+		for (int k = zStart; k < zEnd; k++) {
+			for (int j = r.startY; j <= r.endY; j++) {
+				for (int i = r.startX; i <= r.endX; i++) {
+					int index = INDEX3D(i, j, k);
+					float density = abs(mCurrentDensity[index]);
+					float speed = std::max(abs(mCurVelU[index]), std::max(abs(mCurVelV[index]), abs(mCurVelW[index])));
+					if (density <= mActiveThreshold && speed <= mActiveThreshold) { continue; }
+
+					slab.startX = std::min(slab.startX, i); slab.endX = std::max(slab.endX, i);
+					slab.startY = std::min(slab.startY, j); slab.endY = std::max(slab.endY, j);
+					slab.startZ = std::min(slab.startZ, k); slab.endZ = std::max(slab.endZ, k);
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(foundMutex);
+		found.startX = std::min(found.startX, slab.startX); found.endX = std::max(found.endX, slab.endX);
+		found.startY = std::min(found.startY, slab.startY); found.endY = std::max(found.endY, slab.endY);
+		found.startZ = std::min(found.startZ, slab.startZ); found.endZ = std::max(found.endZ, slab.endZ);
+	});
+
+	ActiveRegion next = EmptyRegion();
+	if (!IsRegionEmpty(found)) {
+		//cells outside the box are still, so advection only pulls smoke into them from cells within a step's travel.
+		//the margin leaves room for that and for the pressure to spread velocity around the smoke
+		int dilation = mActiveRegionMargin;
+
+		next.startX = std::max(found.startX - dilation, 1); next.endX = std::min(found.endX + dilation, mGridWidth);
+		next.startY = std::max(found.startY - dilation, 1); next.endY = std::min(found.endY + dilation, mGridWidth);
+		next.startZ = std::max(found.startZ - dilation, 1); next.endZ = std::min(found.endZ + dilation, mGridWidth);
+	}
+
+	//cells left outside still hold values in the grids the steps swap between, so clear them
+	float* grids[8] = { mCurrentDensity, mPrevDensity, mCurVelU, mCurVelV, mCurVelW, mPrevVelU, mPrevVelV, mPrevVelW };
+	for (int k = r.startZ; k <= r.endZ; k++) {
+		for (int j = r.startY; j <= r.endY; j++) {
+			bool rowInside = k >= next.startZ && k <= next.endZ && j >= next.startY && j <= next.endY;
+
+			for (float* grid : grids) {
+				if (!rowInside) {
+					std::fill(grid + INDEX3D(r.startX, j, k), grid + INDEX3D(r.endX + 1, j, k), 0.0f);
+					continue;
+				}
+				if (r.startX < next.startX) { std::fill(grid + INDEX3D(r.startX, j, k), grid + INDEX3D(next.startX, j, k), 0.0f); }
+				if (r.endX > next.endX) { std::fill(grid + INDEX3D(next.endX + 1, j, k), grid + INDEX3D(r.endX + 1, j, k), 0.0f); }
+			}
+		}
+	}
+
+	mActiveRegion = next;
+}
+
+int Smoke::GetActiveRegionMargin(float stepTime)
+{
+	//cells the fastest velocity moves this step, plus room for the interpolation and the velocity growing during the step
+	float cellsMoved = mMaxVelocity * stepTime * mGridWidth;
+	if (!(cellsMoved <= mGridWidth)) { cellsMoved = (float)mGridWidth; }
+
+	return std::max(mMinActiveRegionMargin, (int)ceilf(cellsMoved) + 2);
+}
+
+void Smoke::ExpandActiveRegion(int x, int y, int z)
+{
+	//include the margin around the cell, kept inside the grid boundary
+	int m = mActiveRegionMargin;
+	ActiveRegion cell = { std::max(x - m, 1), std::max(y - m, 1), std::max(z - m, 1),
+		std::min(x + m, mGridWidth), std::min(y + m, mGridWidth), std::min(z + m, mGridWidth) };
+
+	ActiveRegion& r = mActiveRegion;
+	if (IsRegionEmpty(r)) {
+		r = cell;
+		return;
+	}
+
+	r.startX = std::min(r.startX, cell.startX); r.endX = std::max(r.endX, cell.endX);
+	r.startY = std::min(r.startY, cell.startY); r.endY = std::max(r.endY, cell.endY);
+	r.startZ = std::min(r.startZ, cell.startZ); r.endZ = std::max(r.endZ, cell.endZ);
+}
+
+Smoke::ActiveRegion Smoke::WholeGrid(int gridWidth)
+{
+	return { 1, 1, 1, gridWidth, gridWidth, gridWidth };
+}
+
+Smoke::ActiveRegion Smoke::EmptyRegion()
+{
+	return { 1, 1, 1, 0, 0, 0 };
+}
+
+bool Smoke::IsRegionEmpty(const ActiveRegion& region)
+{
+	return region.endX < region.startX || region.endY < region.startY || region.endZ < region.startZ;
+}
+
+Smoke::ActiveRegion Smoke::GetActiveRegion()
+{
+	return mActiveRegion;
+}
+
+void Smoke::ResetActiveRegion()
+{
+	mActiveRegion = WholeGrid(mGridWidth);
+	MarkAllBricksChanged();
+}
+
+void Smoke::MarkChangedRegionBricks(const ActiveRegion& previousRegion)
+{
+	//cover both regions, plus the boundary cells next to them
+	ActiveRegion r = mActiveRegion;
+	if (IsRegionEmpty(r)) { r = previousRegion; }
+	else if (!IsRegionEmpty(previousRegion)) {
+		r.startX = std::min(r.startX, previousRegion.startX); r.endX = std::max(r.endX, previousRegion.endX);
+		r.startY = std::min(r.startY, previousRegion.startY); r.endY = std::max(r.endY, previousRegion.endY);
+		r.startZ = std::min(r.startZ, previousRegion.startZ); r.endZ = std::max(r.endZ, previousRegion.endZ);
+	}
+	if (IsRegionEmpty(r)) { return; }
+
+	const int B = BrickGrid::BrickWidth;
+	int width = mGridWidth + 2, bpa = mChangedBricksPerAxis;
+	int startBi = (r.startX - 1) / B, endBi = std::min(r.endX + 1, width - 1) / B;
+	int startBj = (r.startY - 1) / B, endBj = std::min(r.endY + 1, width - 1) / B;
+	int startBk = (r.startZ - 1) / B, endBk = std::min(r.endZ + 1, width - 1) / B;
+
+	mThreadPool->ParallelFor(startBk, endBk + 1, [&](int bkStart, int bkEnd) {
+		for (int bk = bkStart; bk < bkEnd; bk++) {
+			for (int bj = startBj; bj <= endBj; bj++) {
+				for (int bi = startBi; bi <= endBi; bi++) {
+					//stop at the first cell holding density
+					bool hasDensity = false;
+					for (int k = bk * B; k < std::min(bk * B + B, width) && !hasDensity; k++) {
+						for (int j = bj * B; j < std::min(bj * B + B, width) && !hasDensity; j++) {
+							for (int i = bi * B; i < std::min(bi * B + B, width); i++) {
+								if (mCurrentDensity[INDEX3D(i, j, k)] != 0.0f) { hasDensity = true; break; }
+							}
+						}
+					}
+
+					//an empty brick which was empty last step hasn't changed
+					int b = bi + bpa * bj + bpa * bpa * bk;
+					if (hasDensity || mBrickHadDensity[b]) { mChangedBricks[b] = 1; }
+					mBrickHadDensity[b] = hasDensity;
+				}
+			}
+		}
+	});
+}
+
+void Smoke::MarkChangedCell(int x, int y, int z)
+{
+	const int B = BrickGrid::BrickWidth;
+	int bpa = mChangedBricksPerAxis;
+	if (x < 0 || y < 0 || z < 0 || x / B >= bpa || y / B >= bpa || z / B >= bpa) { return; }
+
+	int b = x / B + bpa * (y / B) + bpa * bpa * (z / B);
+	mChangedBricks[b] = 1;
+	mBrickHadDensity[b] = 1;
+}
+
+void Smoke::MarkAllBricksChanged()
+{
+	std::fill(mChangedBricks.begin(), mChangedBricks.end(), 1);
+	std::fill(mBrickHadDensity.begin(), mBrickHadDensity.end(), 1);
+}
+
+const uint64_t* Smoke::GetChangedBricks()
+{
+	const int B = BrickGrid::BrickWidth;
+	int width = mGridWidth + 2, bpa = mChangedBricksPerAxis;
+
+	//without a saved density every flagged brick is returned, then the whole density is taken as saved
+	if (mSavedDensity.empty()) {
+		mSavedDensity.assign(mCurrentDensity, mCurrentDensity + mTotalCellCount);
+	}
+	else {
+		//only flagged bricks can have changed, keep those which moved further than the writer would notice and
+		//update their saved density to what's about to be written
+		mThreadPool->ParallelFor(0, bpa, [&](int bkStart, int bkEnd) {
+			for (int bk = bkStart; bk < bkEnd; bk++) {
+				for (int bj = 0; bj < bpa; bj++) {
+					for (int bi = 0; bi < bpa; bi++) {
+						int b = bi + bpa * bj + bpa * bpa * bk;
+						if (!mChangedBricks[b]) { continue; }
+
+						bool changed = false;
+						for (int k = bk * B; k < std::min(bk * B + B, width) && !changed; k++) {
+							for (int j = bj * B; j < std::min(bj * B + B, width) && !changed; j++) {
+								for (int i = bi * B; i < std::min(bi * B + B, width); i++) {
+									int index = INDEX3D(i, j, k);
+									if (abs(mCurrentDensity[index] - mSavedDensity[index]) > ReadWriteSmoke::ChangeTolerance) { changed = true; break; }
+								}
+							}
+						}
+						mChangedBricks[b] = changed;
+						if (!changed) { continue; }
+
+						for (int k = bk * B; k < std::min(bk * B + B, width); k++) {
+							for (int j = bj * B; j < std::min(bj * B + B, width); j++) {
+								int row = INDEX3D(bi * B, j, k);
+								std::copy_n(mCurrentDensity + row, std::min(B, width - bi * B), mSavedDensity.begin() + row);
+							}
+						}
+					}
+				}
+			}
+		});
+	}
+
+	std::fill(mChangedBrickMask.begin(), mChangedBrickMask.end(), 0);
+	for (int b = 0; b < (int)mChangedBricks.size(); b++) {
+		if (mChangedBricks[b]) { mChangedBrickMask[b / 64] |= 1ULL << (b % 64); }
+	}
+
+	return mChangedBrickMask.data();
+}
+
+void Smoke::ClearChangedBricks()
+{
+	if (mSavedDensity.empty()) {
+		mSavedDensity.assign(mCurrentDensity, mCurrentDensity + mTotalCellCount);
+	}
+	std::fill(mChangedBricks.begin(), mChangedBricks.end(), 0);
+}
+
+int Smoke::GetActiveBrickCount()
+{
+	return (int)mActiveBricks.size();
+}
+
+BrickGrid* Smoke::GetDensityBricks()
+{
+	return mBrickDensity;
+}
+
+size_t Smoke::GetGridMemoryUsage()
+{
+	size_t gridBytes = mTotalCellCount * sizeof(float);
+
+	//sparse storage only has the dense density copy, plus the bricks
+	if (mStorage == SparseStorage) {
+		BrickGrid* grids[10] = { mBrickDensity, mBrickPrevDensity, mBrickVelU, mBrickVelV, mBrickVelW,
+			mBrickPrevVelU, mBrickPrevVelV, mBrickPrevVelW, mBrickPressure, mBrickDivergence };
+
+		size_t total = gridBytes;
+		for (BrickGrid* grid : grids) { total += grid->GetMemoryUsage(); }
+		return total;
+	}
+
+	//density, velocity, ambient velocity, temp grids and curl planes, plus the reference curl grid once it's used
+	size_t planeBytes = (mGridWidth + 2) * (mGridWidth + 2) * sizeof(float);
+	return (mReferenceCurlZ ? 14 : 13) * gridBytes + mCurlPlaneCount * 4 * planeBytes;
+}
+
+//---- SPARSE STORAGE ----//
+
+void Smoke::UpdateActiveBricks()
+{
+	const int B = BrickGrid::BrickWidth;
+	int bricksPerAxis = mBrickDensity->GetBricksPerAxis();
+	int totalBricks = mBrickDensity->GetTotalBrickCount();
+
+	//box of the cells in each brick holding density or velocity, empty bricks have start > end.
+	//every cell counts when there's ambient wind
+	struct BrickBounds { int startX, startY, startZ, endX, endY, endZ; };
+	BrickBounds full = { 0, 0, 0, B - 1, B - 1, B - 1 }, empty = { B, B, B, -1, -1, -1 };
+	std::vector<BrickBounds> occupied(totalBricks, bAmbientVelocity ? full : empty);
+
+	if (!bAmbientVelocity) {
+		BrickGrid* fields[4] = { mBrickDensity, mBrickVelU, mBrickVelV, mBrickVelW };
+
+		mThreadPool->ParallelFor(0, totalBricks, [&](int brickStart, int brickEnd) {
+			for (int b = brickStart; b < brickEnd; b++) {
+				BrickBounds& bounds = occupied[b];
+
+				for (BrickGrid* field : fields) {
+					float* brick = field->GetBrick(b);
+					if (!brick) { continue; }
+
+					for (int c = 0; c < BrickGrid::BrickCellCount; c++) {
+						if (abs(brick[c]) <= mActiveThreshold) { continue; }
+
+						int x = c % B, y = (c / B) % B, z = c / (B * B);
+						bounds.startX = std::min(bounds.startX, x); bounds.endX = std::max(bounds.endX, x);
+						bounds.startY = std::min(bounds.startY, y); bounds.endY = std::max(bounds.endY, y);
+						bounds.startZ = std::min(bounds.startZ, z); bounds.endZ = std::max(bounds.endZ, z);
+					}
+				}
+			}
+		});
+	}
+
+	//a nearby brick is simulated too when the smoke is within the margin of it, so smoke can move and spread into it.
+	//a margin wider than a brick reaches past the neighbouring bricks
+	int margin = mActiveRegionMargin;
+	int reach = margin / B + 1;
+	auto reachesAxis = [&](int start, int end, int d) {
+		//distance from the smoke to the nearest cell of the brick d bricks along
+		if (d < 0) { return start - (d * B + B - 1) <= margin; }
+		if (d > 0) { return d * B - end <= margin; }
+		return true;
+	};
+	auto reaches = [&](const BrickBounds& bounds, int dx, int dy, int dz) {
+		if (bounds.endX < bounds.startX) { return false; }
+		return reachesAxis(bounds.startX, bounds.endX, dx) && reachesAxis(bounds.startY, bounds.endY, dy) &&
+			reachesAxis(bounds.startZ, bounds.endZ, dz);
+	};
+
+	BrickGrid* grids[10] = { mBrickDensity, mBrickPrevDensity, mBrickVelU, mBrickVelV, mBrickVelW,
+		mBrickPrevVelU, mBrickPrevVelV, mBrickPrevVelW, mBrickPressure, mBrickDivergence };
+	mActiveBricks.clear();
+
+	for (int b = 0; b < totalBricks; b++) {
+		int bi, bj, bk;
+		mBrickDensity->GetBrickCoords(b, bi, bj, bk);
+
+		//check each brick within reach, including this brick, for smoke reaching towards this brick
+		bool active = false;
+		for (int z = std::max(bk - reach, 0); z <= std::min(bk + reach, bricksPerAxis - 1) && !active; z++) {
+			for (int y = std::max(bj - reach, 0); y <= std::min(bj + reach, bricksPerAxis - 1) && !active; y++) {
+				for (int x = std::max(bi - reach, 0); x <= std::min(bi + reach, bricksPerAxis - 1) && !active; x++) {
+					active = reaches(occupied[x + bricksPerAxis * y + bricksPerAxis * bricksPerAxis * z], bi - x, bj - y, bk - z);
+				}
+			}
+		}
+
+		if (active) {
+			for (BrickGrid* grid : grids) { grid->Touch(b); }
+			mActiveBricks.push_back(b);
+		}
+		else {
+			//anything left is below the threshold, free it and clear its density from the dense copy
+			bool hadDensity = mBrickDensity->GetBrick(b) != nullptr;
+			for (BrickGrid* grid : grids) { grid->Free(b); }
+			if (hadDensity) {
+				mBrickDensity->CopyBrickToDense(b, mCurrentDensity);
+				mChangedBricks[b] = 1;
+			}
+		}
+	}
+}
+
+void Smoke::SparseDensityStep(float dt)
+{
+	//diffusion: spread density to surrounding cells
+	if (bDiffuse) {
+		std::swap(mBrickDensity, mBrickPrevDensity);
+		SparseDiffuse(0, mBrickDensity, mBrickPrevDensity, mDiffuseRate, dt);
+	}
+
+	//advection: move density along velocity field, unless already done in the velocity step
+	if (bAdvect && !(bFuseDensityAdvection && bVelocityStep)) {
+		std::swap(mBrickDensity, mBrickPrevDensity);
+		int boundary = 0;
+		SparseAdvect(&mBrickDensity, &mBrickPrevDensity, &boundary, 1, mBrickVelU, mBrickVelV, mBrickVelW, dt);
+	}
+}
+
+void Smoke::SparseVelocityStep(float dt)
+{
+	//forces are written into the previous grids, then swapped to be current
+	SparseForces(dt);
+	std::swap(mBrickVelU, mBrickPrevVelU); std::swap(mBrickVelV, mBrickPrevVelV); std::swap(mBrickVelW, mBrickPrevVelW);
+
+	//diffusion: spread out the velocity throughout the grid
+	if (bDiffuse) {
+		std::swap(mBrickVelU, mBrickPrevVelU); std::swap(mBrickVelV, mBrickPrevVelV); std::swap(mBrickVelW, mBrickPrevVelW);
+
+		SparseDiffuse(1, mBrickVelU, mBrickPrevVelU, mViscosity, dt);
+		SparseDiffuse(2, mBrickVelV, mBrickPrevVelV, mViscosity, dt);
+		SparseDiffuse(3, mBrickVelW, mBrickPrevVelW, mViscosity, dt);
+
+		SparseProject();
+	}
+
+	//advection: move the velocity grids along itself 
+	if (bAdvect) {
+		std::swap(mBrickVelU, mBrickPrevVelU); std::swap(mBrickVelV, mBrickPrevVelV); std::swap(mBrickVelW, mBrickPrevVelW);
+
+		BrickGrid* current[4] = { mBrickVelU, mBrickVelV, mBrickVelW, mBrickDensity };
+		BrickGrid* previous[4] = { mBrickPrevVelU, mBrickPrevVelV, mBrickPrevVelW, mBrickPrevDensity };
+		int boundaries[4] = { 1, 2, 3, 0 };
+
+		//density is advected in the same pass when fused
+		bool fuseDensity = bFuseDensityAdvection && bDensityStep;
+		if (fuseDensity) {
+			std::swap(mBrickDensity, mBrickPrevDensity);
+			current[3] = mBrickDensity; previous[3] = mBrickPrevDensity;
+		}
+
+		SparseAdvect(current, previous, boundaries, fuseDensity ? 4 : 3, mBrickPrevVelU, mBrickPrevVelV, mBrickPrevVelW, dt);
+
+		SparseProject();
+	}
+}
+
+void Smoke::SparseForces(float dt)
+{
+	const int B = BrickGrid::BrickWidth;
+	const int H = 2, W = B + 2 * H;
+	int N = mGridWidth;
+
+	//curl coeficient 
+	float dt0 = dt * mVorticityCoef;
+	float ambientScale = 1.0f / (1.0f + dt);
+	float buoyancy = buoyancyCoef * dt;
+
+	mThreadPool->ParallelFor(0, (int)mActiveBricks.size(), [&](int activeStart, int activeEnd) {
+		//brick and halo of velocity with the pointwise forces added, then the curl of the brick and 1 cell around it
+		std::vector<float> u(W * W * W), v(W * W * W), w(W * W * W), density(W * W * W);
+		std::vector<float> curlX(W * W * W), curlY(W * W * W), curlZ(W * W * W), curl(W * W * W);
+		auto local = [&](int x, int y, int z) { return x + W * y + W * W * z; };
+
+		for (int a = activeStart; a < activeEnd; a++) {
+			int b = mActiveBricks[a];
+			int bi, bj, bk;
+			mBrickDensity->GetBrickCoords(b, bi, bj, bk);
+			int ox = bi * B - H, oy = bj * B - H, oz = bk * B - H;
+
+			mBrickVelU->GatherHalo(b, H, u.data()); mBrickVelV->GatherHalo(b, H, v.data());
+			mBrickVelW->GatherHalo(b, H, w.data()); mBrickDensity->GatherHalo(b, H, density.data());
+
+			//ambient velocity and buoyancy, over every cell in the grid including the boundary
+			for (int z = 0; z < W; z++) {
+				for (int y = 0; y < W; y++) {
+					for (int x = 0; x < W; x++) {
+						int i = ox + x, j = oy + y, k = oz + z, l = local(x, y, z);
+						bool inGrid = i >= 0 && j >= 0 && k >= 0 && i <= N + 1 && j <= N + 1 && k <= N + 1;
+						if (!inGrid) { u[l] = v[l] = w[l] = 0; continue; }
+
+						u[l] = (u[l] + dt * mAmbientU) * ambientScale;
+						v[l] = (v[l] + dt * mAmbientV) * ambientScale + density[l] * buoyancy;
+						w[l] = (w[l] + dt * mAmbientW) * ambientScale;
+					}
+				}
+			}
+
+			//calculate curl in each direction, only inside the grid boundary
+			for (int z = 1; z < W - 1; z++) {
+				for (int y = 1; y < W - 1; y++) {
+					for (int x = 1; x < W - 1; x++) {
+						int i = ox + x, j = oy + y, k = oz + z, l = local(x, y, z);
+						if (i < 1 || j < 1 || k < 1 || i > N || j > N || k > N) {
+							curlX[l] = curlY[l] = curlZ[l] = curl[l] = 0;
+							continue;
+						}
+
+						// curlx = dw/dy - dv/dz
+						float cx = curlX[l] = (w[l + W] - w[l - W]) * 0.5f - (v[l + W * W] - v[l - W * W]) * 0.5f;
+						// curly = du/dz - dw/dx
+						float cy = curlY[l] = (u[l + W * W] - u[l - W * W]) * 0.5f - (w[l + 1] - w[l - 1]) * 0.5f;
+						// curlz = dv/dx - du/dy
+						float cz = curlZ[l] = (v[l + 1] - v[l - 1]) * 0.5f - (u[l + W] - u[l - W]) * 0.5f;
+						// curl = |curl|
+						curl[l] = sqrtf(cx * cx + cy * cy + cz * cz);
+					}
+				}
+			}
+
+			//add curl to the velocity inside the boundary, and write the brick out
+			float* outU = mBrickPrevVelU->GetBrick(b), * outV = mBrickPrevVelV->GetBrick(b), * outW = mBrickPrevVelW->GetBrick(b);
+			for (int z = 0; z < B; z++) {
+				for (int y = 0; y < B; y++) {
+					for (int x = 0; x < B; x++) {
+						int i = ox + H + x, j = oy + H + y, k = oz + H + z;
+						int l = local(x + H, y + H, z + H), c = x + B * y + B * B * z;
+						outU[c] = u[l]; outV[c] = v[l]; outW[c] = w[l];
+						if (i < 1 || j < 1 || k < 1 || i > N || j > N || k > N) { continue; }
+
+						//confine magnitude of curls 
+						float Nx = (curl[l + 1] - curl[l - 1]) * 0.5f;
+						float Ny = (curl[l + W] - curl[l - W]) * 0.5f;
+						float Nz = (curl[l + W * W] - curl[l - W * W]) * 0.5f;
+						float len1 = 1.0f / (sqrtf(Nx * Nx + Ny * Ny + Nz * Nz) + 0.0000001f);
+						Nx *= len1;
+						Ny *= len1;
+						Nz *= len1;
+
+						outU[c] += (Ny * curlZ[l] - Nz * curlY[l]) * dt0;
+						outV[c] += (Nz * curlX[l] - Nx * curlZ[l]) * dt0;
+						outW[c] += (Nx * curlY[l] - Ny * curlX[l]) * dt0;
+					}
+				}
+			}
+		}
+	});
+}
+
+void Smoke::SparseDiffuse(int boundaryCondition, BrickGrid* current, BrickGrid* previous, float rate, float dt)
+{
+	//eqaution constant to determine rate of diffusion including grid size and time passed
+	float a = dt * rate * mGridWidth * mGridWidth * mGridWidth;
+
+	SparseRelax(boundaryCondition, current, previous, a, 1 + 6 * a);
+}
+
+void Smoke::SparseAdvect(BrickGrid** current, BrickGrid** previous, int* boundaryConditions, int fieldCount,
+	BrickGrid* u, BrickGrid* v, BrickGrid* w, float dt)
+{
+	const int B = BrickGrid::BrickWidth;
+	int N = mGridWidth;
+	float dt0 = dt * mGridWidth;
+
+	//fastest velocity is found while the bricks are advected, for picking the next time step
+	float maxVelocity = 0;
+	std::mutex maxMutex;
+
+	mThreadPool->ParallelFor(0, (int)mActiveBricks.size(), [&](int activeStart, int activeEnd) {
+		float chunkMax = 0;
+		for (int a = activeStart; a < activeEnd; a++) {
+			int b = mActiveBricks[a];
+			int bi, bj, bk;
+			u->GetBrickCoords(b, bi, bj, bk);
+			float* brickU = u->GetBrick(b), * brickV = v->GetBrick(b), * brickW = w->GetBrick(b);
+
+			for (int z = 0; z < B; z++) {
+				for (int y = 0; y < B; y++) {
+					for (int x = 0; x < B; x++) {
+						int i = bi * B + x, j = bj * B + y, k = bk * B + z, c = x + B * y + B * B * z;
+						if (i < 1 || j < 1 || k < 1 || i > N || j > N || k > N) { continue; }
+
+						chunkMax = std::max(chunkMax, std::max(std::abs(brickU[c]), std::max(std::abs(brickV[c]), std::abs(brickW[c]))));
+
+						//calculate predicted movement from backtracing velcoity
+						float px = i - dt0 * brickU[c];
+						float py = j - dt0 * brickV[c];
+						float pz = k - dt0 * brickW[c];
+
+						//make sure all coords are in bounds
+						if (px < 0.5f) { px = 0.5f; } if (px > N + 0.5f) { px = N + 0.5f; }
+						if (py < 0.5f) { py = 0.5f; } if (py > N + 0.5f) { py = N + 0.5f; }
+						if (pz < 0.5f) { pz = 0.5f; } if (pz > N + 0.5f) { pz = N + 0.5f; }
+						int i0 = (int)px, j0 = (int)py, k0 = (int)pz;
+						int i1 = i0 + 1, j1 = j0 + 1, k1 = k0 + 1;
+
+						float s1 = px - i0, s0 = 1 - s1;
+						float t1 = py - j0, t0 = 1 - t1;
+						float u1 = pz - k0, u0 = 1 - u1;
+
+						//when all 8 samples are in one brick, read them straight from it
+						int sampleBrick = u->GetBrickIndex(i0, j0, k0);
+						if (sampleBrick == u->GetBrickIndex(i1, j1, k1)) {
+							int c0 = (i0 & 7) + B * (j0 & 7) + B * B * (k0 & 7);
+							for (int f = 0; f < fieldCount; f++) {
+								float* p = previous[f]->GetBrick(sampleBrick);
+								if (!p) { current[f]->GetBrick(b)[c] = 0; continue; }
+								current[f]->GetBrick(b)[c] = s0 * (
+									t0 * u0 * p[c0] + t1 * u0 * p[c0 + B]
+									+ t0 * u1 * p[c0 + B * B] + t1 * u1 * p[c0 + B + B * B]) +
+									s1 * (t0 * u0 * p[c0 + 1] + t1 * u0 * p[c0 + 1 + B] +
+										t0 * u1 * p[c0 + 1 + B * B] + t1 * u1 * p[c0 + 1 + B + B * B]);
+							}
+							continue;
+						}
+
+						//update each grid with the movement 
+						for (int f = 0; f < fieldCount; f++) {
+							BrickGrid* p = previous[f];
+							current[f]->GetBrick(b)[c] = s0 * (
+								t0 * u0 * p->Get(i0, j0, k0) + t1 * u0 * p->Get(i0, j1, k0)
+								+ t0 * u1 * p->Get(i0, j0, k1) + t1 * u1 * p->Get(i0, j1, k1)) +
+								s1 * (t0 * u0 * p->Get(i1, j0, k0) + t1 * u0 * p->Get(i1, j1, k0) +
+									t0 * u1 * p->Get(i1, j0, k1) + t1 * u1 * p->Get(i1, j1, k1));
+						}
+					}
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(maxMutex);
+		if (chunkMax > maxVelocity) { maxVelocity = chunkMax; }
+	});
+	mMaxVelocity = maxVelocity;
+
+	//manage grid boundaries
+	for (int f = 0; f < fieldCount; f++) { SparseSetBoundary(boundaryConditions[f], current[f]); }
+}
+
+void Smoke::SparseProject()
+{
+	const int B = BrickGrid::BrickWidth;
+	int N = mGridWidth;
+	float h = 1.0f / mGridWidth;
+	BrickGrid* p = mBrickPressure, * div = mBrickDivergence;
+
+	//each brick's velocity or pressure with a 1 cell halo
+	const int W = B + 2;
+	auto local = [&](int x, int y, int z) { return (x + 1) + W * (y + 1) + W * W * (z + 1); };
+
+	//calculate values for div, and start pressure at 0
+	mThreadPool->ParallelFor(0, (int)mActiveBricks.size(), [&](int activeStart, int activeEnd) {
+		std::vector<float> u(W * W * W), v(W * W * W), w(W * W * W);
+
+		for (int a = activeStart; a < activeEnd; a++) {
+			int b = mActiveBricks[a];
+			int bi, bj, bk;
+			div->GetBrickCoords(b, bi, bj, bk);
+			float* brickDiv = div->GetBrick(b);
+			std::fill_n(p->GetBrick(b), BrickGrid::BrickCellCount, 0.0f);
+			mBrickVelU->GatherHalo(b, 1, u.data()); mBrickVelV->GatherHalo(b, 1, v.data()); mBrickVelW->GatherHalo(b, 1, w.data());
+
+			for (int z = 0; z < B; z++) {
+				for (int y = 0; y < B; y++) {
+					for (int x = 0; x < B; x++) {
+						int i = bi * B + x, j = bj * B + y, k = bk * B + z;
+						if (i < 1 || j < 1 || k < 1 || i > N || j > N || k > N) { continue; }
+
+						int l = local(x, y, z);
+						brickDiv[x + B * y + B * B * z] = -h * (
+							u[l + 1] - u[l - 1] +
+							v[l + W] - v[l - W] +
+							w[l + W * W] - w[l - W * W]) / 3;
+					}
+				}
+			}
+		}
+	});
+	SparseSetBoundary(0, div); SparseSetBoundary(0, p);
+
+	SparseRelax(0, p, div, 1, 6);
+
+	//intergrate into velocity field 
+	mThreadPool->ParallelFor(0, (int)mActiveBricks.size(), [&](int activeStart, int activeEnd) {
+		std::vector<float> pressure(W * W * W);
+
+		for (int a = activeStart; a < activeEnd; a++) {
+			int b = mActiveBricks[a];
+			int bi, bj, bk;
+			p->GetBrickCoords(b, bi, bj, bk);
+			float* brickU = mBrickVelU->GetBrick(b), * brickV = mBrickVelV->GetBrick(b), * brickW = mBrickVelW->GetBrick(b);
+			p->GatherHalo(b, 1, pressure.data());
+
+			for (int z = 0; z < B; z++) {
+				for (int y = 0; y < B; y++) {
+					for (int x = 0; x < B; x++) {
+						int i = bi * B + x, j = bj * B + y, k = bk * B + z, c = x + B * y + B * B * z;
+						if (i < 1 || j < 1 || k < 1 || i > N || j > N || k > N) { continue; }
+
+						int l = local(x, y, z);
+						brickU[c] -= (pressure[l + 1] - pressure[l - 1]) / 3 / h;
+						brickV[c] -= (pressure[l + W] - pressure[l - W]) / 3 / h;
+						brickW[c] -= (pressure[l + W * W] - pressure[l - W * W]) / 3 / h;
+					}
+				}
+			}
+		}
+	});
+
+	SparseSetBoundary(1, mBrickVelU); SparseSetBoundary(2, mBrickVelV);
+}
+
+void Smoke::RequireDenseStorage(const char* kernel)
+{
+	if (mStorage == SparseStorage) {
+		throw std::logic_error(std::string(kernel) + " needs dense storage, use Update, DensityStep or VelocityStep with sparse storage");
+	}
+}
+
+void Smoke::RequireSparseSolvers()
+{
+	if (diffusionSolver != RedBlackGaussSeidel || pressureSolver != RedBlackGaussSeidel) {
+		throw std::logic_error("Sparse storage only solves with red-black gauss-seidel");
+	}
+}
+
+void Smoke::SparseRelax(int boundaryCondition, BrickGrid* x, BrickGrid* x0, float a, float c)
+{
+	const int B = BrickGrid::BrickWidth;
+	int N = mGridWidth;
+	float cRecip = 1.0f / c;
+
+	for (int l = 0; l < mLinearSolveTimes; l++)
+	{
+		//relax the red cells, (i + j + k) even, then the black cells. only the other colour is read, 
+		//so bricks can be relaxed in any order across threads
+		for (int colour = 0; colour < 2; colour++)
+		{
+			mThreadPool->ParallelFor(0, (int)mActiveBricks.size(), [&](int activeStart, int activeEnd) {
+				for (int n = activeStart; n < activeEnd; n++) {
+					int b = mActiveBricks[n];
+					int bi, bj, bk;
+					x->GetBrickCoords(b, bi, bj, bk);
+					float* brick = x->GetBrick(b), * rhs = x0->GetBrick(b);
+
+					//bricks either side on each axis, for cells on the brick's faces
+					int perAxis = x->GetBricksPerAxis();
+					float* left = bi > 0 ? x->GetBrick(b - 1) : nullptr;
+					float* right = bi < perAxis - 1 ? x->GetBrick(b + 1) : nullptr;
+					float* down = bj > 0 ? x->GetBrick(b - perAxis) : nullptr;
+					float* up = bj < perAxis - 1 ? x->GetBrick(b + perAxis) : nullptr;
+					float* back = bk > 0 ? x->GetBrick(b - perAxis * perAxis) : nullptr;
+					float* front = bk < perAxis - 1 ? x->GetBrick(b + perAxis * perAxis) : nullptr;
+					auto face = [](float* brick, int cell) { return brick ? brick[cell] : 0.0f; };
+
+					for (int z = 0; z < B; z++) {
+						for (int y = 0; y < B; y++) {
+							int j = bj * B + y, k = bk * B + z;
+							if (j < 1 || k < 1 || j > N || k > N) { continue; }
+
+							//first cell in this row with the current colour
+							for (int xb = (bi * B + j + k + colour) & 1; xb < B; xb += 2) {
+								int i = bi * B + xb, cell = xb + B * y + B * B * z;
+								if (i < 1 || i > N) { continue; }
+
+								//neighbours past the brick's faces come from the next brick along
+								float neighbours =
+									(xb > 0 ? brick[cell - 1] : face(left, cell + B - 1)) +
+									(xb < B - 1 ? brick[cell + 1] : face(right, cell - (B - 1))) +
+									(y > 0 ? brick[cell - B] : face(down, cell + B * (B - 1))) +
+									(y < B - 1 ? brick[cell + B] : face(up, cell - B * (B - 1))) +
+									(z > 0 ? brick[cell - B * B] : face(back, cell + B * B * (B - 1))) +
+									(z < B - 1 ? brick[cell + B * B] : face(front, cell - B * B * (B - 1)));
+
+								brick[cell] = (rhs[cell] + a * neighbours) * cRecip;
+							}
+						}
+					}
+				}
+			});
+		}
+		//manage grid boundary
+		SparseSetBoundary(boundaryCondition, x);
+	}
+}
+
+void Smoke::SparseSetBoundary(int boundaryCondition, BrickGrid* grid)
+{
+	const int B = BrickGrid::BrickWidth;
+	int N = mGridWidth, b = boundaryCondition;
+
+	//only bricks on the edge of the grid hold boundary cells
+	mThreadPool->ParallelFor(0, (int)mActiveBricks.size(), [&](int activeStart, int activeEnd) {
+		for (int a = activeStart; a < activeEnd; a++) {
+			int brickIndex = mActiveBricks[a];
+			int bi, bj, bk;
+			grid->GetBrickCoords(brickIndex, bi, bj, bk);
+			int lastBrick = (N + 1) / B;
+			if (bi != 0 && bj != 0 && bk != 0 && bi != lastBrick && bj != lastBrick && bk != lastBrick) { continue; }
+
+			float* brick = grid->GetBrick(brickIndex);
+			for (int z = 0; z < B; z++) {
+				for (int y = 0; y < B; y++) {
+					for (int x = 0; x < B; x++) {
+						int i = bi * B + x, j = bj * B + y, k = bk * B + z, c = x + B * y + B * B * z;
+						bool insideI = i >= 1 && i <= N, insideJ = j >= 1 && j <= N, insideK = k >= 1 && k <= N;
+
+						//set the boundary faces, the edges are left as they are like SetBoundary
+						if ((i == 0 || i == N + 1) && insideJ && insideK) {
+							float inner = grid->Get(i == 0 ? 1 : N, j, k);
+							brick[c] = (b == 1) ? -inner : inner;
+						}
+						else if ((j == 0 || j == N + 1) && insideI && insideK) {
+							float inner = grid->Get(i, j == 0 ? 1 : N, k);
+							brick[c] = (b == 2) ? -inner : inner;
+						}
+						else if ((k == 0 || k == N + 1) && insideI && insideJ) {
+							float inner = grid->Get(i, j, k == 0 ? 1 : N);
+							brick[c] = (b == 3) ? -inner : inner;
+						}
+					}
+				}
+			}
+		}
+	});
+
+	//set corners, the average of the 3 edge cells next to them
+	for (int corner = 0; corner < 8; corner++) {
+		int i = (corner & 1) ? N + 1 : 0, j = (corner & 2) ? N + 1 : 0, k = (corner & 4) ? N + 1 : 0;
+		int inI = (i == 0) ? 1 : N, inJ = (j == 0) ? 1 : N, inK = (k == 0) ? 1 : N;
+
+		float* brick = grid->GetBrick(grid->GetBrickIndex(i, j, k));
+		if (!brick) { continue; }
+		brick[(i & (B - 1)) + B * (j & (B - 1)) + B * B * (k & (B - 1))] = (grid->Get(inI, j, k) + grid->Get(i, inJ, k) + grid->Get(i, j, inK)) / 3;
+	}
+}
+
+void Smoke::UpdateDensityMirror()
+{
+	const int B = BrickGrid::BrickWidth;
+	int width = mGridWidth + 2;
+
+	mThreadPool->ParallelFor(0, (int)mActiveBricks.size(), [&](int activeStart, int activeEnd) {
+		for (int a = activeStart; a < activeEnd; a++) {
+			int b = mActiveBricks[a], bi, bj, bk;
+			mBrickDensity->GetBrickCoords(b, bi, bj, bk);
+			const float* brick = mBrickDensity->GetBrick(b);
+
+			//compare each row with the dense copy as it's copied over, flagging the brick if it changed
+			bool changed = false;
+			int iStart = bi * B, rowLength = std::min(iStart + B, width) - iStart;
+			for (int z = 0; z < B && bk * B + z < width; z++) {
+				for (int y = 0; y < B && bj * B + y < width; y++) {
+					float* row = mCurrentDensity + INDEX3D(iStart, bj * B + y, bk * B + z);
+					const float* brickRow = brick + B * y + B * B * z;
+
+					for (int x = 0; x < rowLength && !changed; x++) {
+						changed = std::abs(brickRow[x] - row[x]) > 0.000001f;
+					}
+					std::copy_n(brickRow, rowLength, row);
+				}
+			}
+
+			if (changed) { mChangedBricks[b] = 1; }
+		}
+	});
+}
+
+float Smoke::GetTotalDensity()
+{
+	return GetGridTotal(mCurrentDensity);
+}
+
+float Smoke::GetGridTotal(float* grid)
+{
+	//keep acculmative total
+	float total = 0;
+
+	//loop over whole grid adding to the total
+	for (size_t i = 0; i < mTotalCellCount; i++) { total += grid[i]; }
+
+	return total;
+}
+
+int Smoke::GetSavedSimTotalFrames()
+{
+	return mReadSimTotalFrames;
+}
+
+float Smoke::GetLastSolverResidual()
+{
+	return mLastSolverResidual;
+}
+
+int Smoke::GetLastSolverIterations()
+{
+	return mLastSolverIterations;
+}
+
+int Smoke::GetLastSubStepCount()
+{
+	return mLastSubStepCount;
+}
+
+bool Smoke::GetLastSubStepsCapped()
+{
+	return bLastSubStepsCapped;
+}
+
+float Smoke::GetMaxVelocity()
+{
+	return mMaxVelocity;
+}
+
+void Smoke::ClearDensity()
+{
+	MarkAllBricksChanged();
+
+	if (mStorage == SparseStorage) {
+		mBrickDensity->Clear(); mBrickPrevDensity->Clear();
+		std::fill_n(mCurrentDensity, mTotalCellCount, 0.0f);
+		return;
+	}
+
+	//loop over all cells clearing thier denisty
+	for (size_t i = 0; i < mTotalCellCount; i++)
+	{
+		mCurrentDensity[i] = 0.0f;
+		mPrevDensity[i] = 0.0f;
+	}
+}
 
 void Smoke::ClearVelocity()
 {
+	mMaxVelocity = 0;
+
+	if (mStorage == SparseStorage) {
+		mBrickVelU->Clear(); mBrickVelV->Clear(); mBrickVelW->Clear();
+		mBrickPrevVelU->Clear(); mBrickPrevVelV->Clear(); mBrickPrevVelW->Clear();
+		mAmbientU = mAmbientV = mAmbientW = 0;
+		bAmbientVelocity = false;
+		return;
+	}
+
 	for (size_t i = 0; i < mTotalCellCount; i++)
 	{
 		//current velocities
@@ -501,10 +2514,23 @@ void Smoke::ClearVelocity()
 		mAmbientVelV[i] = 0.0f;
 		mAmbientVelW[i] = 0.0f;
 	}
+
+	bAmbientVelocity = false;
 }
 
 void Smoke::SetAmbientVelocity(float uVelSpeed, float vVelSpeed, float wVelSpeed)
 {
+	//ambient wind moves every cell, so the whole grid has to be simulated
+	bAmbientVelocity = uVelSpeed != 0 || vVelSpeed != 0 || wVelSpeed != 0;
+
+	//the grid heads towards the ambient velocity, so the next update is sub-stepped for it straight away
+	mMaxVelocity = std::max(mMaxVelocity, std::max(std::abs(uVelSpeed), std::max(std::abs(vVelSpeed), std::abs(wVelSpeed))));
+
+	if (mStorage == SparseStorage) {
+		mAmbientU = uVelSpeed; mAmbientV = vVelSpeed; mAmbientW = wVelSpeed;
+		return;
+	}
+
 	//set the ambient velocity grids with given values
 	std::fill_n(mAmbientVelU, mTotalCellCount, uVelSpeed);
 	std::fill_n(mAmbientVelV, mTotalCellCount, vVelSpeed);
@@ -513,6 +2539,23 @@ void Smoke::SetAmbientVelocity(float uVelSpeed, float vVelSpeed, float wVelSpeed
 
 void Smoke::SetVelocity(float uVelSpeed, float vVelSpeed, float wVelSpeed)
 {
+	mMaxVelocity = std::max(std::abs(uVelSpeed), std::max(std::abs(vVelSpeed), std::abs(wVelSpeed)));
+
+	if (mStorage == SparseStorage) {
+		BrickGrid* grids[6] = { mBrickVelU, mBrickVelV, mBrickVelW, mBrickPrevVelU, mBrickPrevVelV, mBrickPrevVelW };
+		float speeds[6] = { uVelSpeed, vVelSpeed, wVelSpeed, uVelSpeed, vVelSpeed, wVelSpeed };
+
+		//a zero velocity needs no bricks, anything else fills the whole grid
+		for (int g = 0; g < 6; g++) {
+			grids[g]->Clear();
+			if (speeds[g] == 0) { continue; }
+			for (int b = 0; b < grids[g]->GetTotalBrickCount(); b++) {
+				std::fill_n(grids[g]->Touch(b), BrickGrid::BrickCellCount, speeds[g]);
+			}
+		}
+		return;
+	}
+
 	//set the all current velocity fields
 	std::fill_n(mCurVelU, mTotalCellCount, uVelSpeed);
 	std::fill_n(mCurVelV, mTotalCellCount, vVelSpeed);
@@ -521,6 +2564,8 @@ void Smoke::SetVelocity(float uVelSpeed, float vVelSpeed, float wVelSpeed)
 	std::fill_n(mPrevVelU, mTotalCellCount, uVelSpeed);
 	std::fill_n(mPrevVelV, mTotalCellCount, vVelSpeed);
 	std::fill_n(mPrevVelW, mTotalCellCount, wVelSpeed);
+
+	if (uVelSpeed != 0 || vVelSpeed != 0 || wVelSpeed != 0) { ResetActiveRegion(); }
 }
 
 void Smoke::AddDensity(float* input)
@@ -530,6 +2575,20 @@ void Smoke::AddDensity(float* input)
 	{
 		mCurrentDensity[i] += input[i];
 	}
+
+	if (mStorage == SparseStorage) {
+		//only allocate bricks where density was added
+		for (int k = 0; k < mGridWidth + 2; k++) {
+			for (int j = 0; j < mGridWidth + 2; j++) {
+				for (int i = 0; i < mGridWidth + 2; i++) {
+					float added = input[INDEX3D(i, j, k)];
+					if (added != 0.0f) { mBrickDensity->Set(i, j, k, mBrickDensity->Get(i, j, k) + added); }
+				}
+			}
+		}
+	}
+
+	ResetActiveRegion();
 }
 
 void Smoke::AddDensity(int x, int y, int z, float density)
@@ -540,6 +2599,13 @@ void Smoke::AddDensity(int x, int y, int z, float density)
 	}
 	//set density at postion 
 	mCurrentDensity[INDEX3D(x, y, z)] += density;
+	MarkChangedCell(x, y, z);
+
+	if (mStorage == SparseStorage && x >= 0 && y >= 0 && z >= 0 && x <= mGridWidth + 1 && y <= mGridWidth + 1 && z <= mGridWidth + 1) {
+		mBrickDensity->Set(x, y, z, mBrickDensity->Get(x, y, z) + density);
+	}
+
+	ExpandActiveRegion(x, y, z);
 }
 
 void Smoke::AddDensity(int x, int y, int z, float density, int radius)
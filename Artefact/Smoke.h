@@ -1,16 +1,42 @@
 #pragma once
 #include "ReadWriteSmoke.h"
+#include "FramePrefetcher.hpp"
+#include "PipelinedWriter.hpp"
+#include "ThreadPool.hpp"
+#include "BrickGrid.hpp"
 #include <random>
 
+//macro to convert 3d coords to id array index, for a grid of the given width without its boundary
+#define INDEX3DW(i,j,k,w) ((i)+((w)+2)*(j) + ((w)+2)*((w)+2)*(k))
 //macro to convert 3d coords to id array index
-#define INDEX3D(i,j,k) ((i)+(mGridWidth+2)*(j) + (mGridWidth+2)*(mGridWidth+2)*(k))
+#define INDEX3D(i,j,k) INDEX3DW(i,j,k,mGridWidth)
 //macro to swap two pointers 
 #define SWAPPOINTER(p1,p2) {float * tmp=p1; p1=p2; p2=tmp;}
 
 class Smoke
 {
 public:
-	Smoke(int resolution);
+	//methods of solving the diffusion and pressure linear systems
+	enum LinearSolver { GaussSeidel, RedBlackGaussSeidel, Multigrid, ConjugateGradient };
+	//preconditioners for the conjugate gradient solver
+	enum Preconditioner { JacobiPreconditioner, IncompleteCholesky };
+	//instruction sets the advection kernel can use, the best supported one is picked at start up
+	enum AdvectionKernel { ScalarKernel, Avx2Kernel, Avx512Kernel };
+
+	//a grid moved by advection, read from previous and written to current
+	struct AdvectedField { float* current; float* previous; };
+
+	//box of cells the kernels work on, inclusive and inside the grid boundary
+	struct ActiveRegion { int startX, startY, startZ, endX, endY, endZ; };
+
+	//how the simulation grids are stored. sparse storage only allocates 8x8x8 bricks around the smoke and 
+	//keeps a dense copy of the density for rendering and saving. Update, DensityStep, VelocityStep, Project and 
+	//AddForces work with either, the other kernel functions below need the dense grids and throw std::logic_error
+	//with sparse storage. sparse storage always solves with red-black gauss-seidel, so stepping it with any
+	//other diffusion or pressure solver throws std::logic_error too
+	enum GridStorage { DenseStorage, SparseStorage };
+
+	Smoke(int resolution, GridStorage storage = DenseStorage);
 	~Smoke();
 
 	//---- READ / WRITE SIMULATION ----//
@@ -22,15 +48,18 @@ public:
 	void CreateAndSaveSimulation(std::string fileName, int frames);
 
 	/// <summary>
-	/// returns a new smoke obj loaded with the saved simulation  
+	/// returns a new smoke obj loaded with the saved simulation, to only play it back use SmokePlayback
+	/// which doesn't allocate the solver's grids
 	/// </summary>
 	/// <param name="gridSize"> - out set to the size of the simulation </param>
 	/// <param name="totalFrames"> - out set to the total number of frames</param>
+	/// <param name="prefetchFrames"> - frames decoded ahead on their own thread, 0 decodes each frame when it's read </param>
 	/// <returns> smoke obj containing saved simulation </returns>
-	static Smoke* OpenSavedSimulation(std::string fileName, int& gridSize);
+	static Smoke* OpenSavedSimulation(std::string fileName, int& gridSize, int prefetchFrames = 0);
 
 	/// <summary>
-	/// reads the nexts frame's density of the currently opened saved simulation
+	/// reads the nexts frame's density of the currently opened saved simulation, when prefetching this takes
+	/// the next decoded frame, or keeps the current one if it isn't ready yet
 	/// </summary>
 	void ReadNextSimulationFrame();
 
@@ -74,17 +103,31 @@ public:
 	/// <param name="dt"> - delta time </param>
 	void Advect(int boundaryCondition, float* current, float* previous, float* velU, float* velV, float* velW, float dt);
 
+	/// <summary>
+	/// advects all three velocity grids along the previous velocity in a single pass, calculating the
+	/// backtrace and weights once per cell. also advects density when fusing density advection
+	/// </summary>
+	void AdvectVelocity(float dt);
+
 	/// <summary>
 	/// projects the velocities, enforcing it to be incompressible fluid 
 	/// </summary>
 	void Project();
 
 	/// <summary>
-	/// adds natural curls to the velocity field
+	/// adds natural curls to the velocity field. computes the whole curl grids then confines them in
+	/// a second pass. a reference for testing AddForces' fused sweep, which the simulation uses instead.
+	/// the curl grids reuse the temp buffers plus one grid allocated on the first call
 	/// </summary>
 	/// <param name="dt"></param>
 	void VorticityConfinement(float dt);
 
+	/// <summary>
+	/// adds the ambient velocity, buoyancy and vorticity confinement in a single sweep over the grid, 
+	/// same as calling AddSource for each velocity grid, AddBuoyancy then VorticityConfinement
+	/// </summary>
+	void AddForces(float dt);
+
 	/// <summary>
 	/// swaps the current vel pointers to point at the prev vel grid
 	/// </summary>
@@ -94,6 +137,10 @@ public:
 	/// manages the boundary of the smoke simulation
 	/// </summary>
 	void SetBoundary(int boundaryCondition, float* grid);
+	/// <summary>
+	/// manages the boundary of a grid with the given width, used by the coarse multigrid levels
+	/// </summary>
+	void SetBoundary(int boundaryCondition, float* grid, int gridWidth);
 
 	/// <summary>
 	/// add values from the source grid into the target grid
@@ -147,6 +194,14 @@ public:
 	/// </summary>
 	float GetGridTotal(float* grid);
 	int GetSavedSimTotalFrames();
+	/// <summary>
+	/// largest residual left by the last multigrid or conjugate gradient solve
+	/// </summary>
+	float GetLastSolverResidual();
+	/// <summary>
+	/// v-cycles or iterations used by the last multigrid or conjugate gradient solve
+	/// </summary>
+	int GetLastSolverIterations();
 
 	//flags to simulate density and velocity
 	bool bDiffuse = true;
@@ -154,6 +209,107 @@ public:
 	bool bDensityStep = true;
 	bool bVelocityStep = true;
 
+	//advects density in the velocity step's pass, along the velocity before it's advected, 
+	//saves a pass over the grid but density is advected before it's diffused
+	bool bFuseDensityAdvection = false;
+
+	//linear solvers used by diffusion and projection, red-black splits each sweep across all cores
+	LinearSolver diffusionSolver = RedBlackGaussSeidel;
+	LinearSolver pressureSolver = RedBlackGaussSeidel;
+
+	//multigrid and conjugate gradient stop once the largest residual is below the tolerance, 
+	//or after the max amount of v-cycles / iterations
+	float solverTolerance = 0.00001f;
+	int maxMultigridCycles = 4;
+	int maxConjugateGradientIterations = 100;
+	Preconditioner preconditioner = IncompleteCholesky;
+
+	//advection processes 8 (avx2) or 16 (avx-512) cells at a time, falls back to scalar if unsupported
+	AdvectionKernel advectionKernel = ScalarKernel;
+
+	/// <summary>
+	/// returns the fastest advection kernel this cpu supports
+	/// </summary>
+	static AdvectionKernel DetectAdvectionKernel();
+
+	//only simulate the box around cells with density or velocity, the rest of the grid stays empty.
+	//only used with the gauss-seidel solvers and no ambient velocity, otherwise the whole grid is simulated
+	bool bTrackActiveRegion = true;
+
+	/// <summary>
+	/// box of cells simulated in the next update
+	/// </summary>
+	ActiveRegion GetActiveRegion();
+
+	/// <summary>
+	/// simulates the whole grid in the next update, needed after writing straight into the grids
+	/// </summary>
+	void ResetActiveRegion();
+
+	/// <summary>
+	/// bricks simulated in the last update, when using sparse storage
+	/// </summary>
+	int GetActiveBrickCount();
+
+	/// <summary>
+	/// density stored in bricks when using sparse storage, nullptr otherwise
+	/// </summary>
+	BrickGrid* GetDensityBricks();
+
+	/// <summary>
+	/// one bit per 8x8x8 brick whose density moved further than the writer's change tolerance since it was last
+	/// returned, in the same order as a saved frame's header. the returned bricks are taken as saved, so call it
+	/// once per saved frame
+	/// </summary>
+	const uint64_t* GetChangedBricks();
+
+	/// <summary>
+	/// unflags every brick, called once the changes have been saved. the first call takes the whole density as saved
+	/// </summary>
+	void ClearChangedBricks();
+
+	/// <summary>
+	/// bytes allocated for the simulation grids
+	/// </summary>
+	size_t GetGridMemoryUsage();
+
+	//splits each update into equal sub-steps, so the fastest velocity seen by the last advection pass moves at most 
+	//the cfl number of cells per step. calm updates take a single step and no update takes more than the max sub-steps,
+	//so real time updates can go over the cfl number, see GetLastSubStepsCapped. 0 doesn't cap the sub-steps,
+	//which CreateAndSaveSimulation uses so saved simulations always stay within it
+	bool bAdaptiveTimeStep = true;
+	float cflNumber = 5.0f;
+	int maxSubSteps = 4;
+
+	//how CreateAndSaveSimulation stores blocks, quantised blocks make smaller files but lose some precision,
+	//compressing them is lossless
+	ReadWriteSmoke::BlockEncoding saveBlockEncoding = ReadWriteSmoke::FloatBlocks;
+	bool bCompressSavedBlocks = false;
+
+	//encode and write saved frames on their own threads while the next frame simulates, see PipelinedWriter.
+	//dense storage only, sparse storage writes straight from its bricks
+	bool bPipelinedSave = true;
+
+	/// <summary>
+	/// fewest sub-steps that keep an update of the given length within the cfl number, capped at the max sub-steps
+	/// </summary>
+	int GetStableSubSteps(float deltaTime);
+
+	/// <summary>
+	/// sub-steps taken by the last update
+	/// </summary>
+	int GetLastSubStepCount();
+
+	/// <summary>
+	/// whether the last update needed more than the max sub-steps, so its steps moved further than the cfl number
+	/// </summary>
+	bool GetLastSubStepsCapped();
+
+	/// <summary>
+	/// largest velocity component seen by the last advection pass, in grid widths per second
+	/// </summary>
+	float GetMaxVelocity();
+
 	//smoke coeficients
 	const float mDiffuseRate = 0.0000005f;
 	const float mViscosity = 0.0000f;
@@ -174,16 +330,307 @@ public:
 	float* mAmbientVelU, * mAmbientVelV, * mAmbientVelW;
 
 	//temp buffers, allocated on startup to increase performance
-	float* tempBufX, * tempBufY, * tempBufZ, * tempBuf;
+	float* tempBufX, * tempBuf;
 
 private:
 
+	/// <summary>
+	/// one step of the simulation, update splits its time into these
+	/// </summary>
+	void SimulationStep(float deltaTime);
+
+	/// <summary>
+	/// advects one row of cells along x for each field, using the chosen advection kernel
+	/// </summary>
+	void AdvectRow(AdvectedField* fields, int fieldCount, float* u, float* v, float* w, int j, int k, int iStart, int iEnd, float dt0);
+
+	/// <summary>
+	/// shrinks the active region to the box around cells with density or velocity, plus a margin.
+	/// cells no longer in the region are cleared
+	/// </summary>
+	void UpdateActiveRegion();
+
+	/// <summary>
+	/// cells to grow the active region or bricks by for a step of the given length, far enough that advection
+	/// never backtraces past it at the fastest velocity seen by the last advection pass
+	/// </summary>
+	int GetActiveRegionMargin(float stepTime);
+
+	/// <summary>
+	/// grows the active region to include the cell and the margin around it
+	/// </summary>
+	void ExpandActiveRegion(int x, int y, int z);
+
+	/// <summary>
+	/// flags the bricks inside the old or new active region which hold density now or did last step, 
+	/// nothing outside either region can have changed. GetChangedBricks drops those which didn't
+	/// </summary>
+	void MarkChangedRegionBricks(const ActiveRegion& previousRegion);
+
+	/// <summary>
+	/// flags the brick holding the cell
+	/// </summary>
+	void MarkChangedCell(int x, int y, int z);
+
+	/// <summary>
+	/// flags every brick, after the density is replaced or written into directly
+	/// </summary>
+	void MarkAllBricksChanged();
+
+	static ActiveRegion WholeGrid(int gridWidth);
+	static ActiveRegion EmptyRegion();
+	static bool IsRegionEmpty(const ActiveRegion& region);
+
+	/// <summary>
+	/// sweeps the grid one z-plane at a time, adding the ambient velocity and buoyancy, then
+	/// confining the vorticity. only a few planes of curl are kept, in the rolling curl plane buffers
+	/// </summary>
+	void ForceSweep(float dt);
+
+	/// <summary>
+	/// solves the linear system used by diffusion and projection, using the given linear solver.
+	/// each cell is relaxed as x = (x0 + a * (sum of neighbours)) / c
+	/// </summary>
+	/// <param name="boundaryCondition"> - used in the set boundary function </param>
+	/// <param name="x"> - grid being solved for </param>
+	/// <param name="x0"> - right hand side grid </param>
+	void LinearSolve(LinearSolver solver, int boundaryCondition, float* x, float* x0, float a, float c);
+
+	/// <summary>
+	/// in place gauss-seidel sweeps, in grid order on a single thread
+	/// </summary>
+	void GaussSeidelSolve(int boundaryCondition, float* x, float* x0, float a, float c);
+
+	/// <summary>
+	/// gauss-seidel sweeps in red-black order. each colour only reads cells of the other colour, 
+	/// so every half sweep is split into z-slabs across the thread pool
+	/// </summary>
+	void RedBlackGaussSeidelSolve(int boundaryCondition, float* x, float* x0, float a, float c);
+
+	/// <summary>
+	/// runs red-black sweeps on a grid of the given width
+	/// </summary>
+	void RedBlackRelax(int boundaryCondition, float* x, float* x0, float a, float c, int gridWidth, int sweeps);
+	/// <summary>
+	/// runs red-black sweeps over a region of the grid, cells outside it are left as they are
+	/// </summary>
+	void RedBlackRelax(int boundaryCondition, float* x, float* x0, float a, float c, int gridWidth, int sweeps, const ActiveRegion& region);
+
+	//---- MULTIGRID ----//
+
+	/// <summary>
+	/// one level of the multigrid hierarchy, each level halves the grid width of the one above
+	/// </summary>
+	struct MultigridLevel {
+		int gridWidth;
+		float* x;			//solution, on coarse levels the correction to the finer level
+		float* rhs;			//right hand side, on coarse levels the restricted residual
+		float* residual;
+	};
+
+	/// <summary>
+	/// allocates the multigrid levels, only done the first time multigrid is used
+	/// </summary>
+	void SetupMultigrid();
+
+	/// <summary>
+	/// solves the linear system with multigrid v-cycles until the residual is below the solver tolerance
+	/// </summary>
+	void MultigridSolve(int boundaryCondition, float* x, float* x0, float a, float c);
+
+	/// <summary>
+	/// smooths the level, restricts the residual to the coarser level, solves that recursively,
+	/// then adds the interpolated correction back and smooths again
+	/// </summary>
+	void VCycle(int level, int boundaryCondition, float a, float c);
+
+	/// <summary>
+	/// calculates residual = rhs - A * x for a grid of the given width
+	/// </summary>
+	/// <returns> largest absolute residual </returns>
+	float CalculateResidual(float* residual, float* x, float* rhs, float a, float c, int gridWidth);
+
+	/// <summary>
+	/// averages the fine grid cells into the coarse grid
+	/// </summary>
+	void Restrict(float* fine, int fineWidth, float* coarse, int coarseWidth);
+
+	/// <summary>
+	/// trilinearly interpolates the coarse grid and adds it to the fine grid
+	/// </summary>
+	void ProlongateAdd(float* coarse, int coarseWidth, float* fine, int fineWidth);
+
+	//---- CONJUGATE GRADIENT ----//
+
+	/// <summary>
+	/// allocates the conjugate gradient buffers, only done the first time it's used
+	/// </summary>
+	void SetupConjugateGradient();
+
+	/// <summary>
+	/// solves the linear system with preconditioned conjugate gradient, stopping as soon as the 
+	/// residual is below the solver tolerance. the boundary cells fold into the diagonal, keeping the system symmetric
+	/// </summary>
+	void ConjugateGradientSolve(int boundaryCondition, float* x, float* x0, float a, float c);
+
+	/// <summary>
+	/// product = A * grid, sets the grid's boundary first
+	/// </summary>
+	void ApplySystemMatrix(int boundaryCondition, float* grid, float* product, float a, float c);
+
+	/// <summary>
+	/// diagonal of the system matrix at a cell, including the boundary cells folded into it
+	/// </summary>
+	inline float GetSystemDiagonal(int boundaryCondition, int i, int j, int k, float a, float c);
+
+	/// <summary>
+	/// calculates the preconditioner for the current system, for incomplete cholesky this is the 
+	/// inverse diagonal of the factor
+	/// </summary>
+	void BuildPreconditioner(int boundaryCondition, float a, float c);
+
+	/// <summary>
+	/// output = M^-1 * input using the chosen preconditioner
+	/// </summary>
+	void ApplyPreconditioner(float* input, float* output, float a);
+
+	/// <summary>
+	/// dot product of two grids, over the cells inside the boundary. with no second grid returns the sum of the first
+	/// </summary>
+	double DotProduct(float* grid1, float* grid2 = nullptr);
+
+	/// <summary>
+	/// largest absolute value inside the boundary
+	/// </summary>
+	float MaxAbsolute(float* grid);
+
 	//grid width without a boundary
 	int mGridWidth;
 
 	//amount of times to run the linear solver, higher amount -> higher accuracy and higher computation cost
 	const int mLinearSolveTimes = 10;
 
+	//multigrid settings, sweeps before and after each coarse correction and on the coarsest level
+	const int mMultigridSmoothSweeps = 2;
+	const int mMultigridCoarsestSweeps = 20;
+	const int mMultigridCoarsestWidth = 4;
+
+	std::vector<MultigridLevel> mMultigridLevels;
+	float mLastSolverResidual = 0.0f;
+	int mLastSolverIterations = 0;
+
+	//modified incomplete cholesky settings
+	const float mCholeskyTuning = 0.97f;
+	const float mCholeskySafety = 0.25f;
+
+	//conjugate gradient buffers, residual, preconditioned residual, search direction, A * search and preconditioner
+	float* mCGResidual = nullptr, * mCGAux = nullptr, * mCGSearch = nullptr, * mCGProduct = nullptr, * mCGPrecon = nullptr;
+
+	//rolling curl planes used by the force sweep, enough for the planes read while confining and the one being calculated
+	const int mCurlPlaneCount = 4;
+	float* mCurlPlanes;
+
+	//third curl grid for the reference VorticityConfinement, only allocated if it's called
+	float* mReferenceCurlZ = nullptr;
+
+	//cells the kernels work on, with the threshold for a cell to count as empty and how many cells to grow it by.
+	//the margin is set each step from the velocity, and is never less than the minimum so pressure can spread
+	ActiveRegion mActiveRegion;
+	const float mActiveThreshold = 0.0001f;
+	const int mMinActiveRegionMargin = 4;
+	int mActiveRegionMargin = 4;
+	bool bAmbientVelocity = false;
+
+	//fastest velocity seen by the last advection pass and the sub-steps the last update took
+	float mMaxVelocity = 0.0f;
+	int mLastSubStepCount = 0;
+	bool bLastSubStepsCapped = false;
+
+	//most sub-steps an uncapped update takes, only reached if the velocity has blown up
+	const int mSubStepLimit = 256;
+
+	//---- SPARSE STORAGE ----//
+
+	/// <summary>
+	/// finds the bricks with density or velocity and their neighbours, which are simulated this step.
+	/// every other brick is freed, and the simulated bricks are allocated in every brick grid
+	/// </summary>
+	void UpdateActiveBricks();
+
+	/// <summary>
+	/// density and velocity steps on the brick grids, same as the dense steps
+	/// </summary>
+	void SparseDensityStep(float dt);
+	void SparseVelocityStep(float dt);
+
+	/// <summary>
+	/// adds the ambient velocity, buoyancy and vorticity confinement. each brick is read with a 2 cell halo, 
+	/// enough for the curl around its cells, and written to the previous velocity grids
+	/// </summary>
+	void SparseForces(float dt);
+
+	/// <summary>
+	/// diffuses the brick grid with red-black gauss-seidel
+	/// </summary>
+	void SparseDiffuse(int boundaryCondition, BrickGrid* current, BrickGrid* previous, float rate, float dt);
+
+	/// <summary>
+	/// advects each field from previous to current along the given velocity
+	/// </summary>
+	void SparseAdvect(BrickGrid** current, BrickGrid** previous, int* boundaryConditions, int fieldCount,
+		BrickGrid* u, BrickGrid* v, BrickGrid* w, float dt);
+
+	/// <summary>
+	/// projects the brick velocity grids, pressure is 0 outside the simulated bricks
+	/// </summary>
+	void SparseProject();
+
+	/// <summary>
+	/// throws if the simulation is stored in bricks, for the kernels which only work on the dense grids
+	/// </summary>
+	void RequireDenseStorage(const char* kernel);
+
+	/// <summary>
+	/// throws if a solver other than red-black gauss-seidel is picked, the only one the bricks have
+	/// </summary>
+	void RequireSparseSolvers();
+
+	/// <summary>
+	/// red-black sweeps over the simulated bricks
+	/// </summary>
+	void SparseRelax(int boundaryCondition, BrickGrid* x, BrickGrid* x0, float a, float c);
+
+	/// <summary>
+	/// manages the boundary of the cells in simulated bricks, the same as SetBoundary
+	/// </summary>
+	void SparseSetBoundary(int boundaryCondition, BrickGrid* grid);
+
+	/// <summary>
+	/// copies the simulated bricks' density into the dense density grid
+	/// </summary>
+	void UpdateDensityMirror();
+
+	GridStorage mStorage;
+
+	//brick grids used instead of the dense grids with sparse storage
+	BrickGrid* mBrickDensity = nullptr, * mBrickPrevDensity = nullptr;
+	BrickGrid* mBrickVelU = nullptr, * mBrickVelV = nullptr, * mBrickVelW = nullptr;
+	BrickGrid* mBrickPrevVelU = nullptr, * mBrickPrevVelV = nullptr, * mBrickPrevVelW = nullptr;
+	BrickGrid* mBrickPressure = nullptr, * mBrickDivergence = nullptr;
+
+	//bricks simulated this step, and the ambient velocity which is the same for every cell
+	std::vector<int> mActiveBricks;
+	float mAmbientU = 0, mAmbientV = 0, mAmbientW = 0;
+
+	//bricks which may have changed since the last save, one byte each so threads can flag them without locking,
+	//checked against the saved density and packed into a bitmask when asked for. with dense storage, whether each
+	//brick held density last step. the saved density is only kept once changed bricks are asked for
+	int mChangedBricksPerAxis{};
+	std::vector<uint8_t> mChangedBricks;
+	std::vector<uint64_t> mChangedBrickMask;
+	std::vector<uint8_t> mBrickHadDensity;
+	std::vector<float> mSavedDensity;
+
 	//read a simulation from file, max frames and counter
 	std::string mCurrentFile{};
 	int mReadSimTotalFrames = 0;
@@ -195,9 +642,15 @@ private:
 	std::mt19937 randGenerator;
 	std::uniform_int_distribution<std::mt19937::result_type> randomGridBounds;
 
+	//worker threads shared by the solver kernels
+	ThreadPool* mThreadPool;
+
 protected:
 	//smoke simulation file interface
-	ReadWriteSmoke* mCurrentReadSmoke;
+	ReadWriteSmoke* mCurrentReadSmoke = nullptr;
+
+	//decodes the saved frames ahead of playback, if prefetching
+	FramePrefetcher* mFramePrefetcher = nullptr;
 
 };
 
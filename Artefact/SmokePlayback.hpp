@@ -0,0 +1,120 @@
+#pragma once
+
+#include "ReadWriteSmoke.h"
+#include "FramePrefetcher.hpp"
+#include <string>
+
+/**
+*	Plays back a saved simulation without a solver
+*
+*	only the reader and the decoded density are kept, so a playback takes a grid of memory, or one per prefetched
+*	frame, instead of every grid a Smoke needs to simulate. several can be open side by side
+**/
+
+
+class SmokePlayback
+{
+public:
+	/// <summary>
+	/// opens the saved simulation, ready to read the first frame
+	/// </summary>
+	/// <param name="prefetchFrames"> - frames decoded ahead on their own thread, 0 decodes each frame when it's read </param>
+	/// <param name="loopMode"> - how playback gets back to the first frame, a snapshot makes looping a copy </param>
+	SmokePlayback(std::string fileName, int prefetchFrames = 0, ReadWriteSmoke::LoopMode loopMode = ReadWriteSmoke::LoopFromKeyframe);
+	~SmokePlayback();
+
+	/// <summary>
+	/// moves to the next frame, after the last frame it loops back to the first
+	/// </summary>
+	/// <returns> the frame's density, valid until the next read </returns>
+	float* ReadNextFrame();
+
+	/// <summary>
+	/// density of the current frame
+	/// </summary>
+	float* GetDensity();
+
+	/// <summary>
+	/// grid width including the border, as for Smoke::GetGridWidth
+	/// </summary>
+	int GetGridWidth();
+
+	/// <summary>
+	/// frame in the density, the first frame until the first read
+	/// </summary>
+	int GetCurrentFrame();
+
+	/// <summary>
+	/// frames in the file, including the starting frame
+	/// </summary>
+	int GetFrameCount();
+
+	/// <summary>
+	/// bytes allocated for decoded density
+	/// </summary>
+	size_t GetMemoryUsage();
+
+private:
+	ReadWriteSmoke mReader;
+	FramePrefetcher* mPrefetcher = nullptr;
+	float* mDensity = nullptr;
+};
+
+
+inline SmokePlayback::SmokePlayback(std::string fileName, int prefetchFrames, ReadWriteSmoke::LoopMode loopMode)
+{
+	//the loop mode can't change once the prefetcher is decoding from the reader
+	mReader.ReadInit(fileName);
+	mReader.SetLoopMode(loopMode);
+
+	//the first frame is shown until the first read
+	if (prefetchFrames > 0) {
+		mPrefetcher = new FramePrefetcher(&mReader, prefetchFrames);
+		mDensity = mPrefetcher->GetCurrentDensity();
+	}
+	else { mDensity = mReader.SeekFrame(0); }
+}
+
+inline SmokePlayback::~SmokePlayback()
+{
+	//the prefetcher decodes from the reader, so it stops first
+	delete(mPrefetcher);
+	mReader.StopRead();
+}
+
+inline float* SmokePlayback::ReadNextFrame()
+{
+	mDensity = (mPrefetcher) ? mPrefetcher->GetNextFrame() : mReader.ReadNextFrame();
+	return mDensity;
+}
+
+inline float* SmokePlayback::GetDensity()
+{
+	return mDensity;
+}
+
+inline int SmokePlayback::GetGridWidth()
+{
+	return mReader.GetSimulationGridWidth();
+}
+
+inline int SmokePlayback::GetCurrentFrame()
+{
+	return (mPrefetcher) ? mPrefetcher->GetCurrentFrame() : mReader.GetCurrentFrame();
+}
+
+inline int SmokePlayback::GetFrameCount()
+{
+	return mReader.GetStoredFrameCount();
+}
+
+inline size_t SmokePlayback::GetMemoryUsage()
+{
+	size_t gridWidth = GetGridWidth();
+	size_t gridBytes = gridWidth * gridWidth * gridWidth * sizeof(float);
+
+	//the reader's grid, and its first frame snapshot if it loops from one
+	size_t readerBytes = gridBytes * ((mReader.GetLoopMode() == ReadWriteSmoke::LoopFromSnapshot) ? 2 : 1);
+
+	return readerBytes + ((mPrefetcher) ? mPrefetcher->GetMemoryUsage() : 0);
+}
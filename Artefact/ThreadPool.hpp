@@ -0,0 +1,173 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+/**
+*	Small persistent pool of worker threads used by the smoke solver
+*
+*	the workers are created once and sleep between jobs, so the kernels can split their loops
+*	across every core many times a frame without paying for creating threads each time
+*
+*	ParallelFor splits a range into one contiguous chunk per thread, the calling thread
+*	also takes a chunk, and only returns once every chunk is finished
+**/
+
+
+class ThreadPool
+{
+public:
+	/// <summary>
+	/// creates the worker threads, 0 uses one thread per hardware core
+	/// </summary>
+	ThreadPool(int threadCount = 0);
+	~ThreadPool();
+
+	/// <summary>
+	/// runs the body over the range [start, end), split into contiguous chunks across all the threads.
+	/// blocks until every chunk has finished
+	/// </summary>
+	/// <param name="body"> function called with the start and end of each chunk </param>
+	void ParallelFor(int start, int end, const std::function<void(int, int)>& body);
+
+	/// <summary>
+	/// total threads working on a job, including the calling thread
+	/// </summary>
+	int GetThreadCount();
+
+private:
+	/// <summary>
+	/// worker loop, waits for a new job then runs its chunk
+	/// </summary>
+	void WorkerLoop(int workerIndex);
+
+	/// <summary>
+	/// calculates the chunk of the current job given to a thread
+	/// </summary>
+	void GetChunk(int threadIndex, int& chunkStart, int& chunkEnd);
+
+	std::vector<std::thread> mWorkers;
+
+	std::mutex mMutex;
+	std::condition_variable mJobCondition;
+	std::condition_variable mDoneCondition;
+
+	//current job, each new job increments the generation to wake the workers
+	const std::function<void(int, int)>* mJob = nullptr;
+	int mJobStart{}, mJobEnd{};
+	int mJobGeneration{};
+	int mWorkersRemaining{};
+
+	bool bStopping = false;
+};
+
+
+inline ThreadPool::ThreadPool(int threadCount)
+{
+	//default to one thread per core
+	if (threadCount <= 0) {
+		threadCount = (int)std::thread::hardware_concurrency();
+	}
+
+	//the calling thread also works, so one less worker is needed
+	for (int i = 1; i < threadCount; i++)
+	{
+		mWorkers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+	}
+}
+
+inline ThreadPool::~ThreadPool()
+{
+	//wake all the workers and let them exit
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		bStopping = true;
+	}
+	mJobCondition.notify_all();
+
+	for (std::thread& worker : mWorkers) { worker.join(); }
+}
+
+inline void ThreadPool::ParallelFor(int start, int end, const std::function<void(int, int)>& body)
+{
+	if (end <= start) { return; }
+
+	//not worth waking the workers, run on this thread
+	if (mWorkers.empty() || end - start == 1) {
+		body(start, end);
+		return;
+	}
+
+	//publish the job and wake the workers
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJob = &body;
+		mJobStart = start;
+		mJobEnd = end;
+		mWorkersRemaining = (int)mWorkers.size();
+		mJobGeneration++;
+	}
+	mJobCondition.notify_all();
+
+	//calling thread always takes the first chunk
+	int chunkStart, chunkEnd;
+	GetChunk(0, chunkStart, chunkEnd);
+	if (chunkStart < chunkEnd) { body(chunkStart, chunkEnd); }
+
+	//wait for the rest of the chunks
+	std::unique_lock<std::mutex> lock(mMutex);
+	mDoneCondition.wait(lock, [this] { return mWorkersRemaining == 0; });
+	mJob = nullptr;
+}
+
+inline int ThreadPool::GetThreadCount()
+{
+	return (int)mWorkers.size() + 1;
+}
+
+inline void ThreadPool::WorkerLoop(int workerIndex)
+{
+	int seenGeneration = 0;
+
+	while (true)
+	{
+		//sleep until there is a new job or the pool is closing
+		const std::function<void(int, int)>* job;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mJobCondition.wait(lock, [&] { return bStopping || mJobGeneration != seenGeneration; });
+
+			if (bStopping) { return; }
+
+			seenGeneration = mJobGeneration;
+			job = mJob;
+		}
+
+		//run this worker's chunk
+		int chunkStart, chunkEnd;
+		GetChunk(workerIndex, chunkStart, chunkEnd);
+		if (chunkStart < chunkEnd) { (*job)(chunkStart, chunkEnd); }
+
+		//last worker to finish wakes the calling thread
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mWorkersRemaining--;
+			if (mWorkersRemaining == 0) { mDoneCondition.notify_one(); }
+		}
+	}
+}
+
+inline void ThreadPool::GetChunk(int threadIndex, int& chunkStart, int& chunkEnd)
+{
+	//spread the range as evenly as possible, the first chunks take any remainder
+	int threadCount = GetThreadCount();
+	int range = mJobEnd - mJobStart;
+	int chunkSize = range / threadCount;
+	int remainder = range % threadCount;
+
+	chunkStart = mJobStart + threadIndex * chunkSize + (threadIndex < remainder ? threadIndex : remainder);
+	chunkEnd = chunkStart + chunkSize + (threadIndex < remainder ? 1 : 0);
+}
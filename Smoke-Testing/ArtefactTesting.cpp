@@ -4,8 +4,14 @@
 #include "../Artefact/Smoke.cpp"
 #include "../Artefact/ReadWriteSmoke.h"
 #include "../Artefact/ReadWriteSmoke.cpp"
+#include "../Artefact/SimulationThread.hpp"
+#include "../Artefact/BlockCodec.hpp"
+#include "../Artefact/FramePrefetcher.hpp"
+#include "../Artefact/PipelinedWriter.hpp"
+#include "../Artefact/SmokePlayback.hpp"
 
 #include<algorithm>
+#include<bitset>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -246,6 +252,397 @@ namespace SmokeTesting
 		}
 
 
+		//check the multithreaded red-black solver diffuses the same as the serial solver
+		TEST_METHOD(Test8_RedBlackDiffusion)
+		{
+			//create two smoke objects, one for each solver
+			Smoke* serialSmoke = new Smoke(32);
+			Smoke* redBlackSmoke = new Smoke(32);
+			serialSmoke->diffusionSolver = Smoke::GaussSeidel;
+			redBlackSmoke->diffusionSolver = Smoke::RedBlackGaussSeidel;
+
+			//add the same density to both, solving over the whole grid
+			int densCentre = 15;
+			float sourceDensity = 10.0f;
+			Smoke* smokes[2] = { serialSmoke, redBlackSmoke };
+			for (Smoke* smoke : smokes) {
+				smoke->AddDensity(densCentre, densCentre, densCentre, sourceDensity);
+				smoke->ResetActiveRegion();
+			}
+
+			//the simulation's own rate barely moves the density, so diffuse with a rate that spreads it over a few cells
+			float diffuseRate = 0.0001f;
+			for (int i = 0; i < 5; i++) {
+				for (Smoke* smoke : smokes) {
+					std::swap(smoke->mCurrentDensity, smoke->mPrevDensity);
+					smoke->Diffuse(0, smoke->mCurrentDensity, smoke->mPrevDensity, diffuseRate, 0.1f);
+				}
+			}
+
+			//the source should have spread out, most of it leaving the centre cell
+			float centre = serialSmoke->GetDensityAtPoint(densCentre, densCentre, densCentre);
+			Assert::IsTrue(centre < sourceDensity * 0.5f);
+			Assert::IsTrue(serialSmoke->GetDensityAtPoint(densCentre + 2, densCentre, densCentre) > 0.01f);
+			Assert::IsTrue(serialSmoke->GetDensityAtPoint(densCentre, densCentre - 2, densCentre) > 0.01f);
+			Assert::IsTrue(serialSmoke->GetDensityAtPoint(densCentre, densCentre, densCentre + 2) > 0.01f);
+
+			//both solvers should reach the same diffused density, relative to the peak
+			float maxDifference = 0.0f;
+			for (int i = 0; i < serialSmoke->mTotalCellCount; i++)
+			{
+				maxDifference = std::max(maxDifference, abs(serialSmoke->mCurrentDensity[i] - redBlackSmoke->mCurrentDensity[i]));
+			}
+			Assert::IsTrue(maxDifference < centre * 0.001f);
+
+			delete(serialSmoke);
+			delete(redBlackSmoke);
+		}
+
+		//check the multigrid pressure solver reaches the wanted residual
+		TEST_METHOD(Test9_MultigridPressure)
+		{
+			//create new smoke object using multigrid for projection
+			Smoke* smoke = new Smoke(32);
+			smoke->pressureSolver = Smoke::Multigrid;
+			smoke->maxMultigridCycles = 10;
+
+			//add density so buoyancy creates a velocity field to project
+			int densCentre = 15;
+			smoke->AddDensity(densCentre, 5, densCentre, 15.0f, 8);
+
+			for (int i = 0; i < 5; i++)
+			{
+				smoke->Update(0.1f);
+
+				//each projection should finish below the tolerance
+				Assert::IsTrue(smoke->GetLastSolverResidual() <= smoke->solverTolerance);
+			}
+
+			//density should still be valid after projecting
+			Assert::IsTrue(smoke->GetTotalDensity() > 0.0f);
+
+			delete(smoke);
+		}
+
+		//check conjugate gradient exits early on calm frames and converges on busy ones
+		TEST_METHOD(Test10_ConjugateGradient)
+		{
+			//create new smoke object using conjugate gradient for both systems
+			Smoke* smoke = new Smoke(32);
+			smoke->diffusionSolver = Smoke::ConjugateGradient;
+			smoke->pressureSolver = Smoke::ConjugateGradient;
+
+			//empty smoke is already solved, so no iterations are needed
+			smoke->Update(0.1f);
+			Assert::IsTrue(smoke->GetLastSolverIterations() == 0);
+
+			//add density so buoyancy creates a velocity field to project
+			int densCentre = 15;
+			smoke->AddDensity(densCentre, 5, densCentre, 15.0f, 8);
+
+			//the density diffuse is the last solve in each update
+			for (int i = 0; i < 5; i++)
+			{
+				smoke->Update(0.1f);
+				Assert::IsTrue(smoke->GetLastSolverResidual() <= smoke->solverTolerance);
+			}
+
+			//density should still be valid after projecting
+			Assert::IsTrue(smoke->GetTotalDensity() > 0.0f);
+
+			//two identical velocity fields, projected with conjugate gradient and red-black gauss-seidel
+			Smoke* cg = new Smoke(32);
+			Smoke* redBlack = new Smoke(32);
+			for (Smoke* s : { cg, redBlack }) {
+				s->AddDensity(densCentre, 5, densCentre, 15.0f, 8);
+				for (int i = 0; i < 3; i++) { s->Update(0.1f); }
+				s->AddForces(0.1f);
+			}
+			cg->pressureSolver = Smoke::ConjugateGradient;
+
+			//size of the divergence inside the grid boundary, as the root of its sum of squares
+			auto divergence = [](Smoke* s) {
+				int w = s->GetGridWidth();
+				auto at = [w](int i, int j, int k) { return i + w * j + w * w * k; };
+				double sum = 0.0;
+				for (int k = 1; k < w - 1; k++) {
+					for (int j = 1; j < w - 1; j++) {
+						for (int i = 1; i < w - 1; i++) {
+							float d = s->mCurVelU[at(i + 1, j, k)] - s->mCurVelU[at(i - 1, j, k)] +
+								s->mCurVelV[at(i, j + 1, k)] - s->mCurVelV[at(i, j - 1, k)] +
+								s->mCurVelW[at(i, j, k + 1)] - s->mCurVelW[at(i, j, k - 1)];
+							sum += (double)d * d;
+						}
+					}
+				}
+				return sqrt(sum);
+			};
+			double startDivergence = divergence(cg);
+			Assert::AreEqual(startDivergence, divergence(redBlack));
+
+			//the pressure solve converges, and leaves the velocity at least as divergence free as red-black gauss-seidel
+			cg->Project();
+			redBlack->Project();
+			Assert::IsTrue(cg->GetLastSolverIterations() > 0);
+			Assert::IsTrue(cg->GetLastSolverResidual() <= cg->solverTolerance);
+			Assert::IsTrue(divergence(cg) < startDivergence);
+			Assert::IsTrue(divergence(cg) <= divergence(redBlack));
+
+			delete(cg);
+			delete(redBlack);
+			delete(smoke);
+		}
+
+		//check the vectorised advection kernel matches the scalar kernel
+		TEST_METHOD(Test11_VectorisedAdvection)
+		{
+			//create two smoke objects, one forced to use the scalar kernel
+			Smoke* scalarSmoke = new Smoke(32);
+			Smoke* vectorSmoke = new Smoke(32);
+			scalarSmoke->advectionKernel = Smoke::ScalarKernel;
+			vectorSmoke->advectionKernel = Smoke::DetectAdvectionKernel();
+			scalarSmoke->bDiffuse = false;
+			vectorSmoke->bDiffuse = false;
+
+			//same velocity and density in both
+			scalarSmoke->SetVelocity(0.05f, 0.1f, -0.03f);
+			vectorSmoke->SetVelocity(0.05f, 0.1f, -0.03f);
+			scalarSmoke->AddDensity(15, 15, 15, 10.0f, 6);
+			vectorSmoke->AddDensity(15, 15, 15, 10.0f, 6);
+
+			for (int i = 0; i < 3; i++) { scalarSmoke->DensityStep(0.1f); vectorSmoke->DensityStep(0.1f); }
+
+			//advected density should match
+			for (int i = 0; i < scalarSmoke->mTotalCellCount; i++)
+			{
+				Assert::IsTrue(abs(scalarSmoke->mCurrentDensity[i] - vectorSmoke->mCurrentDensity[i]) < 0.0001f);
+			}
+
+			delete(scalarSmoke);
+			delete(vectorSmoke);
+		}
+
+		//check density still moves when advected in the same pass as velocity
+		TEST_METHOD(Test12_FusedDensityAdvection)
+		{
+			//create new smoke object advecting density with the velocity
+			Smoke* smoke = new Smoke(32);
+			smoke->bDiffuse = false;
+			smoke->bFuseDensityAdvection = true;
+
+			//set upwards velocity
+			smoke->SetVelocity(0, 0.1f, 0);
+
+			//add density and track centre
+			int densCentre = 15;
+			smoke->AddDensity(densCentre, densCentre, densCentre, 10.0f);
+
+			smoke->Update(0.1f);
+
+			//smoke moved from centre to the cell above, and not below
+			Assert::IsTrue(smoke->GetDensityAtPoint(densCentre, densCentre, densCentre) < 10.0f);
+			Assert::IsTrue(smoke->GetDensityAtPoint(densCentre, densCentre + 1, densCentre) > 0.0f);
+			Assert::IsTrue(smoke->GetDensityAtPoint(densCentre, densCentre - 1, densCentre) <= 0.0f);
+
+			delete(smoke);
+		}
+
+		//checks the fused force pass matches adding each force in its own pass
+		TEST_METHOD(Test13_FusedForces)
+		{
+			//two identical simulations with density, velocity and ambient wind
+			Smoke* fused = new Smoke(32);
+			Smoke* separate = new Smoke(32);
+			Smoke* smokes[2] = { fused, separate };
+			for (Smoke* smoke : smokes) {
+				smoke->AddDensity(15, 15, 15, 10.0f);
+				smoke->AddDensity(10, 20, 12, 5.0f);
+				smoke->SetVelocity(0.1f, 0, -0.05f);
+				smoke->SetAmbientVelocity(0.02f, 0, 0.03f);
+				smoke->Update(0.1f);
+			}
+
+			fused->AddForces(0.1f);
+
+			//the unfused kernels, each a separate pass over whole grids
+			separate->AddSource(separate->mCurVelU, separate->mAmbientVelU, 0.1f);
+			separate->AddSource(separate->mCurVelV, separate->mAmbientVelV, 0.1f);
+			separate->AddSource(separate->mCurVelW, separate->mAmbientVelW, 0.1f);
+			separate->AddBuoyancy(0.1f);
+			std::vector<float> beforeConfinement(separate->mCurVelU, separate->mCurVelU + separate->mTotalCellCount);
+			separate->VorticityConfinement(0.1f);
+
+			//vorticity confinement should have done something for the comparison to mean anything
+			bool bConfined = false;
+			for (int i = 0; i < separate->mTotalCellCount; i++) {
+				if (abs(beforeConfinement[i] - separate->mCurVelU[i]) > 0.00001f) { bConfined = true; }
+			}
+			Assert::IsTrue(bConfined);
+
+			for (int i = 0; i < fused->mTotalCellCount; i++) {
+				Assert::AreEqual(separate->mCurVelU[i], fused->mCurVelU[i], 0.00001f);
+				Assert::AreEqual(separate->mCurVelV[i], fused->mCurVelV[i], 0.00001f);
+				Assert::AreEqual(separate->mCurVelW[i], fused->mCurVelW[i], 0.00001f);
+			}
+
+			delete(fused);
+			delete(separate);
+		}
+
+		//checks only the area around the smoke is simulated
+		TEST_METHOD(Test14_ActiveRegion)
+		{
+			Smoke* smoke = new Smoke(64);
+
+			//nothing to simulate in an empty grid
+			Smoke::ActiveRegion region = smoke->GetActiveRegion();
+			Assert::IsTrue(region.endX < region.startX);
+
+			int densCentre = 30;
+			smoke->AddDensity(densCentre, densCentre, densCentre, 10.0f);
+			for (int i = 0; i < 3; i++) { smoke->Update(0.1f); }
+
+			//region surrounds the smoke but not the whole grid
+			region = smoke->GetActiveRegion();
+			Assert::IsTrue(region.startX <= densCentre && region.endX >= densCentre);
+			Assert::IsTrue(region.startY <= densCentre && region.endY >= densCentre);
+			Assert::IsTrue(region.startZ <= densCentre && region.endZ >= densCentre);
+			Assert::IsTrue(region.startX > 1 && region.endX < smoke->GetGridWidth() - 2);
+
+			//no smoke outside the region
+			for (int k = 1; k < smoke->GetGridWidth() - 1; k++) {
+				for (int j = 1; j < smoke->GetGridWidth() - 1; j++) {
+					for (int i = 1; i < smoke->GetGridWidth() - 1; i++) {
+						bool inside = i >= region.startX && i <= region.endX && j >= region.startY && j <= region.endY &&
+							k >= region.startZ && k <= region.endZ;
+						if (!inside) { Assert::AreEqual(0.0f, smoke->GetDensityAtPoint(i, j, k)); }
+					}
+				}
+			}
+			Assert::IsTrue(smoke->GetTotalDensity() > 0.0f);
+
+			delete(smoke);
+		}
+
+		//checks sparse storage simulates the same smoke as dense storage, only allocating bricks around it
+		TEST_METHOD(Test15_SparseStorage)
+		{
+			Smoke* dense = new Smoke(32);
+			Smoke* sparse = new Smoke(32, Smoke::SparseStorage);
+
+			//velocity everywhere, so every brick is simulated
+			Smoke* smokes[2] = { dense, sparse };
+			for (Smoke* smoke : smokes) {
+				smoke->SetVelocity(0.01f, 0.02f, -0.01f);
+				smoke->AddDensity(15, 10, 15, 10.0f, 4);
+				for (int i = 0; i < 3; i++) { smoke->Update(0.1f); }
+			}
+
+			for (int i = 0; i < dense->mTotalCellCount; i++) {
+				Assert::AreEqual(dense->mCurrentDensity[i], sparse->mCurrentDensity[i], 0.0001f);
+			}
+			delete(sparse);
+
+			//still smoke, only the bricks around it are allocated
+			sparse = new Smoke(64, Smoke::SparseStorage);
+			sparse->AddDensity(30, 30, 30, 10.0f);
+			sparse->Update(0.1f);
+
+			Assert::IsTrue(sparse->GetActiveBrickCount() > 0 && sparse->GetActiveBrickCount() <= 27);
+			Assert::IsTrue(sparse->GetDensityAtPoint(30, 30, 30) > 0.0f);
+			Assert::IsTrue(sparse->GetTotalDensity() > 0.0f);
+
+			//forces and projection work on the bricks, the other kernels need the dense grids
+			sparse->SetVelocity(0.0f, 0.1f, 0.0f);
+			sparse->AddForces(0.1f);
+			sparse->Project();
+			auto throwsLogicError = [](const std::function<void()>& call) {
+				try { call(); }
+				catch (const std::logic_error&) { return true; }
+				return false;
+			};
+			Assert::IsTrue(throwsLogicError([&] { sparse->VorticityConfinement(0.1f); }));
+			Assert::IsTrue(throwsLogicError([&] { sparse->Diffuse(0, sparse->mCurrentDensity, sparse->mCurrentDensity, 0.1f, 0.1f); }));
+
+			//the bricks only have red-black gauss-seidel
+			sparse->pressureSolver = Smoke::ConjugateGradient;
+			Assert::IsTrue(throwsLogicError([&] { sparse->Update(0.1f); }));
+
+			delete(dense);
+			delete(sparse);
+		}
+
+		//check updates are split into just enough sub-steps to stay within the cfl number
+		TEST_METHOD(Test16_AdaptiveTimeStep)
+		{
+			Smoke* smoke = new Smoke(32);
+			smoke->AddDensity(15, 15, 15, 10.0f, 4);
+
+			//still smoke takes a single step
+			smoke->Update(0.1f);
+			Assert::AreEqual(1, smoke->GetLastSubStepCount());
+
+			//moving 1 grid width a second, 0.1s crosses 3 cells and 0.5s crosses 15 cells
+			smoke->SetVelocity(0.0f, 1.0f, 0.0f);
+			Assert::AreEqual(1, smoke->GetStableSubSteps(0.1f));
+			Assert::AreEqual(3, smoke->GetStableSubSteps(0.5f));
+
+			smoke->Update(0.5f);
+			Assert::AreEqual(3, smoke->GetLastSubStepCount());
+			Assert::IsTrue(smoke->GetMaxVelocity() > 0.0f);
+
+			//never more than the max sub-steps
+			smoke->SetVelocity(0.0f, 1.0f, 0.0f);
+			smoke->maxSubSteps = 2;
+			smoke->Update(0.5f);
+			Assert::AreEqual(2, smoke->GetLastSubStepCount());
+			Assert::IsTrue(smoke->GetLastSubStepsCapped());
+
+			//uncapped updates always take enough steps
+			smoke->SetVelocity(0.0f, 1.0f, 0.0f);
+			smoke->maxSubSteps = 0;
+			smoke->Update(0.5f);
+			Assert::AreEqual(3, smoke->GetLastSubStepCount());
+			Assert::IsFalse(smoke->GetLastSubStepsCapped());
+
+			//turned off every update is one step
+			smoke->bAdaptiveTimeStep = false;
+			smoke->Update(0.5f);
+			Assert::AreEqual(1, smoke->GetLastSubStepCount());
+
+			delete(smoke);
+		}
+
+		//check the simulation thread publishes frames and runs queued commands
+		TEST_METHOD(Test17_SimulationThread)
+		{
+			Smoke* smoke = new Smoke(32);
+			SimulationThread* simulation = new SimulationThread(smoke, [](Smoke& smoke) {
+				smoke.AddDensity(15, 5, 15, 10.0f);
+			});
+
+			//wait for a few updates, density added on the simulation thread shows up in the latest frame
+			auto waitFor = [&](std::function<bool()> condition) {
+				for (int i = 0; i < 500 && !condition(); i++) { std::this_thread::sleep_for(std::chrono::milliseconds(10)); }
+				return condition();
+			};
+			Assert::IsTrue(waitFor([&] { return simulation->GetStepCount() >= 3; }));
+			Assert::IsTrue(waitFor([&] { return smoke->GetGridTotal(simulation->GetLatestDensity()) > 0.0f; }));
+
+			//paused with the density cleared, the latest frame is empty
+			simulation->SetPaused(true);
+			simulation->ClearDensity();
+			Assert::IsTrue(waitFor([&] { return smoke->GetGridTotal(simulation->GetLatestDensity()) == 0.0f; }));
+
+			//one requested step adds density again
+			int steps = simulation->GetStepCount();
+			simulation->RequestStep();
+			Assert::IsTrue(waitFor([&] { return simulation->GetStepCount() == steps + 1; }));
+			Assert::IsTrue(waitFor([&] { return smoke->GetGridTotal(simulation->GetLatestDensity()) > 0.0f; }));
+
+			delete(simulation);
+			delete(smoke);
+		}
 	};
 
 	TEST_CLASS(SmokeSaving)
@@ -336,6 +733,13 @@ namespace SmokeTesting
 				//check no other blocks are different
 				Assert::IsTrue(differentBlocks.size() == 5);
 
+				//the bitset flags the same blocks, plus one which only differs in its last value
+				densitySplit[3][511] = 1.0f;
+				uint64_t frameHeader[1] = {};
+				smokeSaving.GetDifferenceBitset(densitySplit, blankSplit, frameHeader);
+				uint64_t expected = (1ULL << 0) | (1ULL << 3) | (1ULL << 10) | (1ULL << 17) | (1ULL << 20) | (1ULL << 31);
+				Assert::IsTrue(frameHeader[0] == expected);
+
 				for (size_t i = 0; i < densitySplit.size(); i++)
 				{
 					delete[](densitySplit[i]);
@@ -478,5 +882,776 @@ namespace SmokeTesting
 
 		}
 
+		//check any frame can be read in any order, and reading loops back to the start
+		TEST_METHOD(Test5_SeekingFrames) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			//keep a copy of every written frame
+			std::vector<std::vector<float>> frames;
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest2", smoke->GetGridWidth(), smoke->mCurrentDensity, 8);
+			frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+
+			smoke->AddDensity(15, 15, 15, 100.0f);
+			for (int i = 0; i < 6; i++) {
+				smoke->Update(0.1f);
+				smokeSaving.AddFrame(smoke->mCurrentDensity);
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			}
+			smokeSaving.StopWrite();
+
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest2");
+			Assert::AreEqual(7, smokeReading.GetStoredFrameCount());
+
+			auto matches = [&](float* grid, int frame) {
+				for (int i = 0; i < gridTotal; i++) {
+					if (abs(grid[i] - frames[frame][i]) > 0.00001f) { return false; }
+				}
+				return true;
+			};
+
+			//forwards, backwards and to the same frame
+			Assert::IsTrue(matches(smokeReading.SeekFrame(4), 4));
+			Assert::IsTrue(matches(smokeReading.SeekFrame(2), 2));
+			Assert::IsTrue(matches(smokeReading.SeekFrame(2), 2));
+			Assert::IsTrue(matches(smokeReading.SeekFrame(6), 6));
+
+			//reading past the last frame starts again
+			Assert::IsTrue(matches(smokeReading.ReadNextFrame(), 0));
+			Assert::IsTrue(matches(smokeReading.ReadNextFrame(), 1));
+			Assert::AreEqual(1, smokeReading.GetCurrentFrame());
+
+			smokeReading.StopRead();
+			delete(smoke);
+		}
+
+		//check keyframes are written every K frames and frames decode from them on separate threads
+		TEST_METHOD(Test6_Keyframes) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			std::vector<std::vector<float>> frames;
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest3", smoke->GetGridWidth(), smoke->mCurrentDensity, 8, 3);
+			frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+
+			smoke->AddDensity(15, 15, 15, 100.0f);
+			for (int i = 0; i < 8; i++) {
+				smoke->Update(0.1f);
+				smokeSaving.AddFrame(smoke->mCurrentDensity);
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			}
+			smokeSaving.StopWrite();
+
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest3");
+
+			//frames 0, 3 and 6 are keyframes, listed in the trailer
+			Assert::AreEqual(3, smokeReading.GetKeyframeInterval());
+			Assert::IsTrue(smokeReading.GetKeyframeOffsets().size() == 3);
+			Assert::AreEqual(smokeReading.GetFrameOffset(6), smokeReading.GetKeyframeOffsets()[2]);
+			Assert::IsTrue(smokeReading.IsKeyframe(3) && !smokeReading.IsKeyframe(4));
+
+			//each thread decodes its own range of frames, starting from a keyframe
+			bool passed[2] = { true, true };
+			auto decodeRange = [&](int start, int end, bool& rangePassed) {
+				std::vector<float> grid(gridTotal);
+				for (int frame = start; frame <= end; frame++) {
+					smokeReading.DecodeFrame(frame, grid.data(), frame - 1);
+					for (int i = 0; i < gridTotal; i++) {
+						if (abs(grid[i] - frames[frame][i]) > 0.00001f) { rangePassed = false; }
+					}
+				}
+			};
+			std::thread first(decodeRange, 3, 5, std::ref(passed[0]));
+			std::thread second(decodeRange, 6, 8, std::ref(passed[1]));
+			first.join(); second.join();
+
+			Assert::IsTrue(passed[0]);
+			Assert::IsTrue(passed[1]);
+
+			smokeReading.StopRead();
+			delete(smoke);
+		}
+
+		TEST_METHOD(Test7_BrickFrames) {
+			Smoke* smoke = new Smoke(32, Smoke::SparseStorage);
+			int gridTotal = smoke->mTotalCellCount;
+			BrickGrid* bricks = smoke->GetDensityBricks();
+
+			std::vector<std::vector<float>> frames;
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest4", smoke->GetGridWidth(), smoke->mCurrentDensity, 8, 3);
+			Assert::IsTrue(smokeSaving.MatchesBrickLayout(*bricks));
+			frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+
+			//written straight from the bricks
+			smoke->AddDensity(15, 15, 15, 100.0f);
+			for (int i = 0; i < 5; i++) {
+				smoke->Update(0.1f);
+				smokeSaving.AddFrame(*bricks);
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			}
+			smokeSaving.StopWrite();
+
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest4");
+
+			//decoding into bricks and into a dense grid gives the simulated frames
+			BrickGrid decodedBricks(smoke->GetGridWidth() - 2);
+			std::vector<float> brickGrid(gridTotal), grid(gridTotal);
+			bool passed = true;
+			for (int frame = 0; frame < (int)frames.size(); frame++) {
+				smokeReading.DecodeFrame(frame, decodedBricks, frame - 1);
+				smokeReading.DecodeFrame(frame, grid.data(), frame - 1);
+				decodedBricks.CopyToDense(brickGrid.data());
+
+				for (int i = 0; i < gridTotal; i++) {
+					if (abs(grid[i] - frames[frame][i]) > 0.00001f) { passed = false; }
+					if (abs(brickGrid[i] - frames[frame][i]) > 0.00001f) { passed = false; }
+				}
+			}
+			Assert::IsTrue(passed);
+
+			smokeReading.StopRead();
+			delete(smoke);
+		}
+
+		TEST_METHOD(Test8_ChangedBricks) {
+			//both storage types flag the bricks they change
+			Smoke::GridStorage storages[2] = { Smoke::DenseStorage, Smoke::SparseStorage };
+			for (Smoke::GridStorage storage : storages) {
+				Smoke* smoke = new Smoke(64, storage);
+				int gridTotal = smoke->mTotalCellCount;
+
+				std::vector<std::vector<float>> frames;
+				ReadWriteSmoke smokeSaving{};
+				smokeSaving.WriteInit("IntegrationTest5", smoke->GetGridWidth(), smoke->mCurrentDensity, 8, 4);
+				Assert::IsTrue(smokeSaving.UsesBrickBlocks());
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+
+				//smoke in one corner only changes the bricks around it
+				int flaggedBricks = 0;
+				for (int i = 0; i < 6; i++) {
+					smoke->AddDensity(12, 12, 12, 50.0f, 4);
+					smoke->Update(0.1f);
+
+					const uint64_t* changed = smoke->GetChangedBricks();
+					for (int word = 0; word < 8; word++) { flaggedBricks += (int)std::bitset<64>(changed[word]).count(); }
+
+					smokeSaving.AddFrame(smoke->mCurrentDensity, changed);
+					smoke->ClearChangedBricks();
+					frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+				}
+				smokeSaving.StopWrite();
+				Assert::IsTrue(flaggedBricks > 0 && flaggedBricks < 6 * 512 / 2);
+
+				//every frame reads back the same as it was simulated
+				ReadWriteSmoke smokeReading{};
+				smokeReading.ReadInit("IntegrationTest5");
+				std::vector<float> grid(gridTotal);
+				bool passed = true;
+				for (int frame = 0; frame < (int)frames.size(); frame++) {
+					smokeReading.DecodeFrame(frame, grid.data(), frame - 1);
+					for (int i = 0; i < gridTotal; i++) {
+						if (abs(grid[i] - frames[frame][i]) > 0.00001f) { passed = false; }
+					}
+				}
+				Assert::IsTrue(passed);
+
+				smokeReading.StopRead();
+				delete(smoke);
+			}
+		}
+
+		TEST_METHOD(Test9_QuantisedBlocks) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			std::vector<std::vector<float>> frames;
+			frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			smoke->AddDensity(15, 15, 15, 100.0f, 4);
+			for (int i = 0; i < 4; i++) {
+				smoke->Update(0.1f);
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			}
+
+			//largest range of any block, no value can be off by more than half a step of it
+			float range = 0;
+			for (auto& frame : frames) { range = std::max(range, *std::max_element(frame.begin(), frame.end())); }
+
+			ReadWriteSmoke::BlockEncoding encodings[2] = { ReadWriteSmoke::Quantised16Blocks, ReadWriteSmoke::Quantised8Blocks };
+			float steps[2] = { 65535.0f, 255.0f };
+			for (int e = 0; e < 2; e++) {
+				ReadWriteSmoke smokeSaving{};
+				smokeSaving.WriteInit("IntegrationTest6", smoke->GetGridWidth(), frames[0].data(), 8, 2, encodings[e]);
+				for (size_t f = 1; f < frames.size(); f++) { smokeSaving.AddFrame(frames[f].data()); }
+				smokeSaving.StopWrite();
+
+				ReadWriteSmoke smokeReading{};
+				smokeReading.ReadInit("IntegrationTest6");
+				Assert::IsTrue(smokeReading.GetBlockEncoding() == encodings[e]);
+				Assert::AreEqual(8 + 512 * (2 - e), smokeReading.GetEncodedBlockSize());
+
+				std::vector<float> grid(gridTotal);
+				float maxError = 0;
+				for (int frame = 0; frame < (int)frames.size(); frame++) {
+					smokeReading.DecodeFrame(frame, grid.data(), frame - 1);
+					for (int i = 0; i < gridTotal; i++) { maxError = std::max(maxError, abs(grid[i] - frames[frame][i])); }
+				}
+				Assert::IsTrue(maxError <= range / steps[e] * 0.5f + 0.00001f);
+
+				smokeReading.StopRead();
+			}
+
+			delete(smoke);
+		}
+
+		TEST_METHOD(Test10_CompressedBlocks) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			std::vector<std::vector<float>> frames;
+			frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			smoke->AddDensity(15, 15, 15, 100.0f, 4);
+			for (int i = 0; i < 4; i++) {
+				smoke->Update(0.1f);
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			}
+
+			//the same frames with and without compression
+			uint64_t fileSizes[2] = {};
+			std::vector<std::vector<float>> uncompressedFrames;
+			for (int compress = 0; compress < 2; compress++) {
+				ReadWriteSmoke smokeSaving{};
+				smokeSaving.WriteInit("IntegrationTest7", smoke->GetGridWidth(), frames[0].data(), 8, 3, ReadWriteSmoke::FloatBlocks, compress == 1);
+				for (size_t f = 1; f < frames.size(); f++) { smokeSaving.AddFrame(frames[f].data()); }
+				smokeSaving.StopWrite();
+
+				ReadWriteSmoke smokeReading{};
+				smokeReading.ReadInit("IntegrationTest7");
+				Assert::AreEqual(compress == 1, smokeReading.HasCompressedBlocks());
+				fileSizes[compress] = smokeReading.GetFrameOffset((int)frames.size() - 1);
+
+				//compression is lossless, through both seeking and decoding the frames read back exactly the same
+				std::vector<float> grid(gridTotal);
+				bool passed = true;
+				for (int frame = 0; frame < (int)frames.size(); frame++) {
+					float* seeked = smokeReading.SeekFrame(frame);
+					smokeReading.DecodeFrame(frame, grid.data(), frame - 1);
+					if (compress == 0) { uncompressedFrames.emplace_back(grid); }
+
+					for (int i = 0; i < gridTotal; i++) {
+						if (grid[i] != uncompressedFrames[frame][i] || seeked[i] != uncompressedFrames[frame][i]) { passed = false; }
+					}
+				}
+				Assert::IsTrue(passed);
+
+				smokeReading.StopRead();
+			}
+			//empty blocks take no space either way, so compression only shrinks the blocks holding smoke
+			Assert::IsTrue(fileSizes[1] < fileSizes[0] * 3 / 4);
+
+			//noise doesn't compress, so it's stored as it is
+			std::vector<char> noise(2048), compressed(2048), decompressed(2048), scratch(2048);
+			std::mt19937 random(5);
+			for (char& byte : noise) { byte = (char)random(); }
+			int compressedSize = BlockCodec::Compress(noise.data(), 2048, 4, 0, compressed.data(), scratch.data());
+			Assert::AreEqual(2048, compressedSize);
+			Assert::IsTrue(BlockCodec::Decompress(compressed.data(), compressedSize, 2048, 4, 0, decompressed.data(), scratch.data()));
+			Assert::IsTrue(noise == decompressed);
+
+			delete(smoke);
+		}
+
+		TEST_METHOD(Test11_BlockModes) {
+			//4 blocks along each side, one header word
+			const int width = 32, gridTotal = width * width * width;
+			auto setBlock = [&](std::vector<float>& grid, int blockX, float value, bool varying) {
+				for (int z = 0; z < 8; z++) for (int y = 0; y < 8; y++) for (int x = 0; x < 8; x++) {
+					grid[blockX * 8 + x + width * y + width * width * z] = (varying) ? value + x + y * 0.5f + z * 0.25f : value;
+				}
+			};
+
+			//a varying block becomes empty, an empty block becomes constant and a constant block starts varying
+			std::vector<std::vector<float>> frames(3, std::vector<float>(gridTotal));
+			setBlock(frames[0], 0, 2.5f, false); setBlock(frames[0], 1, 1.0f, true);
+			setBlock(frames[1], 0, 2.5f, false); setBlock(frames[1], 2, 7.0f, false);
+			setBlock(frames[2], 0, 3.0f, true); setBlock(frames[2], 2, 7.0f, false);
+
+			for (int compress = 0; compress < 2; compress++) {
+				ReadWriteSmoke smokeSaving{};
+				smokeSaving.WriteInit("IntegrationTest8", width, frames[0].data(), 8, 0, ReadWriteSmoke::FloatBlocks, compress == 1);
+				for (size_t f = 1; f < frames.size(); f++) { smokeSaving.AddFrame(frames[f].data()); }
+				smokeSaving.StopWrite();
+
+				ReadWriteSmoke smokeReading{};
+				smokeReading.ReadInit("IntegrationTest8");
+				Assert::IsTrue(smokeReading.HasBlockModes());
+				Assert::IsTrue(smokeReading.HasHeaderSummary());
+				Assert::AreEqual(4, smokeReading.GetFrameHeaderWords());
+
+				//the first frame only stores the constant value and the varying block, the empty blocks take no space
+				if (compress == 0) { Assert::AreEqual((uint64_t)(32 + 4 * 8 + 4 + 512 * 4), smokeReading.GetFrameOffset(1)); }
+
+				//the second frame only stores the new constant value
+				uint64_t secondFrameSize = smokeReading.GetFrameOffset(2) - smokeReading.GetFrameOffset(1);
+				Assert::AreEqual((uint64_t)(4 * 8 + 2 * 4 * compress + 4), secondFrameSize);
+
+				//every block reads back exactly, into a dense grid and into bricks
+				BrickGrid decodedBricks(width - 2);
+				std::vector<float> grid(gridTotal), brickGrid(gridTotal);
+				bool passed = true;
+				for (int frame = 0; frame < (int)frames.size(); frame++) {
+					float* seeked = smokeReading.SeekFrame(frame);
+					smokeReading.DecodeFrame(frame, grid.data(), frame - 1);
+					smokeReading.DecodeFrame(frame, decodedBricks, frame - 1);
+					decodedBricks.CopyToDense(brickGrid.data());
+
+					for (int i = 0; i < gridTotal; i++) {
+						if (seeked[i] != frames[frame][i] || grid[i] != frames[frame][i] || brickGrid[i] != frames[frame][i]) { passed = false; }
+					}
+				}
+				Assert::IsTrue(passed);
+
+				smokeReading.StopRead();
+			}
+		}
+
+		TEST_METHOD(Test12_PrefetchedPlayback) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest9", smoke->GetGridWidth(), smoke->mCurrentDensity, 8, 3);
+			smoke->AddDensity(15, 15, 15, 100.0f, 4);
+			for (int i = 0; i < 7; i++) {
+				smoke->Update(0.1f);
+				smokeSaving.AddFrame(smoke->mCurrentDensity);
+			}
+			smokeSaving.StopWrite();
+
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest9");
+			int frameCount = smokeReading.GetStoredFrameCount();
+
+			//the first frame is there straight away, then every frame in order, looping back round twice
+			FramePrefetcher prefetcher(&smokeReading, 3);
+			Assert::AreEqual(0, prefetcher.GetCurrentFrame());
+
+			std::vector<float> grid(gridTotal);
+			bool passed = true;
+			for (int i = 1; i <= frameCount * 2; i++) {
+				while (prefetcher.GetReadyFrameCount() == 0) { std::this_thread::yield(); }
+				float* density = prefetcher.GetNextFrame();
+
+				int frame = i % frameCount;
+				if (prefetcher.GetCurrentFrame() != frame) { passed = false; }
+
+				smokeReading.DecodeFrame(frame, grid.data());
+				for (int c = 0; c < gridTotal; c++) {
+					if (density[c] != grid[c]) { passed = false; }
+				}
+			}
+			Assert::IsTrue(passed);
+
+			//fills up to the frames asked for, and never goes past them
+			while (prefetcher.GetReadyFrameCount() < 3) { std::this_thread::yield(); }
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			Assert::AreEqual(3, prefetcher.GetReadyFrameCount());
+
+			//with nothing ready the same frame is kept
+			int missed = prefetcher.GetMissedFrameCount();
+			for (int i = 0; i < 3; i++) { prefetcher.GetNextFrame(); }
+			int current = prefetcher.GetCurrentFrame();
+			Assert::AreEqual(missed, prefetcher.GetMissedFrameCount());
+			Assert::AreEqual((frameCount * 2 + 3) % frameCount, current);
+
+			delete(smoke);
+		}
+
+		TEST_METHOD(Test13_PipelinedWrite) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			std::vector<std::vector<float>> frames;
+			std::vector<std::vector<uint64_t>> masks;
+			std::vector<float> start(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			smoke->ClearChangedBricks();
+			smoke->AddDensity(15, 15, 15, 100.0f, 4);
+			for (int i = 0; i < 8; i++) {
+				smoke->Update(0.1f);
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+				const uint64_t* mask = smoke->GetChangedBricks();
+				masks.emplace_back(mask, mask + (gridTotal / 512 + 63) / 64);
+				smoke->ClearChangedBricks();
+			}
+
+			//written straight away, then through the pipeline diffing and with masks, with a queue shorter than the frames
+			for (int mode = 0; mode < 3; mode++) {
+				ReadWriteSmoke smokeSaving{};
+				smokeSaving.WriteInit("IntegrationTest10-" + std::to_string(mode), smoke->GetGridWidth(), start.data(), 8, 3,
+					ReadWriteSmoke::FloatBlocks, true);
+
+				if (mode == 0) {
+					for (auto& frame : frames) { smokeSaving.AddFrame(frame.data()); }
+				}
+				else {
+					PipelinedWriter pipeline(&smokeSaving, 2);
+					for (size_t f = 0; f < frames.size(); f++) { pipeline.AddFrame(frames[f].data(), (mode == 2) ? masks[f].data() : nullptr); }
+					pipeline.Finish();
+
+					for (int s = 0; s < PipelinedWriter::StageCount; s++) {
+						Assert::AreEqual((int)frames.size(), pipeline.GetStageStats((PipelinedWriter::Stage)s).frames);
+					}
+					Assert::IsTrue(pipeline.GetStageStats(PipelinedWriter::WriteStage).bytes > 0);
+				}
+				smokeSaving.StopWrite();
+			}
+
+			//every way writes the same frames, diffing exactly the same file as writing straight away
+			ReadWriteSmoke direct{}, piped{}, masked{};
+			direct.ReadInit("IntegrationTest10-0");
+			piped.ReadInit("IntegrationTest10-1");
+			masked.ReadInit("IntegrationTest10-2");
+			Assert::AreEqual((int)frames.size() + 1, piped.GetStoredFrameCount());
+			Assert::AreEqual((int)frames.size() + 1, masked.GetStoredFrameCount());
+			Assert::IsTrue(direct.GetKeyframeOffsets() == piped.GetKeyframeOffsets());
+
+			std::vector<float> directGrid(gridTotal), pipedGrid(gridTotal), maskedGrid(gridTotal);
+			bool passed = true;
+			for (int frame = 0; frame < direct.GetStoredFrameCount(); frame++) {
+				if (direct.GetFrameOffset(frame) != piped.GetFrameOffset(frame)) { passed = false; }
+
+				direct.DecodeFrame(frame, directGrid.data(), frame - 1);
+				piped.DecodeFrame(frame, pipedGrid.data(), frame - 1);
+				masked.DecodeFrame(frame, maskedGrid.data(), frame - 1);
+				for (int i = 0; i < gridTotal; i++) {
+					if (pipedGrid[i] != directGrid[i]) { passed = false; }
+					if (frame > 0 && abs(maskedGrid[i] - frames[frame - 1][i]) > 0.00001f) { passed = false; }
+				}
+			}
+			Assert::IsTrue(passed);
+
+			direct.StopRead(); piped.StopRead(); masked.StopRead();
+			delete(smoke);
+		}
+
+		TEST_METHOD(Test14_SmokePlayback) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest11", smoke->GetGridWidth(), smoke->mCurrentDensity, 8, 3);
+			smoke->AddDensity(15, 15, 15, 100.0f, 4);
+			for (int i = 0; i < 5; i++) {
+				smoke->Update(0.1f);
+				smokeSaving.AddFrame(smoke->mCurrentDensity);
+			}
+			smokeSaving.StopWrite();
+
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest11");
+			std::vector<float> grid(gridTotal);
+
+			//both ways of reading play every frame in order, looping back round
+			for (int prefetch = 0; prefetch < 2; prefetch++) {
+				SmokePlayback playback("IntegrationTest11", prefetch * 2);
+				Assert::AreEqual(smoke->GetGridWidth(), playback.GetGridWidth());
+				Assert::AreEqual(0, playback.GetCurrentFrame());
+
+				//without prefetching only one grid is decoded into, far less than a solver needs
+				if (prefetch == 0) { Assert::IsTrue(playback.GetMemoryUsage() * 10 < smoke->GetGridMemoryUsage()); }
+
+				bool passed = true;
+				for (int i = 1; i <= playback.GetFrameCount() + 2; i++) {
+					float* density = playback.ReadNextFrame();
+					while (playback.GetCurrentFrame() != i % playback.GetFrameCount()) {
+						std::this_thread::yield();
+						density = playback.ReadNextFrame();
+					}
+
+					smokeReading.DecodeFrame(i % playback.GetFrameCount(), grid.data());
+					for (int c = 0; c < gridTotal; c++) {
+						if (density[c] != grid[c]) { passed = false; }
+					}
+				}
+				Assert::IsTrue(passed);
+			}
+
+			//a saved simulation opened as a smoke reads into its own density
+			int gridSize = 0;
+			Smoke* savedSmoke = Smoke::OpenSavedSimulation("IntegrationTest11", gridSize, 2);
+			float* density = savedSmoke->mCurrentDensity;
+			for (int i = 0; i < 3; i++) { savedSmoke->ReadNextSimulationFrame(); }
+			Assert::IsTrue(density == savedSmoke->mCurrentDensity);
+			delete(savedSmoke);
+
+			smokeReading.StopRead();
+			delete(smoke);
+		}
+
+		TEST_METHOD(Test15_LoopPlayback) {
+			Smoke* smoke = new Smoke(32);
+			int gridTotal = smoke->mTotalCellCount;
+
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest12", smoke->GetGridWidth(), smoke->mCurrentDensity, 8, 4);
+			smoke->AddDensity(15, 15, 15, 100.0f, 4);
+			for (int i = 0; i < 9; i++) {
+				smoke->Update(0.1f);
+				smokeSaving.AddFrame(smoke->mCurrentDensity);
+			}
+			smokeSaving.StopWrite();
+
+			//the loop mode can be set before or after opening the file
+			ReadWriteSmoke fromKeyframe{}, fromSnapshot{};
+			fromKeyframe.ReadInit("IntegrationTest12");
+			fromSnapshot.SetLoopMode(ReadWriteSmoke::LoopFromSnapshot);
+			fromSnapshot.ReadInit("IntegrationTest12");
+			Assert::IsTrue(fromSnapshot.GetLoopMode() == ReadWriteSmoke::LoopFromSnapshot);
+
+			//looping round three times reads the same frames into the same grid, and seeking back does too
+			int frameCount = fromSnapshot.GetStoredFrameCount();
+			float* grid = fromSnapshot.ReadNextFrame();
+			bool passed = true;
+			for (int i = 0; i < frameCount * 3; i++) {
+				float* expected = fromKeyframe.ReadNextFrame();
+				float* density = (i == 0) ? grid : fromSnapshot.ReadNextFrame();
+				if (density != grid || fromSnapshot.GetCurrentFrame() != fromKeyframe.GetCurrentFrame()) { passed = false; }
+
+				for (int c = 0; c < gridTotal; c++) {
+					if (density[c] != expected[c]) { passed = false; }
+				}
+			}
+
+			int seeks[4] = { 7, 2, 0, 5 };
+			std::vector<float> decoded(gridTotal);
+			for (int frame : seeks) {
+				float* density = fromSnapshot.SeekFrame(frame);
+				float* expected = fromKeyframe.SeekFrame(frame);
+				fromSnapshot.DecodeFrame(frame, decoded.data());
+
+				for (int c = 0; c < gridTotal; c++) {
+					if (density[c] != expected[c] || decoded[c] != expected[c]) { passed = false; }
+				}
+			}
+			Assert::IsTrue(passed);
+
+			fromKeyframe.StopRead();
+			fromSnapshot.StopRead();
+			delete(smoke);
+		}
+
+		//grids that aren't a multiple of the block width pad their edge blocks, and read back through the frame offset table
+		TEST_METHOD(Test16_PaddedBlocks) {
+			int gridWidths[2] = { 30, 32 };
+			int blockWidths[2] = { 8, 7 };
+
+			for (int run = 0; run < 2; run++) {
+				Smoke* smoke = new Smoke(gridWidths[run]);
+				int gridTotal = smoke->mTotalCellCount;
+
+				std::vector<std::vector<float>> frames;
+				ReadWriteSmoke smokeSaving{};
+				smokeSaving.WriteInit("IntegrationTest13", smoke->GetGridWidth(), smoke->mCurrentDensity, blockWidths[run], 3);
+				Assert::AreEqual(run == 0, smokeSaving.UsesBrickBlocks());
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+
+				//smoke against the far edges, so the padded blocks change
+				for (int i = 0; i < 7; i++) {
+					smoke->AddDensity(gridWidths[run] - 3, gridWidths[run] - 3, gridWidths[run] - 3, 50.0f, 2);
+					smoke->Update(0.1f);
+
+					if (run == 0) { smokeSaving.AddFrame(smoke->mCurrentDensity, smoke->GetChangedBricks()); }
+					else { smokeSaving.AddFrame(smoke->mCurrentDensity); }
+					smoke->ClearChangedBricks();
+					frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+				}
+				smokeSaving.StopWrite();
+
+				ReadWriteSmoke smokeReading{};
+				smokeReading.ReadInit("IntegrationTest13");
+				Assert::IsTrue(smokeReading.HasFrameOffsetTable());
+				Assert::AreEqual((int)frames.size(), smokeReading.GetStoredFrameCount());
+
+				//every frame reads back in order, and seeking to each one matches
+				bool passed = true;
+				for (int frame = 0; frame < (int)frames.size(); frame++) {
+					float* density = smokeReading.ReadNextFrame();
+					for (int i = 0; i < gridTotal; i++) {
+						if (abs(density[i] - frames[frame][i]) > 0.00001f) { passed = false; }
+					}
+				}
+				for (int frame = (int)frames.size() - 1; frame >= 0; frame -= 2) {
+					float* density = smokeReading.SeekFrame(frame);
+					for (int i = 0; i < gridTotal; i++) {
+						if (abs(density[i] - frames[frame][i]) > 0.00001f) { passed = false; }
+					}
+				}
+				Assert::IsTrue(passed);
+
+				smokeReading.StopRead();
+				delete(smoke);
+			}
+		}
+
+		//frame headers are decoded from their flagged bits only, skipping unchanged frames from the summary
+		TEST_METHOD(Test17_HeaderSummary) {
+			Smoke* smoke = new Smoke(64);
+			int gridTotal = smoke->mTotalCellCount;
+
+			//4 wide blocks, so the header has 64 words of flagged bits and 1 of summary
+			std::vector<std::vector<float>> frames;
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest14", smoke->GetGridWidth(), smoke->mCurrentDensity, 4);
+			frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+
+			//moving smoke, then still frames which store no blocks, then moving again
+			for (int i = 0; i < 12; i++) {
+				if (i < 4 || i >= 8) {
+					smoke->AddDensity(20, 20, 20, 50.0f, 3);
+					smoke->Update(0.1f);
+				}
+				smokeSaving.AddFrame(smoke->mCurrentDensity);
+				frames.emplace_back(smoke->mCurrentDensity, smoke->mCurrentDensity + gridTotal);
+			}
+
+			//a header encoded by the writer has its summary, so it decodes back to the same blocks
+			std::vector<int> encodedIds = { 1, 64, 200, 4095 };
+			uint64_t* encoded = smokeSaving.EncodeFrameHeader(encodedIds);
+			Assert::IsTrue(encodedIds == smokeSaving.DecodeFrameHeader(encoded));
+			free(encoded);
+
+			smokeSaving.StopWrite();
+
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest14");
+			Assert::IsTrue(smokeReading.HasHeaderSummary());
+			Assert::AreEqual(1, smokeReading.GetHeaderSummaryWords());
+
+			//a still frame is only its header
+			uint64_t headerBytes = smokeReading.GetFrameHeaderWords() * sizeof(uint64_t);
+			Assert::AreEqual(headerBytes, smokeReading.GetFrameOffset(7) - smokeReading.GetFrameOffset(6));
+
+			//flagged bits come back lowest first, from only the words the summary marks
+			std::vector<uint64_t> header(smokeReading.GetFrameHeaderWords(), 0);
+			header[0] = 0x8000000000000001ULL;
+			header[5] = 1ULL << 17;
+			header[63] = 1ULL << 63;
+			header.back() = 1ULL | (1ULL << 5) | (1ULL << 63);
+			std::vector<int> blockIds = { 99 };
+			Assert::AreEqual(4, smokeReading.DecodeFrameHeader(header.data(), blockIds));
+			int expected[4] = { 0, 63, 5 * 64 + 17, 63 * 64 + 63 };
+			for (int i = 0; i < 4; i++) { Assert::AreEqual(expected[i], blockIds[i]); }
+			Assert::IsTrue(blockIds == smokeReading.DecodeFrameHeader(header.data()));
+
+			//every frame reads back, walking back over the still frames when seeking
+			bool passed = true;
+			for (int frame = 0; frame < (int)frames.size(); frame++) {
+				float* density = smokeReading.ReadNextFrame();
+				for (int i = 0; i < gridTotal; i++) {
+					if (abs(density[i] - frames[frame][i]) > 0.00001f) { passed = false; }
+				}
+			}
+			int seeks[3] = { 6, 12, 2 };
+			for (int frame : seeks) {
+				float* density = smokeReading.SeekFrame(frame);
+				for (int i = 0; i < gridTotal; i++) {
+					if (abs(density[i] - frames[frame][i]) > 0.00001f) { passed = false; }
+				}
+			}
+			Assert::IsTrue(passed);
+
+			smokeReading.StopRead();
+			delete(smoke);
+		}
+
+		//a corrupt compressed block throws from the reading thread, even when the blocks are decoded across threads
+		TEST_METHOD(Test18_CorruptBlock) {
+			int width = 32;
+			std::vector<float> start((size_t)width * width * width);
+			for (size_t i = 0; i < start.size(); i++) { start[i] = (float)(i % 8); }
+
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest15", width, start.data(), 8, 0, ReadWriteSmoke::FloatBlocks, true);
+			smokeSaving.AddFrame(start.data());
+			smokeSaving.StopWrite();
+
+			//find where the first frame's blocks are, after its header and length table
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest15");
+			uint64_t blocksStart = 32 + smokeReading.GetFrameHeaderWords() * sizeof(uint64_t) + 64 * sizeof(uint32_t);
+			uint64_t blocksEnd = smokeReading.GetFrameOffset(1);
+			smokeReading.StopRead();
+
+			std::fstream file("../../Saved-Smoke/IntegrationTest15.dat", std::ios_base::binary | std::ios_base::out | std::ios_base::in);
+			if (!file) { file.open("../../../Saved-Smoke/IntegrationTest15.dat", std::ios_base::binary | std::ios_base::out | std::ios_base::in); }
+			Assert::IsTrue((bool)file);
+			std::vector<char> garbage(blocksEnd - blocksStart, (char)0xFF);
+			file.seekp(blocksStart);
+			file.write(garbage.data(), garbage.size());
+			file.close();
+
+			smokeReading.ReadInit("IntegrationTest15");
+			Assert::IsTrue(smokeReading.HasCompressedBlocks());
+			bool threw = false;
+			try { smokeReading.SeekFrame(0); }
+			catch (const std::runtime_error&) { threw = true; }
+			Assert::IsTrue(threw);
+
+			smokeReading.StopRead();
+		}
+
+		//a corrupt frame stops the prefetcher, and is thrown on the renderer's thread after the frames before it
+		TEST_METHOD(Test19_CorruptPrefetch) {
+			int width = 32;
+			std::vector<float> grid((size_t)width * width * width);
+
+			ReadWriteSmoke smokeSaving{};
+			smokeSaving.WriteInit("IntegrationTest16", width, grid.data(), 8, 0, ReadWriteSmoke::FloatBlocks, true);
+			for (int frame = 1; frame <= 3; frame++) {
+				for (size_t i = 0; i < grid.size(); i++) { grid[i] = (float)((i + frame) % 8); }
+				smokeSaving.AddFrame(grid.data());
+			}
+			smokeSaving.StopWrite();
+
+			//overwrite the back half of frame 2's blocks, leaving its header and length table
+			ReadWriteSmoke smokeReading{};
+			smokeReading.ReadInit("IntegrationTest16");
+			uint64_t blocksEnd = smokeReading.GetFrameOffset(3);
+			uint64_t blocksStart = (smokeReading.GetFrameOffset(2) + blocksEnd) / 2;
+			smokeReading.StopRead();
+
+			std::fstream file("../../Saved-Smoke/IntegrationTest16.dat", std::ios_base::binary | std::ios_base::out | std::ios_base::in);
+			if (!file) { file.open("../../../Saved-Smoke/IntegrationTest16.dat", std::ios_base::binary | std::ios_base::out | std::ios_base::in); }
+			Assert::IsTrue((bool)file);
+			std::vector<char> garbage(blocksEnd - blocksStart, (char)0xFF);
+			file.seekp(blocksStart);
+			file.write(garbage.data(), garbage.size());
+			file.close();
+
+			smokeReading.ReadInit("IntegrationTest16");
+			FramePrefetcher* prefetcher = new FramePrefetcher(&smokeReading, 2);
+
+			//frame 1 is shown, then the error instead of frame 2
+			bool threw = false;
+			int lastFrame = 0;
+			for (int i = 0; i < 2000 && !threw; i++) {
+				try {
+					prefetcher->GetNextFrame();
+					lastFrame = prefetcher->GetCurrentFrame();
+				}
+				catch (const std::runtime_error&) { threw = true; }
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			Assert::IsTrue(threw);
+			Assert::AreEqual(1, lastFrame);
+
+			delete(prefetcher);
+			smokeReading.StopRead();
+		}
 	};
 }
\ No newline at end of file